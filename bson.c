@@ -171,25 +171,54 @@ void bson_set_oid_inc( int ( *func )( void ) ) {
     oid_inc_func = func;
 }
 
+/* Per-process random bytes for the middle of every ObjectId. Computed
+ * once; a racing thread that loses the CAS adopts the winner's value. */
+static int oid_fuzz = 0;
+static int oid_incr = 0;
+
+static int bson_oid_fuzz( void ) {
+    int fuzz = oid_fuzz;
+    FILE *f;
+
+    if( fuzz )
+        return fuzz;
+
+    if( oid_fuzz_func )
+        fuzz = oid_fuzz_func();
+    else if( ( f = fopen( "/dev/urandom", "rb" ) ) != NULL ) {
+        if( fread( &fuzz, sizeof( fuzz ), 1, f ) != 1 )
+            fuzz = 0;
+        fclose( f );
+    }
+    if( !fuzz )
+        fuzz = ( int )time( NULL ) ^ ( int )clock() ^ ( int )( size_t )&fuzz;
+    if( !fuzz )
+        fuzz = 1;
+
+    mongo_atomic_cas( &oid_fuzz, 0, fuzz );
+    return oid_fuzz;
+}
+
+/* The seconds part of an ObjectId. A coarse clock is read from the vDSO
+ * without a system call where the platform offers one. */
+static int bson_oid_time( void ) {
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec ts;
+    if( clock_gettime( CLOCK_REALTIME_COARSE, &ts ) == 0 )
+        return ( int )ts.tv_sec;
+#endif
+    return ( int )time( NULL );
+}
+
 void bson_oid_gen( bson_oid_t *oid ) {
-    static int incr = 0;
-    static int fuzz = 0;
     int i;
-    int t = time( NULL );
+    int t = bson_oid_time();
+    int fuzz = bson_oid_fuzz();
 
     if( oid_inc_func )
         i = oid_inc_func();
     else
-        i = incr++;
-
-    if ( !fuzz ) {
-        if ( oid_fuzz_func )
-            fuzz = oid_fuzz_func();
-        else {
-            srand( t );
-            fuzz = rand();
-        }
-    }
+        i = mongo_atomic_inc( &oid_incr );
 
     bson_big_endian32( &oid->ints[0], &t );
     oid->ints[1] = fuzz;
@@ -564,6 +593,133 @@ void bson_iterator_subiterator( const bson_iterator *i, bson_iterator *sub ) {
     bson_iterator_from_buffer( sub, bson_iterator_value( i ) );
 }
 
+/* Field extraction */
+
+static int bson_extractor_node_new( bson_extractor *x, const char *key, int len ) {
+    bson_extractor_node *n;
+
+    if( x->nnodes == x->alloc ) {
+        x->alloc = x->alloc ? x->alloc * 2 : 8;
+        x->nodes = ( bson_extractor_node * )bson_realloc( x->nodes,
+                   x->alloc * sizeof( bson_extractor_node ) );
+    }
+
+    n = &x->nodes[x->nnodes];
+    n->key = ( char * )bson_malloc( len + 1 );
+    memcpy( n->key, key, len );
+    n->key[len] = '\0';
+    n->field = -1;
+    n->child = -1;
+    n->sibling = -1;
+
+    return x->nnodes++;
+}
+
+void bson_extractor_init( bson_extractor *x ) {
+    x->nodes = NULL;
+    x->nnodes = 0;
+    x->alloc = 0;
+    x->nfields = 0;
+    bson_extractor_node_new( x, "", 0 );
+}
+
+int bson_extractor_add( bson_extractor *x, const char *path ) {
+    const char *end;
+    int node = 0;
+    int c, len;
+
+    for( ;; ) {
+        end = strchr( path, '.' );
+        len = end ? ( int )( end - path ) : ( int )strlen( path );
+
+        for( c = x->nodes[node].child; c >= 0; c = x->nodes[c].sibling ) {
+            if( strncmp( x->nodes[c].key, path, len ) == 0 && x->nodes[c].key[len] == '\0' )
+                break;
+        }
+        if( c < 0 ) {
+            c = bson_extractor_node_new( x, path, len );
+            x->nodes[c].sibling = x->nodes[node].child;
+            x->nodes[node].child = c;
+        }
+        node = c;
+
+        if( !end )
+            break;
+        path = end + 1;
+    }
+
+    if( x->nodes[node].field < 0 )
+        x->nodes[node].field = x->nfields++;
+
+    return x->nodes[node].field;
+}
+
+/* Match the elements of it against the children of node. Returns the
+ * number of fields still to be found. */
+static int bson_extractor_walk( const bson_extractor *x, int node, bson_iterator *it,
+                                bson_iterator *found, int left, int in_array ) {
+    const bson_extractor_node *n;
+    bson_iterator sub;
+    bson_type type;
+    const char *key;
+    int c;
+
+    while( left && ( type = bson_iterator_next( it ) ) ) {
+        key = bson_iterator_key( it );
+        for( c = x->nodes[node].child; c >= 0; c = x->nodes[c].sibling ) {
+            if( strcmp( x->nodes[c].key, key ) == 0 )
+                break;
+        }
+
+        if( c < 0 ) {
+            /* The elements of an array stand for the array itself */
+            if( in_array && type == BSON_OBJECT ) {
+                bson_iterator_subiterator( it, &sub );
+                left = bson_extractor_walk( x, node, &sub, found, left, 0 );
+            }
+            continue;
+        }
+
+        n = &x->nodes[c];
+        if( n->field >= 0 && bson_iterator_type( &found[n->field] ) == BSON_EOO ) {
+            found[n->field] = *it;
+            left--;
+        }
+        if( n->child >= 0 && ( type == BSON_OBJECT || type == BSON_ARRAY ) ) {
+            bson_iterator_subiterator( it, &sub );
+            left = bson_extractor_walk( x, c, &sub, found, left, type == BSON_ARRAY );
+        }
+    }
+
+    return left;
+}
+
+int bson_extractor_run( const bson_extractor *x, const char *data, bson_iterator *found ) {
+    static const char eoo = 0;
+    bson_iterator it;
+    int i;
+
+    for( i = 0; i < x->nfields; i++ ) {
+        found[i].cur = &eoo;
+        found[i].first = 0;
+    }
+
+    bson_iterator_from_buffer( &it, data );
+    return x->nfields - bson_extractor_walk( x, 0, &it, found, x->nfields, 0 );
+}
+
+void bson_extractor_destroy( bson_extractor *x ) {
+    int i;
+
+    for( i = 0; i < x->nnodes; i++ )
+        bson_free( x->nodes[i].key );
+    bson_free( x->nodes );
+    x->nodes = NULL;
+    x->nnodes = 0;
+    x->alloc = 0;
+    x->nfields = 0;
+}
+
 /* ----------------------------
    BUILDING
    ------------------------------ */
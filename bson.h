@@ -452,6 +452,63 @@ void bson_iterator_subobject( const bson_iterator *i, bson *sub );
  */
 void bson_iterator_subiterator( const bson_iterator *i, bson_iterator *sub );
 
+/* A field extractor pulls several fields, given as dotted paths, out of
+ * a document in a single pass. The paths are compiled into a trie of
+ * their components, so that subtrees holding none of them are skipped
+ * without being looked into, and the pass ends once all are found. As
+ * in queries, a path goes through the elements of the arrays on it.
+ */
+typedef struct {
+    char *key;         /**< Path component. */
+    int field;         /**< Index of the path ending here, or -1. */
+    int child;         /**< First child node, or -1. */
+    int sibling;       /**< Next node with the same parent, or -1. */
+} bson_extractor_node;
+
+typedef struct {
+    bson_extractor_node *nodes; /**< nodes[0] is the root. */
+    int nnodes;
+    int alloc;
+    int nfields;
+} bson_extractor;
+
+/**
+ * Initialize a field extractor with no fields.
+ *
+ * @param x the extractor.
+ */
+void bson_extractor_init( bson_extractor *x );
+
+/**
+ * Add a field to an extractor.
+ *
+ * @param x the extractor.
+ * @param path the field name, e.g., "auth.password".
+ *
+ * @return the index of the field in the iterators filled by
+ *     bson_extractor_run(). Adding a path twice returns the same index.
+ */
+int bson_extractor_add( bson_extractor *x, const char *path );
+
+/**
+ * Find the fields of an extractor in a document.
+ *
+ * @param x the extractor.
+ * @param data the document's data.
+ * @param found x->nfields iterators, set to the first occurrence of
+ *     each field; the type of those not found is BSON_EOO.
+ *
+ * @return the number of fields found.
+ */
+int bson_extractor_run( const bson_extractor *x, const char *data, bson_iterator *found );
+
+/**
+ * Release the resources held by an extractor.
+ *
+ * @param x the extractor.
+ */
+void bson_extractor_destroy( bson_extractor *x );
+
 /* str must be at least 24 hex chars + null byte */
 /**
  * Create a bson_oid_t from a string.
@@ -470,7 +527,9 @@ void bson_oid_from_string( bson_oid_t *oid, const char *str );
 void bson_oid_to_string( const bson_oid_t *oid, char *str );
 
 /**
- * Create a bson_oid object.
+ * Create a bson_oid object. Safe to call from several threads at once:
+ * the counter is incremented atomically and the per-process random
+ * bytes are generated only once.
  *
  * @param oid the destination for the newly created bson_oid_t.
  */
@@ -486,8 +545,8 @@ void bson_set_oid_fuzz( int ( *func )( void ) );
 
 /**
  * Set a function to be used to generate the incrementing part
- * of an object id (last four bytes). If you need thread-safety
- * in generating object ids, you should set this function.
+ * of an object id (last four bytes). The built-in counter is
+ * already thread-safe.
  *
  * @param func a pointer to a function that returns an int.
  */
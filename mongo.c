@@ -17,11 +17,14 @@
 
 #include "mongo.h"
 #include "md5.h"
+#include "encoding.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <sys/time.h>
 
 #ifdef _USE_LINUX_SYSTEM
 #include "platform/linux/net.h"
@@ -33,12 +36,10 @@
 
 static const int ZERO = 0;
 static const int ONE = 1;
+/* An id of 0 is replaced by the connection's next request id on send. */
 mongo_message *mongo_message_create( int len , int id , int responseTo , int op ) {
     mongo_message *mm = ( mongo_message * )bson_malloc( len );
 
-    if ( !id )
-        id = rand();
-
     /* native endian (converted on send) */
     mm->head.len = len;
     mm->head.id = id;
@@ -52,6 +53,26 @@ mongo_message *mongo_message_create( int len , int id , int responseTo , int op
 int mongo_message_send( mongo *conn, mongo_message *mm ) {
     mongo_header head; /* little endian */
     int res;
+
+    if( conn->flags & MONGO_CONN_BUSY ) {
+        conn->err = MONGO_CONN_BUSY_ERROR;
+        bson_free( mm );
+        return MONGO_ERROR;
+    }
+
+    /* Each request starts with a clean error state, so conn->err always
+     * describes the operation that was issued last. */
+    conn->err = MONGO_CONN_SUCCESS;
+
+    /* Nothing has been written yet, so the connection stays usable. */
+    if( conn->deadline_ms && mongo_time_ms() >= conn->deadline_ms ) {
+        conn->err = MONGO_DEADLINE_EXCEEDED;
+        bson_free( mm );
+        return MONGO_ERROR;
+    }
+
+    if( !mm->head.id )
+        mm->head.id = mongo_atomic_inc( &conn->request_id );
     bson_little_endian32( &head.len, &mm->head.len );
     bson_little_endian32( &head.id, &mm->head.id );
     bson_little_endian32( &head.responseTo, &mm->head.responseTo );
@@ -73,22 +94,35 @@ int mongo_message_send( mongo *conn, mongo_message *mm ) {
     return MONGO_OK;
 }
 
-int mongo_read_response( mongo *conn, mongo_reply **reply ) {
+/* With reuse set the reply is read into conn->reply_buf, which is grown
+ * as needed and never freed before mongo_destroy(). */
+static int mongo_read_response_buf( mongo *conn, mongo_reply **reply, int reuse ) {
     mongo_header head; /* header from network */
     mongo_reply_fields fields; /* header from network */
     mongo_reply *out;  /* native endian */
     unsigned int len;
     int res;
 
-    mongo_read_socket( conn, &head, sizeof( head ) );
-    mongo_read_socket( conn, &fields, sizeof( fields ) );
+    if( mongo_read_socket( conn, &head, sizeof( head ) ) != MONGO_OK ||
+            mongo_read_socket( conn, &fields, sizeof( fields ) ) != MONGO_OK )
+        return MONGO_ERROR;
 
     bson_little_endian32( &len, &head.len );
 
-    if ( len < sizeof( head )+sizeof( fields ) || len > 64*1024*1024 )
-        return MONGO_READ_SIZE_ERROR;  /* most likely corruption */
+    if ( len < sizeof( head )+sizeof( fields ) || len > 64*1024*1024 ) {
+        conn->err = MONGO_READ_SIZE_ERROR;  /* most likely corruption */
+        return MONGO_ERROR;
+    }
 
-    out = ( mongo_reply * )bson_malloc( len );
+    if( ! reuse )
+        out = ( mongo_reply * )bson_malloc( len );
+    else {
+        if( ( int )len > conn->reply_buf_size ) {
+            conn->reply_buf = ( mongo_reply * )bson_realloc( conn->reply_buf, len );
+            conn->reply_buf_size = len;
+        }
+        out = conn->reply_buf;
+    }
 
     out->head.len = len;
     bson_little_endian32( &out->head.id, &head.id );
@@ -102,7 +136,8 @@ int mongo_read_response( mongo *conn, mongo_reply **reply ) {
 
     res = mongo_read_socket( conn, &out->objs, len-sizeof( head )-sizeof( fields ) );
     if( res != MONGO_OK ) {
-        bson_free( out );
+        if( ! reuse )
+            bson_free( out );
         return res;
     }
 
@@ -111,6 +146,10 @@ int mongo_read_response( mongo *conn, mongo_reply **reply ) {
     return MONGO_OK;
 }
 
+int mongo_read_response( mongo *conn, mongo_reply **reply ) {
+    return mongo_read_response_buf( conn, reply, 0 );
+}
+
 
 char *mongo_data_append( char *start , const void *data , int len ) {
     memcpy( start , data , len );
@@ -129,32 +168,245 @@ char *mongo_data_append64( char *start , const void *data ) {
 
 /* Connection API */
 
-static int mongo_check_is_master( mongo *conn ) {
-    bson out;
+/* Record the document and message size limits advertised by ismaster. */
+static void mongo_set_server_limits( mongo *conn, const bson *ismaster ) {
     bson_iterator it;
-    bson_bool_t ismaster = 0;
 
-    out.data = NULL;
+    conn->max_bson_size = MONGO_DEFAULT_MAX_BSON_SIZE;
+    if( bson_find( &it, ismaster, "maxBsonObjectSize" ) )
+        conn->max_bson_size = bson_iterator_int( &it );
 
-    if ( mongo_simple_int_command( conn, "admin", "ismaster", 1, &out ) == MONGO_OK ) {
-        if( bson_find( &it, &out, "ismaster" ) )
-            ismaster = bson_iterator_bool( &it );
-    } else {
+    conn->max_message_size = 2 * conn->max_bson_size;
+    if( bson_find( &it, ismaster, "maxMessageSizeBytes" ) )
+        conn->max_message_size = bson_iterator_int( &it );
+}
+
+static void digest2hex( mongo_md5_byte_t digest[16], char hex_digest[33] ) {
+    static const char hex[16] = {'0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f'};
+    int i;
+    for ( i=0; i<16; i++ ) {
+        hex_digest[2*i]     = hex[( digest[i] & 0xf0 ) >> 4];
+        hex_digest[2*i + 1] = hex[ digest[i] & 0x0f      ];
+    }
+    hex_digest[32] = '\0';
+}
+
+static void mongo_pass_digest( const char *user, const char *pass, char hex_digest[33] ) {
+    mongo_md5_state_t st;
+    mongo_md5_byte_t digest[16];
+
+    mongo_md5_init( &st );
+    mongo_md5_append( &st, ( const mongo_md5_byte_t * )user, strlen( user ) );
+    mongo_md5_append( &st, ( const mongo_md5_byte_t * )":mongo:", 7 );
+    mongo_md5_append( &st, ( const mongo_md5_byte_t * )pass, strlen( pass ) );
+    mongo_md5_finish( &st, digest );
+    digest2hex( digest, hex_digest );
+}
+
+void mongo_credentials_init( mongo_credentials *cred, const char *db,
+                             const char *user, const char *pass ) {
+    cred->db = ( char * )bson_malloc( strlen( db ) + 1 );
+    strcpy( cred->db, db );
+    cred->user = ( char * )bson_malloc( strlen( user ) + 1 );
+    strcpy( cred->user, user );
+    mongo_pass_digest( user, pass, cred->digest );
+}
+
+void mongo_credentials_destroy( mongo_credentials *cred ) {
+    bson_free( cred->db );
+    bson_free( cred->user );
+    cred->db = NULL;
+    cred->user = NULL;
+}
+
+void mongo_set_credentials( mongo *conn, const mongo_credentials *cred ) {
+    conn->cred = cred;
+}
+
+/* An OP_QUERY running cmd on db, ready for mongo_message_send( ). */
+static mongo_message *mongo_command_message( const char *db, const bson *cmd ) {
+    static const int MINUS_ONE = -1;
+    int sl = strlen( db );
+    mongo_message *mm = mongo_message_create( 16 + /* header */
+                        4 + /* options */
+                        sl + 5 + 1 + /* ns */
+                        4 + 4 + /* skip, return */
+                        bson_size( cmd ),
+                        0, 0, MONGO_OP_QUERY );
+    char *data = &mm->data;
+
+    data = mongo_data_append32( data, &ZERO );
+    data = mongo_data_append( data, db, sl );
+    data = mongo_data_append( data, ".$cmd", 6 );
+    data = mongo_data_append32( data, &ZERO );
+    data = mongo_data_append32( data, &MINUS_ONE );
+    mongo_data_append( data, cmd->data, bson_size( cmd ) );
+
+    return mm;
+}
+
+static int mongo_command_send( mongo *conn, const char *db, const char *cmdstr ) {
+    bson cmd;
+    int res;
+
+    bson_init( &cmd );
+    bson_append_int( &cmd, cmdstr, 1 );
+    bson_finish( &cmd );
+    res = mongo_message_send( conn, mongo_command_message( db, &cmd ) );
+    bson_destroy( &cmd );
+
+    return res;
+}
+
+/* Read the reply to a command. On success out points into *reply, which
+ * the caller must free in any case. */
+static int mongo_command_recv( mongo *conn, mongo_reply **reply, bson *out ) {
+    bson_iterator it;
+
+    *reply = NULL;
+    if( mongo_read_response( conn, reply ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( ( *reply )->fields.num < 1 ||
+            ( ( *reply )->fields.flag & MONGO_REPLY_QUERY_FAILURE ) ) {
+        conn->err = MONGO_COMMAND_FAILED;
         return MONGO_ERROR;
     }
 
-    bson_destroy( &out );
+    bson_init_data( out, &( *reply )->objs );
+    if( ! bson_find( &it, out, "ok" ) || ! bson_iterator_bool( &it ) ) {
+        conn->err = MONGO_COMMAND_FAILED;
+        return MONGO_ERROR;
+    }
 
-    if( ismaster )
-        return MONGO_OK;
-    else {
+    return MONGO_OK;
+}
+
+/* Second half of authentication, once getnonce has answered. */
+static int mongo_authenticate_nonce( mongo *conn, const mongo_credentials *cred,
+                                     const char *nonce ) {
+    mongo_md5_state_t st;
+    mongo_md5_byte_t digest[16];
+    char hex_digest[33];
+    mongo_reply *reply = NULL;
+    bson cmd;
+    bson out;
+    int res;
+
+    mongo_md5_init( &st );
+    mongo_md5_append( &st, ( const mongo_md5_byte_t * )nonce, strlen( nonce ) );
+    mongo_md5_append( &st, ( const mongo_md5_byte_t * )cred->user, strlen( cred->user ) );
+    mongo_md5_append( &st, ( const mongo_md5_byte_t * )cred->digest, 32 );
+    mongo_md5_finish( &st, digest );
+    digest2hex( digest, hex_digest );
+
+    bson_init( &cmd );
+    bson_append_int( &cmd, "authenticate", 1 );
+    bson_append_string( &cmd, "user", cred->user );
+    bson_append_string( &cmd, "nonce", nonce );
+    bson_append_string( &cmd, "key", hex_digest );
+    bson_finish( &cmd );
+
+    res = mongo_message_send( conn, mongo_command_message( cred->db, &cmd ) );
+    bson_destroy( &cmd );
+    if( res == MONGO_OK )
+        res = mongo_command_recv( conn, &reply, &out );
+    bson_free( reply );
+
+    return res;
+}
+
+static int mongo_authenticate( mongo *conn, const mongo_credentials *cred ) {
+    mongo_reply *reply;
+    bson_iterator it;
+    bson out;
+    int res;
+
+    if( mongo_command_send( conn, cred->db, "getnonce" ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    res = mongo_command_recv( conn, &reply, &out );
+    if( res == MONGO_OK ) {
+        if( bson_find( &it, &out, "nonce" ) == BSON_STRING )
+            res = mongo_authenticate_nonce( conn, cred, bson_iterator_string( &it ) );
+        else
+            res = MONGO_ERROR;
+    }
+    bson_free( reply );
+
+    return res;
+}
+
+/* Set up a freshly connected socket. ismaster and, when credentials are
+ * set, getnonce are sent back to back, so the handshake costs one round
+ * trip, or two with authentication. On I/O or authentication failure the
+ * socket is closed, since replies may still be in flight. */
+static int mongo_handshake( mongo *conn ) {
+    mongo_reply *reply = NULL;
+    bson_iterator it;
+    bson out;
+    bson_bool_t ismaster = 0;
+
+    if( mongo_command_send( conn, "admin", "ismaster" ) != MONGO_OK ||
+            ( conn->cred && mongo_command_send( conn, conn->cred->db, "getnonce" ) != MONGO_OK ) )
+        goto fail;
+
+    if( mongo_command_recv( conn, &reply, &out ) != MONGO_OK )
+        goto fail;
+    if( bson_find( &it, &out, "ismaster" ) )
+        ismaster = bson_iterator_bool( &it );
+    mongo_set_server_limits( conn, &out );
+    bson_free( reply );
+    reply = NULL;
+
+    if( conn->cred ) {
+        if( mongo_command_recv( conn, &reply, &out ) != MONGO_OK ||
+                bson_find( &it, &out, "nonce" ) != BSON_STRING ||
+                mongo_authenticate_nonce( conn, conn->cred, bson_iterator_string( &it ) ) != MONGO_OK )
+            goto fail;
+        bson_free( reply );
+        reply = NULL;
+    }
+
+    if( ! ismaster ) {
         conn->err = MONGO_CONN_NOT_MASTER;
         return MONGO_ERROR;
     }
+
+    return MONGO_OK;
+
+fail:
+    bson_free( reply );
+    mongo_disconnect( conn );
+    if( conn->err == MONGO_CONN_SUCCESS )
+        conn->err = MONGO_COMMAND_FAILED;
+    return MONGO_ERROR;
+}
+
+static int mongo_connect_primary( mongo *conn ) {
+    if( mongo_socket_connect( conn, conn->primary->host, conn->primary->port ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_handshake( conn );
+}
+
+int64_t mongo_time_ms( void ) {
+    struct timeval tv;
+
+    gettimeofday( &tv, NULL );
+    return ( int64_t )tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void mongo_set_deadline( mongo *conn, int64_t deadline_ms ) {
+    conn->deadline_ms = deadline_ms;
 }
 
 void mongo_init( mongo *conn ) {
     conn->replset = NULL;
+    conn->sock = 0;
+    conn->connected = 0;
+    conn->flags = 0;
+    conn->request_id = 0;
     conn->err = 0;
     conn->errstr = NULL;
     conn->lasterrcode = 0;
@@ -162,6 +414,15 @@ void mongo_init( mongo *conn ) {
 
     conn->conn_timeout_ms = 0;
     conn->op_timeout_ms = 0;
+    conn->deadline_ms = 0;
+
+    conn->max_bson_size = MONGO_DEFAULT_MAX_BSON_SIZE;
+    conn->max_message_size = 2 * MONGO_DEFAULT_MAX_BSON_SIZE;
+
+    conn->reply_buf = NULL;
+    conn->reply_buf_size = 0;
+
+    conn->cred = NULL;
 }
 
 int mongo_connect( mongo *conn , const char *host, int port ) {
@@ -171,13 +432,7 @@ int mongo_connect( mongo *conn , const char *host, int port ) {
     conn->primary->next = NULL;
 
     mongo_init( conn );
-    if( mongo_socket_connect( conn, host, port ) != MONGO_OK )
-        return MONGO_ERROR;
-
-    if( mongo_check_is_master( conn ) != MONGO_OK )
-        return MONGO_ERROR;
-    else
-        return MONGO_OK;
+    return mongo_connect_primary( conn );
 }
 
 void mongo_replset_init( mongo *conn, const char *name ) {
@@ -312,6 +567,7 @@ static int mongo_replset_check_host( mongo *conn ) {
     if ( mongo_simple_int_command( conn, "admin", "ismaster", 1, &out ) == MONGO_OK ) {
         if( bson_find( &it, &out, "ismaster" ) )
             ismaster = bson_iterator_bool( &it );
+        mongo_set_server_limits( conn, &out );
 
         if( bson_find( &it, &out, "setName" ) ) {
             set_name = bson_iterator_string( &it );
@@ -375,7 +631,7 @@ int mongo_replset_connect( mongo *conn ) {
 
                 /* Primary found, so return. */
                 else if( conn->replset->primary_connected )
-                    return MONGO_OK;
+                    return conn->cred ? mongo_authenticate( conn, conn->cred ) : MONGO_OK;
 
                 /* No primary, so close the connection. */
                 else {
@@ -413,7 +669,7 @@ int mongo_reconnect( mongo *conn ) {
         res = mongo_replset_connect( conn );
         return res;
     } else
-        return mongo_socket_connect( conn, conn->primary->host, conn->primary->port );
+        return mongo_connect_primary( conn );
 }
 
 int mongo_check_connection( mongo *conn ) {
@@ -440,6 +696,7 @@ void mongo_disconnect( mongo *conn ) {
 
     conn->sock = 0;
     conn->connected = 0;
+    conn->flags &= ~MONGO_CONN_BUSY;
 }
 
 void mongo_destroy( mongo *conn ) {
@@ -456,13 +713,226 @@ void mongo_destroy( mongo *conn ) {
     bson_free( conn->primary );
     bson_free( conn->errstr );
     bson_free( conn->lasterrstr );
+    bson_free( conn->reply_buf );
 
+    conn->reply_buf = NULL;
+    conn->reply_buf_size = 0;
     conn->err = 0;
     conn->errstr = NULL;
     conn->lasterrcode = 0;
     conn->lasterrstr = NULL;
 }
 
+/* Connection pool API */
+
+/* Background reconnects give up after this long, so that
+ * mongo_pool_destroy( ) doesn't wait for the kernel connect timeout. */
+#define MONGO_POOL_RECONNECT_MS 5000
+
+typedef struct {
+    mongo_pool *pool;          /* release conn there once done, if set */
+    mongo *conn;
+} mongo_pool_connect_arg;
+
+static void *mongo_pool_connect_thread( void *arg ) {
+    mongo_pool_connect_arg *a = ( mongo_pool_connect_arg * )arg;
+
+    mongo_reconnect( a->conn );
+    if( a->pool ) {
+        a->conn->deadline_ms = 0;
+        mongo_pool_release( a->pool, a->conn );
+    }
+    return NULL;
+}
+
+/* Open n connections at once, one thread each, so that the total time is
+ * that of the slowest handshake rather than the sum of them. If pool is
+ * set, each connection is released to it as soon as its own handshake is
+ * done. Returns the number that succeeded. */
+static int mongo_pool_connect_all( mongo_pool *pool, mongo **conns, int n ) {
+    mongo_pool_connect_arg *args;
+    pthread_t *threads;
+    char *started;
+    int i, connected = 0;
+
+    if( n == 0 )
+        return 0;
+
+    threads = ( pthread_t * )bson_malloc( n * sizeof( pthread_t ) );
+    started = ( char * )bson_malloc( n );
+    args = ( mongo_pool_connect_arg * )bson_malloc( n * sizeof( mongo_pool_connect_arg ) );
+
+    for( i = 0; i < n; i++ ) {
+        args[i].pool = pool;
+        args[i].conn = conns[i];
+    }
+    for( i = 1; i < n; i++ )
+        started[i] = pthread_create( &threads[i], NULL, mongo_pool_connect_thread, &args[i] ) == 0;
+    mongo_pool_connect_thread( &args[0] );
+
+    for( i = 0; i < n; i++ ) {
+        if( i > 0 ) {
+            if( started[i] )
+                pthread_join( threads[i], NULL );
+            else
+                mongo_pool_connect_thread( &args[i] );
+        }
+        /* Released ones may be in use already: only count them here */
+        if( ! pool && conns[i]->connected )
+            connected++;
+    }
+
+    bson_free( args );
+    bson_free( threads );
+    bson_free( started );
+
+    return connected;
+}
+
+/* Check out every idle connection, so nobody uses one mid-handshake,
+ * and reopen them all. Requests wait for them in mongo_pool_acquire( ),
+ * each for about one handshake. */
+static void *mongo_pool_reconnect_thread( void *arg ) {
+    mongo_pool *pool = ( mongo_pool * )arg;
+    mongo **conns;
+    int64_t deadline_ms;
+    int i, n;
+
+    pthread_mutex_lock( &pool->lock );
+    n = pool->nidle;
+    conns = ( mongo ** )bson_malloc( ( n ? n : 1 ) * sizeof( mongo * ) );
+    for( i = 0; i < n; i++ )
+        conns[i] = &pool->conns[pool->idle[i]];
+    pool->nidle = 0;
+    pthread_mutex_unlock( &pool->lock );
+
+    deadline_ms = mongo_time_ms() + MONGO_POOL_RECONNECT_MS;
+    for( i = 0; i < n; i++ )
+        conns[i]->deadline_ms = deadline_ms;
+    mongo_pool_connect_all( pool, conns, n );
+    bson_free( conns );
+
+    pthread_mutex_lock( &pool->lock );
+    pool->reconnecting = 0;
+    pthread_mutex_unlock( &pool->lock );
+
+    return NULL;
+}
+
+void mongo_pool_reconnect( mongo_pool *pool ) {
+    pthread_mutex_lock( &pool->lock );
+    if( pool->reconnecting ) {
+        pthread_mutex_unlock( &pool->lock );
+        return;
+    }
+    /* The previous one is done, but still has to be joined. */
+    if( pool->reconnect_started )
+        pthread_join( pool->reconnect_thread, NULL );
+    pool->reconnect_started = pthread_create( &pool->reconnect_thread, NULL,
+                                              mongo_pool_reconnect_thread, pool ) == 0;
+    pool->reconnecting = pool->reconnect_started;
+    pthread_mutex_unlock( &pool->lock );
+}
+
+int mongo_pool_init( mongo_pool *pool, const char *host, int port, int size,
+                     const mongo_credentials *cred ) {
+    mongo **conns;
+    int i, connected;
+
+    pool->conns = ( mongo * )bson_malloc( size * sizeof( mongo ) );
+    pool->idle = ( int * )bson_malloc( size * sizeof( int ) );
+    pool->size = size;
+    pool->nidle = 0;
+    pool->reconnecting = 0;
+    pool->reconnect_started = 0;
+    strncpy( pool->host, host, sizeof( pool->host ) - 1 );
+    pool->host[sizeof( pool->host ) - 1] = '\0';
+    pool->port = port;
+    pthread_mutex_init( &pool->lock, NULL );
+    pthread_cond_init( &pool->available, NULL );
+
+    conns = ( mongo ** )bson_malloc( size * sizeof( mongo * ) );
+    for( i = 0; i < size; i++ ) {
+        mongo *conn = &pool->conns[i];
+
+        mongo_init( conn );
+        conn->primary = bson_malloc( sizeof( mongo_host_port ) );
+        strcpy( conn->primary->host, pool->host );
+        conn->primary->port = port;
+        conn->primary->next = NULL;
+        conn->cred = cred;
+
+        conns[i] = conn;
+        pool->idle[pool->nidle++] = i;
+    }
+
+    connected = mongo_pool_connect_all( NULL, conns, size );
+    bson_free( conns );
+
+    return connected ? MONGO_OK : MONGO_ERROR;
+}
+
+mongo *mongo_pool_acquire_timed( mongo_pool *pool, int64_t deadline_ms ) {
+    struct timespec ts;
+    mongo *conn;
+
+    /* Condition variables wait on the realtime clock, like mongo_time_ms(). */
+    ts.tv_sec = deadline_ms / 1000;
+    ts.tv_nsec = ( deadline_ms % 1000 ) * 1000000;
+
+    pthread_mutex_lock( &pool->lock );
+    while( pool->nidle == 0 ) {
+        if( ! deadline_ms )
+            pthread_cond_wait( &pool->available, &pool->lock );
+        else if( pthread_cond_timedwait( &pool->available, &pool->lock, &ts ) == ETIMEDOUT &&
+                 pool->nidle == 0 ) {
+            pthread_mutex_unlock( &pool->lock );
+            return NULL;
+        }
+    }
+    /* LIFO, so that the most recently used sockets stay warm. */
+    conn = &pool->conns[pool->idle[--pool->nidle]];
+    pthread_mutex_unlock( &pool->lock );
+
+    conn->deadline_ms = deadline_ms;
+    if( ! conn->connected )
+        mongo_reconnect( conn );
+
+    return conn;
+}
+
+mongo *mongo_pool_acquire( mongo_pool *pool ) {
+    return mongo_pool_acquire_timed( pool, 0 );
+}
+
+void mongo_pool_release( mongo_pool *pool, mongo *conn ) {
+    conn->deadline_ms = 0;
+
+    pthread_mutex_lock( &pool->lock );
+    pool->idle[pool->nidle++] = conn - pool->conns;
+    pthread_cond_signal( &pool->available );
+    pthread_mutex_unlock( &pool->lock );
+}
+
+void mongo_pool_destroy( mongo_pool *pool ) {
+    int i;
+
+    if( pool->reconnect_started )
+        pthread_join( pool->reconnect_thread, NULL );
+
+    for( i = 0; i < pool->size; i++ )
+        mongo_destroy( &pool->conns[i] );
+
+    bson_free( pool->conns );
+    bson_free( pool->idle );
+    pool->conns = NULL;
+    pool->idle = NULL;
+    pool->size = pool->nidle = 0;
+
+    pthread_cond_destroy( &pool->available );
+    pthread_mutex_destroy( &pool->lock );
+}
+
 /* Determine whether this BSON object is valid for the given operation.  */
 static int mongo_bson_valid( mongo *conn, bson *bson, int write ) {
     if( ! bson->finished ) {
@@ -508,24 +978,21 @@ static int mongo_cursor_bson_valid( mongo_cursor *cursor, bson *bson ) {
 
 /* MongoDB CRUD API */
 
-int mongo_insert_batch( mongo *conn, const char *ns,
-                        bson **bsons, int count ) {
-
-    int size =  16 + 4 + strlen( ns ) + 1;
+/* Send bsons[0 .. count-1] in a single OP_INSERT. */
+static int mongo_insert_message( mongo *conn, const char *ns,
+                                 const bson **bsons, int count, int flags ) {
+    int size = 16 + 4 + strlen( ns ) + 1;
     int i;
     mongo_message *mm;
     char *data;
 
-    for( i=0; i<count; i++ ) {
+    for( i=0; i<count; i++ )
         size += bson_size( bsons[i] );
-        if( mongo_bson_valid( conn, bsons[i], 1 ) != MONGO_OK )
-            return MONGO_ERROR;
-    }
 
     mm = mongo_message_create( size , 0 , 0 , MONGO_OP_INSERT );
 
     data = &mm->data;
-    data = mongo_data_append32( data, &ZERO );
+    data = mongo_data_append32( data, &flags );
     data = mongo_data_append( data, ns, strlen( ns ) + 1 );
 
     for( i=0; i<count; i++ ) {
@@ -535,6 +1002,44 @@ int mongo_insert_batch( mongo *conn, const char *ns,
     return mongo_message_send( conn, mm );
 }
 
+/* How many of bsons[0 .. count-1] fit in one OP_INSERT (at least one). */
+static int mongo_insert_fit( mongo *conn, const char *ns,
+                             const bson **bsons, int count ) {
+    int size = 16 + 4 + strlen( ns ) + 1 + bson_size( bsons[0] );
+    int i;
+
+    for( i=1; i<count; i++ ) {
+        size += bson_size( bsons[i] );
+        if( size > conn->max_message_size )
+            break;
+    }
+
+    return i;
+}
+
+int mongo_insert_batch( mongo *conn, const char *ns,
+                        bson **bsons, int count ) {
+
+    int i, n;
+
+    for( i=0; i<count; i++ ) {
+        if( mongo_bson_valid( conn, bsons[i], 1 ) != MONGO_OK )
+            return MONGO_ERROR;
+        if( bson_size( bsons[i] ) > conn->max_bson_size ) {
+            conn->err = MONGO_BSON_TOO_LARGE;
+            return MONGO_ERROR;
+        }
+    }
+
+    for( i=0; i<count; i+=n ) {
+        n = mongo_insert_fit( conn, ns, ( const bson ** )bsons + i, count - i );
+        if( mongo_insert_message( conn, ns, ( const bson ** )bsons + i, n, 0 ) != MONGO_OK )
+            return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
 int mongo_insert( mongo *conn , const char *ns , bson *bson ) {
 
     char *data;
@@ -559,28 +1064,400 @@ int mongo_insert( mongo *conn , const char *ns , bson *bson ) {
     return mongo_message_send( conn, mm );
 }
 
-int mongo_update( mongo *conn, const char *ns, const bson *cond,
-                  const bson *op, int flags ) {
+/* Bulk writer API */
 
-    char *data;
-    mongo_message *mm;
+void mongo_bulk_init( mongo_bulk *bulk, const char *ns, int options ) {
+    bulk->ns = ( char * )bson_malloc( strlen( ns ) + 1 );
+    strcpy( bulk->ns, ns );
+    bulk->options = options;
+    bulk->wc = NULL;
+    bulk->ops = NULL;
+    bulk->count = 0;
+    bulk->alloc = 0;
+}
 
-    /* Make sure that the op BSON is valid UTF-8.
-     * TODO: decide whether to check cond as well.
-     * */
-    if( mongo_bson_valid( conn, ( bson * )op, 0 ) != MONGO_OK ) {
-        return MONGO_ERROR;
+static void mongo_bulk_append( mongo_bulk *bulk, mongo_bulk_op_type type,
+                               const bson *doc, const bson *op, int flags ) {
+    mongo_bulk_op *o;
+
+    if( bulk->count == bulk->alloc ) {
+        bulk->alloc = bulk->alloc ? bulk->alloc * 2 : 16;
+        bulk->ops = ( mongo_bulk_op * )bson_realloc( bulk->ops, bulk->alloc * sizeof( mongo_bulk_op ) );
     }
 
-    mm = mongo_message_create( 16 /* header */
-                               + 4  /* ZERO */
-                               + strlen( ns ) + 1
-                               + 4  /* flags */
-                               + bson_size( cond )
-                               + bson_size( op )
-                               , 0 , 0 , MONGO_OP_UPDATE );
+    o = &bulk->ops[bulk->count++];
+    o->type = type;
+    o->doc = doc;
+    o->op = op;
+    o->flags = flags;
+}
 
-    data = &mm->data;
+void mongo_bulk_insert( mongo_bulk *bulk, const bson *doc ) {
+    mongo_bulk_append( bulk, MONGO_BULK_INSERT, doc, NULL, 0 );
+}
+
+void mongo_bulk_update( mongo_bulk *bulk, const bson *cond, const bson *op, int flags ) {
+    mongo_bulk_append( bulk, MONGO_BULK_UPDATE, cond, op, flags );
+}
+
+void mongo_bulk_remove( mongo_bulk *bulk, const bson *cond ) {
+    mongo_bulk_append( bulk, MONGO_BULK_REMOVE, cond, NULL, 0 );
+}
+
+void mongo_bulk_clear( mongo_bulk *bulk ) {
+    bulk->count = 0;
+}
+
+void mongo_bulk_destroy( mongo_bulk *bulk ) {
+    bson_free( bulk->ns );
+    bson_free( bulk->ops );
+    bulk->ns = NULL;
+    bulk->ops = NULL;
+    bulk->count = bulk->alloc = 0;
+}
+
+void mongo_bulk_result_destroy( mongo_bulk_result *result ) {
+    int i;
+
+    for( i = 0; i < result->nerrors; i++ )
+        bson_free( result->errors[i].errmsg );
+    bson_free( result->errors );
+    result->errors = NULL;
+    result->nerrors = 0;
+}
+
+static void mongo_bulk_add_error( mongo_bulk_result *result, int index, int count,
+                                  mongo_error_t err, int code, const char *errmsg ) {
+    mongo_bulk_error *e;
+
+    result->errors = ( mongo_bulk_error * )bson_realloc( result->errors,
+                     ( result->nerrors + 1 ) * sizeof( mongo_bulk_error ) );
+    e = &result->errors[result->nerrors++];
+    e->index = index;
+    e->count = count;
+    e->err = err;
+    e->code = code;
+    e->errmsg = NULL;
+    if( errmsg ) {
+        e->errmsg = ( char * )bson_malloc( strlen( errmsg ) + 1 );
+        strcpy( e->errmsg, errmsg );
+    }
+}
+
+/* Client-side checks for a single queued write. */
+static int mongo_bulk_op_valid( mongo *conn, const mongo_bulk_op *o ) {
+    if( mongo_bson_valid( conn, ( bson * )o->doc, o->type == MONGO_BULK_INSERT ) != MONGO_OK )
+        return MONGO_ERROR;
+    if( o->op && mongo_bson_valid( conn, ( bson * )o->op, 0 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( bson_size( o->doc ) > conn->max_bson_size ||
+            ( o->op && bson_size( o->op ) > conn->max_bson_size ) ) {
+        conn->err = MONGO_BSON_TOO_LARGE;
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+/* getlasterror, waiting for the write concern if one is given. */
+static void mongo_bulk_ack_command( bson *cmd, const mongo_write_concern *wc ) {
+    bson_init( cmd );
+    bson_append_int( cmd, "getlasterror", 1 );
+    if( wc ) {
+        if( wc->wmode )
+            bson_append_string( cmd, "w", wc->wmode );
+        else if( wc->w > 1 )
+            bson_append_int( cmd, "w", wc->w );
+        if( wc->j )
+            bson_append_bool( cmd, "j", 1 );
+        if( wc->fsync )
+            bson_append_bool( cmd, "fsync", 1 );
+        if( wc->wtimeout > 0 )
+            bson_append_int( cmd, "wtimeout", wc->wtimeout );
+    }
+    bson_finish( cmd );
+}
+
+static void mongo_bulk_ack_parse( const bson *out, int *n, int *code, const char **errmsg ) {
+    bson_iterator it;
+
+    if( bson_find( &it, out, "n" ) )
+        *n = bson_iterator_int( &it );
+    if( bson_find( &it, out, "err" ) == BSON_STRING )
+        *errmsg = bson_iterator_string( &it );
+    if( *errmsg && bson_find( &it, out, "code" ) )
+        *code = bson_iterator_int( &it );
+}
+
+/* Acknowledge the previous message with getlasterror. Returns
+ * MONGO_ERROR only if the command itself could not be run; a write
+ * error is reported through errmsg (NULL if none) and code. The caller
+ * destroys out. */
+static int mongo_bulk_ack( mongo *conn, const char *db, const mongo_write_concern *wc,
+                           bson *out, int *n, int *code, const char **errmsg ) {
+    bson cmd;
+    int res;
+
+    mongo_bulk_ack_command( &cmd, wc );
+    out->data = NULL;
+    res = mongo_run_command( conn, db, &cmd, out );
+    bson_destroy( &cmd );
+
+    *n = 0;
+    *code = 0;
+    *errmsg = NULL;
+    if( res != MONGO_OK )
+        return MONGO_ERROR;
+
+    mongo_bulk_ack_parse( out, n, code, errmsg );
+    return MONGO_OK;
+}
+
+/* Like mongo_bulk_ack( ), in two halves so that the acknowledgements
+ * of several messages can be pipelined. */
+static int mongo_bulk_ack_send( mongo *conn, const char *db, const mongo_write_concern *wc ) {
+    bson cmd;
+    int res;
+
+    mongo_bulk_ack_command( &cmd, wc );
+    res = mongo_message_send( conn, mongo_command_message( db, &cmd ) );
+    bson_destroy( &cmd );
+
+    return res;
+}
+
+/* errmsg points into *reply, which the caller frees in any case. */
+static int mongo_bulk_ack_recv( mongo *conn, mongo_reply **reply,
+                                int *n, int *code, const char **errmsg ) {
+    bson out;
+
+    *reply = NULL;
+    *n = 0;
+    *code = 0;
+    *errmsg = NULL;
+    if( mongo_read_response( conn, reply ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( ( *reply )->fields.num < 1 || ( ( *reply )->fields.flag & MONGO_REPLY_QUERY_FAILURE ) ) {
+        conn->err = MONGO_COMMAND_FAILED;
+        return MONGO_ERROR;
+    }
+
+    bson_init_data( &out, &( *reply )->objs );
+    mongo_bulk_ack_parse( &out, n, code, errmsg );
+    return MONGO_OK;
+}
+
+void mongo_write_concern_init( mongo_write_concern *wc ) {
+    wc->w = 1;
+    wc->wmode = NULL;
+    wc->j = 0;
+    wc->fsync = 0;
+    wc->wtimeout = 0;
+}
+
+void mongo_bulk_set_write_concern( mongo_bulk *bulk, const mongo_write_concern *wc ) {
+    bulk->wc = wc;
+}
+
+/* A message sent in batch-ack mode, acknowledged once all are sent. */
+typedef struct {
+    int index;         /* of its first write */
+    int count;
+    mongo_bulk_op_type type;
+} mongo_bulk_message;
+
+int mongo_bulk_execute( mongo *conn, mongo_bulk *bulk, mongo_bulk_result *result ) {
+    const bson **docs;
+    mongo_bulk_message *msgs = NULL;
+    mongo_reply *reply;
+    char db[255];
+    const char *dot = strchr( bulk->ns, '.' );
+    int ordered = !( bulk->options & MONGO_BULK_CONTINUE_ON_ERROR );
+    int batch_ack = bulk->options & MONGO_BULK_BATCH_ACK;
+    int i = 0, j, end;
+    int sent = 0;       /* first write not yet acknowledged */
+    int unacked = 0;    /* inserted documents not yet acknowledged */
+    int nmsgs = 0;      /* messages sent in batch-ack mode */
+    int acks = 0;       /* of which getlasterror was sent for */
+    bson out;
+    const char *errmsg;
+    int n, code;
+
+    memset( result, 0, sizeof( *result ) );
+
+    if( !dot || dot - bulk->ns >= ( int )sizeof( db ) ) {
+        conn->err = MONGO_BSON_INVALID;
+        return MONGO_ERROR;
+    }
+    memcpy( db, bulk->ns, dot - bulk->ns );
+    db[dot - bulk->ns] = '\0';
+
+    docs = ( const bson ** )bson_malloc( ( bulk->count ? bulk->count : 1 ) * sizeof( bson * ) );
+    if( batch_ack )
+        msgs = ( mongo_bulk_message * )bson_malloc( ( bulk->count ? bulk->count : 1 ) *
+                sizeof( mongo_bulk_message ) );
+
+    while( i < bulk->count ) {
+        mongo_bulk_op *o = &bulk->ops[i];
+        int count = 1, res, last;
+
+        if( mongo_bulk_op_valid( conn, o ) != MONGO_OK ) {
+            mongo_bulk_add_error( result, i, 1, conn->err, 0, NULL );
+            if( ordered && !batch_ack )
+                break;
+            i++;
+            if( !batch_ack )
+                sent = i;
+            continue;
+        }
+
+        /* getlasterror only reports on the last message before it, so
+         * each message gets its own, without waiting for the reply. */
+        if( batch_ack && acks < nmsgs ) {
+            if( mongo_bulk_ack_send( conn, db, NULL ) != MONGO_OK ) {
+                mongo_bulk_add_error( result, i, bulk->count - i, conn->err, 0, NULL );
+                break;
+            }
+            acks++;
+        }
+
+        switch( o->type ) {
+        case MONGO_BULK_INSERT:
+            /* Gather the run of valid inserts that fits in one message. */
+            docs[0] = o->doc;
+            while( i + count < bulk->count &&
+                    bulk->ops[i + count].type == MONGO_BULK_INSERT &&
+                    mongo_bulk_op_valid( conn, &bulk->ops[i + count] ) == MONGO_OK ) {
+                docs[count] = bulk->ops[i + count].doc;
+                count++;
+            }
+            count = mongo_insert_fit( conn, bulk->ns, docs, count );
+            res = mongo_insert_message( conn, bulk->ns, docs, count,
+                                        bulk->options & MONGO_BULK_CONTINUE_ON_ERROR );
+            break;
+        case MONGO_BULK_UPDATE:
+            res = mongo_update( conn, bulk->ns, o->doc, o->op, o->flags );
+            break;
+        default:
+            res = mongo_remove( conn, bulk->ns, o->doc );
+            break;
+        }
+
+        if( res != MONGO_OK ) {
+            /* Nothing more can be sent on this connection. */
+            if( batch_ack )
+                sent = i;
+            mongo_bulk_add_error( result, sent, bulk->count - sent, conn->err, 0, NULL );
+            unacked = 0;
+            break;
+        }
+        result->messages++;
+
+        /* In batch-ack mode the replies are read at the end. */
+        if( batch_ack ) {
+            msgs[nmsgs].index = i;
+            msgs[nmsgs].count = count;
+            msgs[nmsgs].type = o->type;
+            nmsgs++;
+            i += count;
+            continue;
+        }
+
+        if( o->type == MONGO_BULK_INSERT )
+            unacked += count;
+        i += count;
+
+        /* Replication is ordered, so only the last acknowledgement needs
+         * to wait for the write concern. */
+        last = ( i >= bulk->count );
+        if( mongo_bulk_ack( conn, db, last ? bulk->wc : NULL, &out, &n, &code, &errmsg ) != MONGO_OK ) {
+            mongo_bulk_add_error( result, sent, bulk->count - sent, conn->err, 0, NULL );
+            unacked = 0;
+            break;
+        }
+
+        if( errmsg ) {
+            mongo_bulk_add_error( result, sent, i - sent, MONGO_WRITE_ERROR, code, errmsg );
+        } else {
+            result->inserted += unacked;
+            if( o->type == MONGO_BULK_UPDATE )
+                result->updated += n;
+            else if( o->type == MONGO_BULK_REMOVE )
+                result->removed += n;
+        }
+        bson_destroy( &out );
+        unacked = 0;
+        sent = i;
+
+        if( result->nerrors && ordered )
+            break;
+    }
+
+    if( batch_ack && nmsgs ) {
+        /* The last message waits for the write concern, which covers
+         * those before it. */
+        if( acks < nmsgs && i >= bulk->count && mongo_bulk_ack_send( conn, db, bulk->wc ) == MONGO_OK )
+            acks++;
+
+        end = msgs[nmsgs - 1].index + msgs[nmsgs - 1].count;
+        for( j = 0; j < acks; j++ ) {
+            if( mongo_bulk_ack_recv( conn, &reply, &n, &code, &errmsg ) != MONGO_OK ) {
+                bson_free( reply );
+                break;
+            }
+            if( errmsg ) {
+                mongo_bulk_add_error( result, msgs[j].index, msgs[j].count,
+                                      MONGO_WRITE_ERROR, code, errmsg );
+            } else if( msgs[j].type == MONGO_BULK_INSERT ) {
+                result->inserted += msgs[j].count;
+            } else if( msgs[j].type == MONGO_BULK_UPDATE ) {
+                result->updated += n;
+            } else {
+                result->removed += n;
+            }
+            bson_free( reply );
+        }
+        /* Those whose acknowledgement was lost, or never sent */
+        if( j < nmsgs )
+            mongo_bulk_add_error( result, msgs[j].index, end - msgs[j].index,
+                                  conn->err ? conn->err : MONGO_IO_ERROR, 0, NULL );
+    }
+
+    bson_free( msgs );
+    bson_free( docs );
+
+    if( result->nerrors ) {
+        conn->err = MONGO_WRITE_ERROR;
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+int mongo_update( mongo *conn, const char *ns, const bson *cond,
+                  const bson *op, int flags ) {
+
+    char *data;
+    mongo_message *mm;
+
+    /* Make sure that the op BSON is valid UTF-8.
+     * TODO: decide whether to check cond as well.
+     * */
+    if( mongo_bson_valid( conn, ( bson * )op, 0 ) != MONGO_OK ) {
+        return MONGO_ERROR;
+    }
+
+    mm = mongo_message_create( 16 /* header */
+                               + 4  /* ZERO */
+                               + strlen( ns ) + 1
+                               + 4  /* flags */
+                               + bson_size( cond )
+                               + bson_size( op )
+                               , 0 , 0 , MONGO_OP_UPDATE );
+
+    data = &mm->data;
     data = mongo_data_append32( data, &ZERO );
     data = mongo_data_append( data, ns, strlen( ns ) + 1 );
     data = mongo_data_append32( data, &flags );
@@ -617,8 +1494,147 @@ int mongo_remove( mongo *conn, const char *ns, const bson *cond ) {
 }
 
 
+/* Number of documents to ask for in the next OP_QUERY or OP_GET_MORE. */
+static int mongo_cursor_batch( mongo_cursor *cursor ) {
+    int n = cursor->batch_size;
+
+    if( cursor->limit > 0 ) {
+        int remaining = cursor->limit - cursor->seen;
+        if( n <= 0 || n > remaining )
+            n = remaining;
+    }
+
+    return n;
+}
+
+static int mongo_cursor_send_get_more( mongo_cursor *cursor ) {
+    char *data;
+    int sl = strlen( cursor->ns )+1;
+    int batch = mongo_cursor_batch( cursor );
+    mongo_message *mm;
+
+    mm = mongo_message_create( 16 /*header*/
+                               +4 /*ZERO*/
+                               +sl
+                               +4 /*numToReturn*/
+                               +8 /*cursorID*/
+                               , 0, 0, MONGO_OP_GET_MORE );
+    data = &mm->data;
+    data = mongo_data_append32( data, &ZERO );
+    data = mongo_data_append( data, cursor->ns, sl );
+    data = mongo_data_append32( data, &batch );
+    data = mongo_data_append64( data, &cursor->reply->fields.cursorID );
+
+    if( mongo_message_send( cursor->conn, mm ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    cursor->flags |= MONGO_CURSOR_REPLY_PENDING;
+    cursor->conn->flags |= MONGO_CONN_BUSY;
+    return MONGO_OK;
+}
+
+/* Called after every reply. Exhaust cursors expect the server to stream
+ * the next batch unasked; with read-ahead enabled, ask for it now while
+ * the current one is being consumed. Does nothing once the server has
+ * no more results. */
+static int mongo_cursor_prefetch( mongo_cursor *cursor ) {
+    if( !cursor->reply->fields.cursorID )
+        return MONGO_OK;
+
+    if( cursor->options & MONGO_EXHAUST ) {
+        cursor->flags |= MONGO_CURSOR_REPLY_PENDING;
+        cursor->conn->flags |= MONGO_CONN_BUSY;
+        return MONGO_OK;
+    }
+
+    if( !( cursor->flags & MONGO_CURSOR_PREFETCH ) ||
+            ( cursor->flags & MONGO_CURSOR_REPLY_PENDING ) ||
+            ( cursor->limit > 0 && cursor->seen >= cursor->limit ) )
+        return MONGO_OK;
+
+    return mongo_cursor_send_get_more( cursor );
+}
+
+static int mongo_cursor_read_reply( mongo_cursor *cursor, mongo_reply **reply ) {
+    return mongo_read_response_buf( cursor->conn, reply,
+                                    cursor->flags & MONGO_CURSOR_REPLY_BORROWED );
+}
+
+static void mongo_cursor_free_reply( mongo_cursor *cursor ) {
+    if( ! ( cursor->flags & MONGO_CURSOR_REPLY_BORROWED ) )
+        bson_free( cursor->reply );
+    cursor->reply = NULL;
+}
+
+/* Read the pending reply, replacing the current batch. */
+static int mongo_cursor_recv_more( mongo_cursor *cursor ) {
+    mongo_reply *reply;
+    int res;
+
+    cursor->flags &= ~MONGO_CURSOR_REPLY_PENDING;
+    cursor->conn->flags &= ~MONGO_CONN_BUSY;
+
+    /* A borrowed reply is overwritten in place, so drop the old one first. */
+    cursor->current.data = NULL;
+    mongo_cursor_free_reply( cursor );
+    res = mongo_cursor_read_reply( cursor, &reply );
+
+    if( res != MONGO_OK )
+        return MONGO_ERROR;
+
+    cursor->reply = reply;
+    cursor->seen += cursor->reply->fields.num;
+
+    return mongo_cursor_prefetch( cursor );
+}
+
+/* Size of the query as sent, once $maxTimeMS has been added. */
+static int mongo_cursor_query_size( mongo_cursor *cursor, bson_bool_t *wrapped ) {
+    bson_iterator it;
+    int size = bson_size( cursor->query );
+
+    if( ! cursor->max_time_ms )
+        return size;
+
+    /* A query that already has modifiers is extended; a plain one is
+     * wrapped as { $query: ..., $maxTimeMS: ... }. */
+    bson_iterator_init( &it, cursor->query );
+    *wrapped = !( bson_iterator_next( &it ) && strcmp( bson_iterator_key( &it ), "$query" ) == 0 );
+
+    size += 1 + 11 + 4; /* $maxTimeMS */
+    if( *wrapped )
+        size += 4 + 1 + 7 + 1; /* length, $query, terminator */
+
+    return size;
+}
+
+static char *mongo_cursor_append_query( mongo_cursor *cursor, char *data, int size,
+                                        bson_bool_t wrapped ) {
+    char *start = data;
+
+    if( ! cursor->max_time_ms )
+        return mongo_data_append( data, cursor->query->data, size );
+
+    if( wrapped ) {
+        data = mongo_data_append32( data, &size );
+        data = mongo_data_append( data, "\003$query", 8 );
+        data = mongo_data_append( data, cursor->query->data, bson_size( cursor->query ) );
+    } else
+        data = mongo_data_append( data, cursor->query->data, bson_size( cursor->query ) - 1 );
+
+    data = mongo_data_append( data, "\020$maxTimeMS", 12 );
+    data = mongo_data_append32( data, &cursor->max_time_ms );
+    *data++ = 0;
+
+    bson_little_endian32( start, &size );
+    return data;
+}
+
 static int mongo_cursor_op_query( mongo_cursor *cursor ) {
     int res;
+    int batch;
+    int query_size;
+    bson_bool_t wrapped = 0;
     bson empty;
     char *data;
     mongo_message *mm;
@@ -634,20 +1650,24 @@ static int mongo_cursor_op_query( mongo_cursor *cursor ) {
     else if( mongo_cursor_bson_valid( cursor, cursor->fields ) != MONGO_OK )
         return MONGO_ERROR;
 
+    query_size = mongo_cursor_query_size( cursor, &wrapped );
+
     mm = mongo_message_create( 16 + /* header */
                                4 + /*  options */
                                strlen( cursor->ns ) + 1 + /* ns */
                                4 + 4 + /* skip,return */
-                               bson_size( cursor->query ) +
+                               query_size +
                                bson_size( cursor->fields ) ,
                                0 , 0 , MONGO_OP_QUERY );
 
+    batch = mongo_cursor_batch( cursor );
+
     data = &mm->data;
     data = mongo_data_append32( data , &cursor->options );
     data = mongo_data_append( data , cursor->ns , strlen( cursor->ns ) + 1 );
     data = mongo_data_append32( data , &cursor->skip );
-    data = mongo_data_append32( data , &cursor->limit );
-    data = mongo_data_append( data , cursor->query->data , bson_size( cursor->query ) );
+    data = mongo_data_append32( data , &batch );
+    data = mongo_cursor_append_query( cursor, data, query_size, wrapped );
     if ( cursor->fields )
         data = mongo_data_append( data , cursor->fields->data , bson_size( cursor->fields ) );
 
@@ -658,20 +1678,26 @@ static int mongo_cursor_op_query( mongo_cursor *cursor ) {
         return MONGO_ERROR;
     }
 
-    res = mongo_read_response( cursor->conn, ( mongo_reply ** )&( cursor->reply ) );
+    res = mongo_cursor_read_reply( cursor, &cursor->reply );
     if( res != MONGO_OK ) {
         return MONGO_ERROR;
     }
 
     cursor->seen += cursor->reply->fields.num;
     cursor->flags |= MONGO_CURSOR_QUERY_SENT;
-    return MONGO_OK;
+
+    if( cursor->reply->fields.flag & MONGO_REPLY_QUERY_FAILURE ) {
+        cursor->err = MONGO_CURSOR_QUERY_FAIL;
+        return MONGO_ERROR;
+    }
+
+    return mongo_cursor_prefetch( cursor );
 }
 
 static int mongo_cursor_get_more( mongo_cursor *cursor ) {
-    int res;
-
-    if( cursor->limit > 0 && cursor->seen >= cursor->limit ) {
+    if( cursor->flags & MONGO_CURSOR_REPLY_PENDING ) {
+        return mongo_cursor_recv_more( cursor );
+    } else if( cursor->limit > 0 && cursor->seen >= cursor->limit ) {
         cursor->err = MONGO_CURSOR_EXHAUSTED;
         return MONGO_ERROR;
     } else if( ! cursor->reply ) {
@@ -681,42 +1707,10 @@ static int mongo_cursor_get_more( mongo_cursor *cursor ) {
         cursor->err = MONGO_CURSOR_EXHAUSTED;
         return MONGO_ERROR;
     } else {
-        char *data;
-        int sl = strlen( cursor->ns )+1;
-        int limit = 0;
-        mongo_message *mm;
-
-        if( cursor->limit > 0 )
-            limit = cursor->limit - cursor->seen;
-
-        mm = mongo_message_create( 16 /*header*/
-                                   +4 /*ZERO*/
-                                   +sl
-                                   +4 /*numToReturn*/
-                                   +8 /*cursorID*/
-                                   , 0, 0, MONGO_OP_GET_MORE );
-        data = &mm->data;
-        data = mongo_data_append32( data, &ZERO );
-        data = mongo_data_append( data, cursor->ns, sl );
-        data = mongo_data_append32( data, &limit );
-        data = mongo_data_append64( data, &cursor->reply->fields.cursorID );
-
-        bson_free( cursor->reply );
-        res = mongo_message_send( cursor->conn, mm );
-        if( res != MONGO_OK ) {
-            mongo_cursor_destroy( cursor );
+        if( mongo_cursor_send_get_more( cursor ) != MONGO_OK )
             return MONGO_ERROR;
-        }
 
-        res = mongo_read_response( cursor->conn, &( cursor->reply ) );
-        if( res != MONGO_OK ) {
-            mongo_cursor_destroy( cursor );
-            return MONGO_ERROR;
-        }
-        cursor->current.data = NULL;
-        cursor->seen += cursor->reply->fields.num;
-
-        return MONGO_OK;
+        return mongo_cursor_recv_more( cursor );
     }
 }
 
@@ -756,10 +1750,165 @@ int mongo_find_one( mongo *conn, const char *ns, bson *query,
     }
 }
 
-void mongo_cursor_init( mongo_cursor *cursor, mongo *conn, const char *ns ) {
+int mongo_find_one_borrowed( mongo_cursor *cursor, const bson **out ) {
+    cursor->flags |= MONGO_CURSOR_REPLY_BORROWED;
+    mongo_cursor_set_limit( cursor, 1 );
+
+    if( mongo_cursor_next( cursor ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    *out = &cursor->current;
+    return MONGO_OK;
+}
+
+/* Prepared queries */
+
+void mongo_prepared_init( mongo_prepared *q, const char *ns ) {
+    q->ns = ( char * )bson_malloc( strlen( ns ) + 1 );
+    strcpy( q->ns, ns );
+    bson_init( &q->tmpl );
+    bson_init( &q->fields );
+    q->nfields = 0;
+    q->params = NULL;
+    q->nparams = 0;
+    q->alloc = 0;
+}
+
+int mongo_prepared_add_param( mongo_prepared *q, const char *name, int type ) {
+    mongo_prepared_param *p;
+    int start = q->tmpl.cur - q->tmpl.data;
+
+    if( type != BSON_STRING && type != BSON_LONG )
+        return MONGO_ERROR;
+
+    /* Reserve the element header now; bind writes the real type byte. */
+    if( bson_append_null( &q->tmpl, name ) != BSON_OK )
+        return MONGO_ERROR;
+
+    if( q->nparams == q->alloc ) {
+        q->alloc = q->alloc ? q->alloc * 2 : 4;
+        q->params = ( mongo_prepared_param * )bson_realloc( q->params,
+                    q->alloc * sizeof( mongo_prepared_param ) );
+    }
+
+    p = &q->params[q->nparams];
+    p->start = start;
+    p->offset = q->tmpl.cur - q->tmpl.data;
+    p->type = type;
+
+    return q->nparams++;
+}
+
+int mongo_prepared_add_field( mongo_prepared *q, const char *name, int include ) {
+    const char *p = q->fields.data + 4;
+
+    /* Not finished yet, so walk it by hand: every element is an int. */
+    while( p < q->fields.cur ) {
+        if( strcmp( p + 1, name ) == 0 )
+            return MONGO_OK;
+        p += 1 + strlen( p + 1 ) + 1 + 4;
+    }
+
+    if( bson_append_int( &q->fields, name, include ) != BSON_OK )
+        return MONGO_ERROR;
+    q->nfields++;
+
+    return MONGO_OK;
+}
+
+int mongo_prepared_finish( mongo_prepared *q ) {
+    if( bson_finish( &q->tmpl ) != BSON_OK )
+        return MONGO_ERROR;
+
+    if( bson_finish( &q->fields ) != BSON_OK )
+        return MONGO_ERROR;
+
+    return MONGO_OK;
+}
+
+int mongo_prepared_bind( const mongo_prepared *q, const mongo_prepared_value *values,
+                         char *buf, int size, bson *out ) {
+    const char *tmpl = q->tmpl.data;
+    int tmpl_size = bson_size( &q->tmpl );
+    int pos = 4; /* skip the template's length */
+    int len = 4;
+    int i;
+
+    for( i = 0; i < q->nparams; i++ ) {
+        const mongo_prepared_param *p = &q->params[i];
+        const char *str = values[i].str;
+        int sl;
+        int chunk = p->offset - pos;
+        bson check;
+
+        if( p->type == BSON_LONG ) {
+            if( len + chunk + 8 > size )
+                return MONGO_ERROR;
+
+            memcpy( buf + len, tmpl + pos, chunk );
+            buf[len + p->start - pos] = ( char )p->type;
+            len += chunk;
+
+            bson_little_endian64( buf + len, &values[i].num );
+            len += 8;
+
+            pos = p->offset;
+            continue;
+        }
+
+        sl = values[i].len < 0 ? ( int )strlen( str ) : values[i].len;
+        check.err = 0;
+        if( bson_check_string( &check, str, sl ) == BSON_ERROR )
+            return MONGO_ERROR;
+
+        if( len + chunk + 4 + sl + 1 > size )
+            return MONGO_ERROR;
+
+        memcpy( buf + len, tmpl + pos, chunk );
+        buf[len + p->start - pos] = ( char )p->type;
+        len += chunk;
+
+        sl += 1;
+        bson_little_endian32( buf + len, &sl );
+        memcpy( buf + len + 4, str, sl - 1 );
+        buf[len + 4 + sl - 1] = '\0';
+        len += 4 + sl;
+
+        pos = p->offset;
+    }
+
+    if( len + tmpl_size - pos > size )
+        return MONGO_ERROR;
+
+    memcpy( buf + len, tmpl + pos, tmpl_size - pos );
+    len += tmpl_size - pos;
+    bson_little_endian32( buf, &len );
+
+    bson_init_data( out, buf );
+    out->cur = buf + len;
+    out->dataSize = size;
+    out->finished = 1;
+    out->stackPos = 0;
+    out->err = 0;
+    out->errstr = NULL;
+
+    return MONGO_OK;
+}
+
+void mongo_prepared_destroy( mongo_prepared *q ) {
+    bson_free( q->ns );
+    bson_destroy( &q->tmpl );
+    bson_destroy( &q->fields );
+    q->nfields = 0;
+    bson_free( q->params );
+    q->ns = NULL;
+    q->params = NULL;
+    q->nparams = 0;
+    q->alloc = 0;
+}
+
+static void mongo_cursor_reset( mongo_cursor *cursor, mongo *conn ) {
     cursor->conn = conn;
-    cursor->ns = ( const char * )bson_malloc( strlen( ns ) + 1 );
-    strncpy( ( char * )cursor->ns, ns, strlen( ns ) + 1 );
     cursor->current.data = NULL;
     cursor->reply = NULL;
     cursor->flags = 0;
@@ -770,6 +1919,24 @@ void mongo_cursor_init( mongo_cursor *cursor, mongo *conn, const char *ns ) {
     cursor->fields = NULL;
     cursor->skip = 0;
     cursor->limit = 0;
+    cursor->batch_size = 0;
+    cursor->max_time_ms = 0;
+}
+
+void mongo_cursor_init( mongo_cursor *cursor, mongo *conn, const char *ns ) {
+    mongo_cursor_reset( cursor, conn );
+    cursor->ns = ( const char * )bson_malloc( strlen( ns ) + 1 );
+    strncpy( ( char * )cursor->ns, ns, strlen( ns ) + 1 );
+}
+
+void mongo_cursor_init_prepared( mongo_cursor *cursor, mongo *conn,
+                                 const mongo_prepared *q, bson *query ) {
+    mongo_cursor_reset( cursor, conn );
+    cursor->ns = q->ns;
+    cursor->flags |= MONGO_CURSOR_NS_BORROWED;
+    cursor->query = query;
+    if( q->nfields )
+        cursor->fields = ( bson * )&q->fields;
 }
 
 void mongo_cursor_set_query( mongo_cursor *cursor, bson *query ) {
@@ -788,6 +1955,21 @@ void mongo_cursor_set_limit( mongo_cursor *cursor, int limit ) {
     cursor->limit = limit;
 }
 
+void mongo_cursor_set_batch_size( mongo_cursor *cursor, int batch_size ) {
+    cursor->batch_size = batch_size;
+}
+
+void mongo_cursor_set_prefetch( mongo_cursor *cursor, bson_bool_t prefetch ) {
+    if( prefetch )
+        cursor->flags |= MONGO_CURSOR_PREFETCH;
+    else
+        cursor->flags &= ~MONGO_CURSOR_PREFETCH;
+}
+
+void mongo_cursor_set_max_time_ms( mongo_cursor *cursor, int max_time_ms ) {
+    cursor->max_time_ms = max_time_ms;
+}
+
 void mongo_cursor_set_options( mongo_cursor *cursor, int options ) {
     cursor->options = options;
 }
@@ -804,8 +1986,9 @@ int mongo_cursor_next( mongo_cursor *cursor ) {
     char *next_object;
     char *message_end;
 
-    if( ! ( cursor->flags & MONGO_CURSOR_QUERY_SENT ) )
-        mongo_cursor_op_query( cursor );
+    if( ! ( cursor->flags & MONGO_CURSOR_QUERY_SENT ) &&
+            mongo_cursor_op_query( cursor ) != MONGO_OK )
+        return MONGO_ERROR;
 
     if( !cursor->reply )
         return MONGO_ERROR;
@@ -815,8 +1998,12 @@ int mongo_cursor_next( mongo_cursor *cursor ) {
 
         /* Special case for tailable cursors. */
         if( cursor->reply->fields.cursorID ) {
-            if( ( mongo_cursor_get_more( cursor ) != MONGO_OK ) ||
-                    cursor->reply->fields.num == 0 ) {
+            if( mongo_cursor_get_more( cursor ) != MONGO_OK )
+                return MONGO_ERROR;
+
+            if( cursor->reply->fields.num == 0 ) {
+                if( cursor->reply->fields.cursorID )
+                    cursor->err = MONGO_CURSOR_PENDING;
                 return MONGO_ERROR;
             }
         }
@@ -857,6 +2044,20 @@ int mongo_cursor_destroy( mongo_cursor *cursor ) {
 
     if ( !cursor ) return result;
 
+    if( cursor->flags & MONGO_CURSOR_REPLY_PENDING ) {
+        cursor->flags &= ~MONGO_CURSOR_REPLY_PENDING;
+        cursor->conn->flags &= ~MONGO_CONN_BUSY;
+        mongo_cursor_free_reply( cursor );
+
+        /* An exhaust stream can't be cancelled; the only way to give the
+         * socket back in a usable state is to close it. A single
+         * read-ahead reply is simply drained. */
+        if( cursor->options & MONGO_EXHAUST )
+            mongo_disconnect( cursor->conn );
+        else
+            mongo_cursor_read_reply( cursor, &cursor->reply );
+    }
+
     /* Kill cursor if live. */
     if ( cursor->reply && cursor->reply->fields.cursorID ) {
         mongo *conn = cursor->conn;
@@ -873,8 +2074,9 @@ int mongo_cursor_destroy( mongo_cursor *cursor ) {
         result = mongo_message_send( conn, mm );
     }
 
-    bson_free( cursor->reply );
-    bson_free( ( void * )cursor->ns );
+    mongo_cursor_free_reply( cursor );
+    if( ! ( cursor->flags & MONGO_CURSOR_NS_BORROWED ) )
+        bson_free( ( void * )cursor->ns );
 
     if( cursor->flags & MONGO_CURSOR_MUST_FREE )
         bson_free( cursor );
@@ -882,13 +2084,269 @@ int mongo_cursor_destroy( mongo_cursor *cursor ) {
     return result;
 }
 
+/* Parallel scan */
+
+typedef struct {
+    mongo_pool *pool;
+    const char *ns;
+    bson query;            /* {$query, $min, $max, $hint}, owned by the partition */
+    bson *fields;
+    mongo_scan_func func;
+    void *arg;
+    volatile int *abort;   /* shared by all partitions of a scan */
+    int result;
+    pthread_t thread;
+} mongo_scan_partition;
+
+static void *mongo_scan_partition_run( void *data ) {
+    mongo_scan_partition *part = ( mongo_scan_partition * )data;
+    mongo *conn = mongo_pool_acquire( part->pool );
+    mongo_cursor cursor[1];
+
+    mongo_cursor_init( cursor, conn, part->ns );
+    mongo_cursor_set_query( cursor, &part->query );
+    mongo_cursor_set_fields( cursor, part->fields );
+    mongo_cursor_set_prefetch( cursor, 1 );
+
+    part->result = MONGO_OK;
+    while( ! *part->abort && mongo_cursor_next( cursor ) == MONGO_OK ) {
+        if( part->func( &cursor->current, part->arg ) != MONGO_OK ) {
+            part->result = MONGO_ERROR;
+            break;
+        }
+    }
+
+    /* The range was read completely only if the server closed the cursor. */
+    if( ! cursor->reply || cursor->reply->fields.cursorID ||
+            cursor->err == MONGO_CURSOR_QUERY_FAIL )
+        part->result = MONGO_ERROR;
+
+    if( part->result != MONGO_OK )
+        *part->abort = 1;
+
+    mongo_cursor_destroy( cursor );
+    mongo_pool_release( part->pool, conn );
+    return NULL;
+}
+
+/* Fetch {key: value} for the document at position skip in key order
+ * (dir 1) or reverse key order (dir -1). */
+static int mongo_scan_key_at( mongo *conn, const char *ns, const char *key,
+                              bson *query, int dir, int skip, bson *out ) {
+    bson q, fields, empty;
+    bson_iterator it;
+    mongo_cursor *cursor;
+    int res = MONGO_ERROR;
+
+    bson_init( &q );
+    bson_append_bson( &q, "$query", query ? query : bson_empty( &empty ) );
+    bson_append_start_object( &q, "$orderby" );
+    bson_append_int( &q, key, dir );
+    bson_append_finish_object( &q );
+    bson_finish( &q );
+
+    bson_init( &fields );
+    bson_append_int( &fields, key, 1 );
+    bson_finish( &fields );
+
+    cursor = mongo_find( conn, ns, &q, &fields, 1, skip, 0 );
+    if( cursor && mongo_cursor_next( cursor ) == MONGO_OK ) {
+        bson_init( out );
+        if( bson_find( &it, &cursor->current, key ) )
+            bson_append_element( out, NULL, &it );
+        else
+            bson_append_null( out, key );
+        bson_finish( out );
+        res = MONGO_OK;
+    }
+
+    mongo_cursor_destroy( cursor );
+    bson_destroy( &fields );
+    bson_destroy( &q );
+    return res;
+}
+
+static bson_bool_t mongo_scan_numeric( bson_type t ) {
+    return t == BSON_INT || t == BSON_LONG || t == BSON_DOUBLE;
+}
+
+/* Fill bounds[0 .. partitions-2] with split points between min and max.
+ * Returns the number of split points, which is smaller than requested
+ * when the key range is too narrow. */
+static int mongo_scan_split( mongo *conn, const char *ns, const char *key,
+                             bson *query, int partitions, bson *bounds ) {
+    bson min, max;
+    bson_iterator lo, hi;
+    int i, n = 0;
+
+    if( mongo_scan_key_at( conn, ns, key, query, 1, 0, &min ) != MONGO_OK )
+        return 0;
+    if( mongo_scan_key_at( conn, ns, key, query, -1, 0, &max ) != MONGO_OK ) {
+        bson_destroy( &min );
+        return 0;
+    }
+
+    bson_iterator_init( &lo, &min );
+    bson_iterator_init( &hi, &max );
+    bson_iterator_next( &lo );
+    bson_iterator_next( &hi );
+
+    if( mongo_scan_numeric( bson_iterator_type( &lo ) ) &&
+            mongo_scan_numeric( bson_iterator_type( &hi ) ) ) {
+        double a = bson_iterator_double( &lo );
+        double b = bson_iterator_double( &hi );
+
+        for( i = 1; i < partitions; i++ ) {
+            bson_init( &bounds[n] );
+            bson_append_double( &bounds[n], key, a + ( b - a ) * i / partitions );
+            bson_finish( &bounds[n++] );
+        }
+    } else if( bson_iterator_type( &lo ) == BSON_OID &&
+               bson_iterator_type( &hi ) == BSON_OID ) {
+        /* Interpolate on the time and machine bytes; the rest is noise. */
+        uint64_t a, b, v;
+        bson_oid_t oid;
+
+        bson_big_endian64( &a, bson_iterator_oid( &lo )->bytes );
+        bson_big_endian64( &b, bson_iterator_oid( &hi )->bytes );
+
+        for( i = 1; i < partitions; i++ ) {
+            v = a + ( b - a ) / partitions * i;
+            memset( &oid, 0, sizeof( oid ) );
+            bson_big_endian64( oid.bytes, &v );
+            bson_init( &bounds[n] );
+            bson_append_oid( &bounds[n], key, &oid );
+            bson_finish( &bounds[n++] );
+        }
+    } else {
+        /* Sample the key at evenly spaced offsets. */
+        char db[255];
+        const char *coll = strchr( ns, '.' );
+        int64_t count;
+
+        if( coll && coll - ns < ( int )sizeof( db ) ) {
+            memcpy( db, ns, coll - ns );
+            db[coll - ns] = '\0';
+            count = mongo_count( conn, db, coll + 1, query );
+
+            for( i = 1; i < partitions && count > 0; i++ ) {
+                if( mongo_scan_key_at( conn, ns, key, query, 1,
+                                       ( int )( count * i / partitions ), &bounds[n] ) == MONGO_OK )
+                    n++;
+            }
+        }
+    }
+
+    bson_destroy( &min );
+    bson_destroy( &max );
+
+    /* Equal split points would produce empty ranges; drop them. */
+    for( i = 1; i < n; i++ ) {
+        if( bson_size( &bounds[i] ) == bson_size( &bounds[i - 1] ) &&
+                memcmp( bounds[i].data, bounds[i - 1].data, bson_size( &bounds[i] ) ) == 0 ) {
+            bson_destroy( &bounds[i] );
+            memmove( &bounds[i], &bounds[i + 1], ( n - i - 1 ) * sizeof( bson ) );
+            n--;
+            i--;
+        }
+    }
+
+    return n;
+}
+
+int mongo_parallel_scan( mongo_pool *pool, const char *ns, const char *key,
+                         bson *query, bson *fields, int partitions,
+                         mongo_scan_func func, void *arg ) {
+    mongo_scan_partition *parts;
+    bson *bounds;
+    bson empty;
+    volatile int aborted = 0;
+    int i, nbounds, res = MONGO_OK;
+    mongo *conn;
+
+    if( partitions < 1 )
+        partitions = 1;
+
+    bounds = ( bson * )bson_malloc( partitions * sizeof( bson ) );
+    conn = mongo_pool_acquire( pool );
+    nbounds = mongo_scan_split( conn, ns, key, query, partitions, bounds );
+    mongo_pool_release( pool, conn );
+
+    partitions = nbounds + 1;
+    parts = ( mongo_scan_partition * )bson_malloc( partitions * sizeof( mongo_scan_partition ) );
+
+    for( i = 0; i < partitions; i++ ) {
+        mongo_scan_partition *part = &parts[i];
+
+        part->pool = pool;
+        part->ns = ns;
+        part->fields = fields;
+        part->func = func;
+        part->arg = arg;
+        part->abort = &aborted;
+        part->result = MONGO_ERROR;
+
+        bson_init( &part->query );
+        bson_append_bson( &part->query, "$query", query ? query : bson_empty( &empty ) );
+        if( i > 0 )
+            bson_append_bson( &part->query, "$min", &bounds[i - 1] );
+        if( i < nbounds )
+            bson_append_bson( &part->query, "$max", &bounds[i] );
+        /* MongoDB 4.2+ only accepts $min/$max along with the index. */
+        if( nbounds > 0 ) {
+            bson_append_start_object( &part->query, "$hint" );
+            bson_append_int( &part->query, key, 1 );
+            bson_append_finish_object( &part->query );
+        }
+        bson_finish( &part->query );
+
+        if( pthread_create( &part->thread, NULL, mongo_scan_partition_run, part ) != 0 ) {
+            bson_destroy( &part->query );
+            aborted = 1;
+            break;
+        }
+    }
+
+    partitions = i;
+    for( i = 0; i < partitions; i++ ) {
+        pthread_join( parts[i].thread, NULL );
+        if( parts[i].result != MONGO_OK )
+            res = MONGO_ERROR;
+        bson_destroy( &parts[i].query );
+    }
+    if( aborted )
+        res = MONGO_ERROR;
+
+    for( i = 0; i < nbounds; i++ )
+        bson_destroy( &bounds[i] );
+    bson_free( bounds );
+    bson_free( parts );
+
+    return res;
+}
+
 /* MongoDB Helper Functions */
 
+static void mongo_index_spec( bson *b, bson *key, const char *name, int options ) {
+    bson_append_bson( b, "key", key );
+    bson_append_string( b, "name", name );
+    if ( options & MONGO_INDEX_UNIQUE )
+        bson_append_bool( b, "unique", 1 );
+    if ( options & MONGO_INDEX_DROP_DUPS )
+        bson_append_bool( b, "dropDups", 1 );
+    if ( options & MONGO_INDEX_BACKGROUND )
+        bson_append_bool( b, "background", 1 );
+    if ( options & MONGO_INDEX_SPARSE )
+        bson_append_bool( b, "sparse", 1 );
+}
+
 int mongo_create_index( mongo *conn, const char *ns, bson *key, int options, bson *out ) {
     bson b;
+    bson reply = {NULL, 0};
     bson_iterator it;
     char name[255] = {'_'};
     int i = 1;
+    int ok, legacy;
     char idxns[1024];
 
     bson_iterator_init( &it, key );
@@ -898,26 +2356,63 @@ int mongo_create_index( mongo *conn, const char *ns, bson *key, int options, bso
     }
     name[254] = '\0';
 
+    strncpy( idxns, ns, 1024-16 );
+    idxns[1024-16] = '\0';
+    *strchr( idxns, '.' ) = '\0'; /* just db not ns */
+
+    /* The createIndexes command, from 2.6 on. */
+    bson_init( &b );
+    bson_append_string( &b, "createIndexes", strchr( ns, '.' ) + 1 );
+    bson_append_start_array( &b, "indexes" );
+    bson_append_start_object( &b, "0" );
+    mongo_index_spec( &b, key, name, options );
+    bson_append_finish_object( &b );
+    bson_append_finish_array( &b );
+    bson_finish( &b );
+
+    i = mongo_run_command( conn, idxns, &b, &reply );
+    bson_destroy( &b );
+    if( i != MONGO_OK )
+        return MONGO_ERROR;
+
+    ok = bson_find( &it, &reply, "ok" ) && bson_iterator_bool( &it );
+    legacy = !ok && bson_find( &it, &reply, "errmsg" ) == BSON_STRING &&
+             strncmp( bson_iterator_string( &it ), "no such", 7 ) == 0;
+
+    if( !legacy ) {
+        conn->lasterrcode = 0;
+        bson_free( conn->lasterrstr );
+        conn->lasterrstr = NULL;
+        if( !ok ) {
+            conn->err = MONGO_COMMAND_FAILED;
+            if( bson_find( &it, &reply, "errmsg" ) == BSON_STRING ) {
+                conn->lasterrstr = ( char * )bson_malloc( bson_iterator_string_len( &it ) );
+                strcpy( conn->lasterrstr, bson_iterator_string( &it ) );
+            }
+            if( bson_find( &it, &reply, "code" ) != BSON_EOO )
+                conn->lasterrcode = bson_iterator_int( &it );
+        }
+
+        if( out )
+            *out = reply; /* transfer of ownership */
+        else
+            bson_destroy( &reply );
+
+        return ok ? MONGO_OK : MONGO_ERROR;
+    }
+    bson_destroy( &reply );
+
+    /* Older servers take the index document in system.indexes. */
     bson_init( &b );
-    bson_append_bson( &b, "key", key );
+    mongo_index_spec( &b, key, name, options );
     bson_append_string( &b, "ns", ns );
-    bson_append_string( &b, "name", name );
-    if ( options & MONGO_INDEX_UNIQUE )
-        bson_append_bool( &b, "unique", 1 );
-    if ( options & MONGO_INDEX_DROP_DUPS )
-        bson_append_bool( &b, "dropDups", 1 );
-    if ( options & MONGO_INDEX_BACKGROUND )
-        bson_append_bool( &b, "background", 1 );
-    if ( options & MONGO_INDEX_SPARSE )
-        bson_append_bool( &b, "sparse", 1 );
     bson_finish( &b );
 
-    strncpy( idxns, ns, 1024-16 );
-    strcpy( strchr( idxns, '.' ), ".system.indexes" );
+    strcat( idxns, ".system.indexes" );
     mongo_insert( conn, idxns, &b );
     bson_destroy( &b );
 
-    *strchr( idxns, '.' ) = '\0'; /* just db not ns */
+    *strchr( idxns, '.' ) = '\0';
     return mongo_cmd_get_last_error( conn, idxns, out );
 }
 
@@ -1112,28 +2607,6 @@ bson_bool_t mongo_cmd_ismaster( mongo *conn, bson *realout ) {
     return ismaster;
 }
 
-static void digest2hex( mongo_md5_byte_t digest[16], char hex_digest[33] ) {
-    static const char hex[16] = {'0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f'};
-    int i;
-    for ( i=0; i<16; i++ ) {
-        hex_digest[2*i]     = hex[( digest[i] & 0xf0 ) >> 4];
-        hex_digest[2*i + 1] = hex[ digest[i] & 0x0f      ];
-    }
-    hex_digest[32] = '\0';
-}
-
-static void mongo_pass_digest( const char *user, const char *pass, char hex_digest[33] ) {
-    mongo_md5_state_t st;
-    mongo_md5_byte_t digest[16];
-
-    mongo_md5_init( &st );
-    mongo_md5_append( &st, ( const mongo_md5_byte_t * )user, strlen( user ) );
-    mongo_md5_append( &st, ( const mongo_md5_byte_t * )":mongo:", 7 );
-    mongo_md5_append( &st, ( const mongo_md5_byte_t * )pass, strlen( pass ) );
-    mongo_md5_finish( &st, digest );
-    digest2hex( digest, hex_digest );
-}
-
 int mongo_cmd_add_user( mongo *conn, const char *db, const char *user, const char *pass ) {
     bson user_obj;
     bson pass_obj;
@@ -1166,53 +2639,12 @@ int mongo_cmd_add_user( mongo *conn, const char *db, const char *user, const cha
 }
 
 bson_bool_t mongo_cmd_authenticate( mongo *conn, const char *db, const char *user, const char *pass ) {
-    bson from_db;
-    bson cmd;
-    bson out;
-    const char *nonce;
-    bson_bool_t success = 0;
-
-    mongo_md5_state_t st;
-    mongo_md5_byte_t digest[16];
-    char hex_digest[33];
-
-    if( mongo_simple_int_command( conn, db, "getnonce", 1, &from_db ) == MONGO_OK ) {
-        bson_iterator it;
-        bson_find( &it, &from_db, "nonce" );
-        nonce = bson_iterator_string( &it );
-    } else {
-        return MONGO_ERROR;
-    }
-
-    mongo_pass_digest( user, pass, hex_digest );
-
-    mongo_md5_init( &st );
-    mongo_md5_append( &st, ( const mongo_md5_byte_t * )nonce, strlen( nonce ) );
-    mongo_md5_append( &st, ( const mongo_md5_byte_t * )user, strlen( user ) );
-    mongo_md5_append( &st, ( const mongo_md5_byte_t * )hex_digest, 32 );
-    mongo_md5_finish( &st, digest );
-    digest2hex( digest, hex_digest );
-
-    bson_init( &cmd );
-    bson_append_int( &cmd, "authenticate", 1 );
-    bson_append_string( &cmd, "user", user );
-    bson_append_string( &cmd, "nonce", nonce );
-    bson_append_string( &cmd, "key", hex_digest );
-    bson_finish( &cmd );
+    mongo_credentials cred;
+    int res;
 
-    bson_destroy( &from_db );
-    /*bson_init( &from_db ); */
-    if( mongo_run_command( conn, db, &cmd, &out ) == MONGO_OK ) {
-        bson_iterator it;
-        if( bson_find( &it, &out, "ok" ) )
-            success = bson_iterator_bool( &it );
-    }
+    mongo_credentials_init( &cred, db, user, pass );
+    res = mongo_authenticate( conn, &cred );
+    mongo_credentials_destroy( &cred );
 
-    bson_destroy( &from_db );
-    bson_destroy( &cmd );
-
-    if( success )
-        return MONGO_OK;
-    else
-        return MONGO_ERROR;
+    return res;
 }
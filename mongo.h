@@ -23,6 +23,8 @@
 
 #include "bson.h"
 
+#include <pthread.h>
+
 MONGO_EXTERN_C_START
 
 #define MONGO_MAJOR 0
@@ -34,6 +36,8 @@ MONGO_EXTERN_C_START
 
 #define MONGO_DEFAULT_PORT 27017
 
+#define MONGO_DEFAULT_MAX_BSON_SIZE ( 4 * 1024 * 1024 )
+
 typedef enum mongo_error_t {
     MONGO_CONN_SUCCESS = 0,  /**< Connection success! */
     MONGO_CONN_NO_SOCKET,    /**< Could not create a socket. */
@@ -50,12 +54,25 @@ typedef enum mongo_error_t {
     MONGO_CURSOR_INVALID,    /**< The cursor has timed out or is not recognized. */
     MONGO_CURSOR_PENDING,    /**< Tailable cursor still alive but no data. */
     MONGO_BSON_INVALID,      /**< BSON not valid for the specified op. */
-    MONGO_BSON_NOT_FINISHED  /**< BSON object has not been finished. */
+    MONGO_BSON_NOT_FINISHED, /**< BSON object has not been finished. */
+    MONGO_CONN_BUSY_ERROR,   /**< The socket is owned by a cursor with a reply in flight. */
+    MONGO_CURSOR_QUERY_FAIL, /**< The server rejected the query ($err in the reply). */
+    MONGO_BSON_TOO_LARGE,    /**< BSON object exceeds the server's maxBsonObjectSize. */
+    MONGO_WRITE_ERROR,       /**< The server reported an error for a write. */
+    MONGO_DEADLINE_EXCEEDED  /**< The connection's deadline passed before the operation completed. */
 } mongo_error_t;
 
 enum mongo_cursor_flags {
     MONGO_CURSOR_MUST_FREE = 1,      /**< mongo_cursor_destroy should free cursor. */
-    MONGO_CURSOR_QUERY_SENT = ( 1<<1 ) /**< Initial query has been sent. */
+    MONGO_CURSOR_QUERY_SENT = ( 1<<1 ), /**< Initial query has been sent. */
+    MONGO_CURSOR_PREFETCH = ( 1<<2 ),   /**< Request the next batch as soon as one arrives. */
+    MONGO_CURSOR_REPLY_PENDING = ( 1<<3 ), /**< A reply (read-ahead or exhaust) is in flight. */
+    MONGO_CURSOR_NS_BORROWED = ( 1<<4 ),   /**< ns belongs to a prepared query; don't free it. */
+    MONGO_CURSOR_REPLY_BORROWED = ( 1<<5 ) /**< reply lives in the connection's reply buffer. */
+};
+
+enum mongo_conn_flags {
+    MONGO_CONN_BUSY = ( 1<<0 ) /**< A cursor owns the socket until its pending reply is read. */
 };
 
 enum mongo_index_opts {
@@ -71,15 +88,31 @@ enum mongo_update_opts {
     MONGO_UPDATE_BASIC = 0x4
 };
 
+enum mongo_insert_opts {
+    MONGO_CONTINUE_ON_ERROR = 0x1   /**< Keep inserting the batch past a failed document. */
+};
+
+enum mongo_bulk_opts {
+    MONGO_BULK_ORDERED = 0,                             /**< Stop at the first failed write. */
+    MONGO_BULK_CONTINUE_ON_ERROR = MONGO_CONTINUE_ON_ERROR, /**< Attempt every write. */
+    MONGO_BULK_BATCH_ACK = ( 1<<1 )                     /**< Pipeline acknowledgements: one round trip per batch. */
+};
+
 enum mongo_cursor_opts {
     MONGO_TAILABLE = ( 1<<1 ),        /**< Create a tailable cursor. */
     MONGO_SLAVE_OK = ( 1<<2 ),        /**< Allow queries on a non-primary node. */
+    MONGO_OPLOG_REPLAY = ( 1<<3 ),    /**< Seek an oplog query on its ts condition. */
     MONGO_NO_CURSOR_TIMEOUT = ( 1<<4 ), /**< Disable cursor timeouts. */
     MONGO_AWAIT_DATA = ( 1<<5 ),      /**< Momentarily block for more data. */
     MONGO_EXHAUST = ( 1<<6 ),         /**< Stream in multiple 'more' packages. */
     MONGO_PARTIAL = ( 1<<7 )          /**< Allow reads even if a shard is down. */
 };
 
+enum mongo_reply_flags {
+    MONGO_REPLY_CURSOR_NOT_FOUND = ( 1<<0 ), /**< getMore on a cursor the server doesn't know. */
+    MONGO_REPLY_QUERY_FAILURE = ( 1<<1 )     /**< The single document returned is an $err. */
+};
+
 enum mongo_operations {
     MONGO_OP_MSG = 1000,
     MONGO_OP_UPDATE = 2001,
@@ -130,25 +163,41 @@ typedef struct {
     bson_bool_t primary_connected; /**< Primary node connection status. */
 } mongo_replset;
 
+typedef struct {
+    char *db;          /**< Database the user is defined in. */
+    char *user;
+    char digest[33];   /**< Hex md5 of "user:mongo:password", computed once. */
+} mongo_credentials;
+
 typedef struct mongo {
     mongo_host_port *primary;  /**< Primary connection info. */
     mongo_replset *replset;    /**< replset object if connected to a replica set. */
     int sock;                  /**< Socket file descriptor. */
     int flags;                 /**< Flags on this connection object. */
+    int request_id;            /**< Last request id issued; incremented atomically. */
     int conn_timeout_ms;       /**< Connection timeout in milliseconds. */
     int op_timeout_ms;         /**< Read and write timeout in milliseconds. */
+    int64_t deadline_ms;       /**< Absolute deadline for socket I/O (see mongo_time_ms()), 0 for none. */
     bson_bool_t connected;     /**< Connection status. */
 
-    mongo_error_t err;         /**< Most recent driver error code. */
+    mongo_error_t err;         /**< Driver error code of the most recent operation. */
     char *errstr;              /**< String version of most recent driver error code. */
     int lasterrcode;           /**< getlasterror given by the server on calls. */
     char *lasterrstr;          /**< getlasterror string generated by server. */
+
+    int max_bson_size;         /**< maxBsonObjectSize reported by ismaster. */
+    int max_message_size;      /**< maxMessageSizeBytes reported by ismaster. */
+
+    mongo_reply *reply_buf;    /**< Reusable buffer for borrowed replies, see mongo_find_one_borrowed(). */
+    int reply_buf_size;        /**< Allocated size of reply_buf. */
+
+    const mongo_credentials *cred; /**< Authenticate with these on every reconnect; not owned. */
 } mongo;
 
 typedef struct {
-    mongo_reply *reply;  /**< reply is owned by cursor */
+    mongo_reply *reply;  /**< reply is owned by cursor unless MONGO_CURSOR_REPLY_BORROWED is set */
     mongo *conn;       /**< connection is *not* owned by cursor */
-    const char *ns;    /**< owned by cursor */
+    const char *ns;    /**< owned by cursor unless MONGO_CURSOR_NS_BORROWED is set */
     int flags;         /**< Flags used internally by this drivers. */
     int seen;          /**< Number returned so far. */
     bson current;      /**< This cursor's current bson object. */
@@ -158,8 +207,109 @@ typedef struct {
     int options;       /**< Bitfield containing cursor options. */
     int limit;         /**< Bitfield containing cursor options. */
     int skip;          /**< Bitfield containing cursor options. */
+    int batch_size;    /**< Number of documents to request per reply (0 lets the server decide). */
+    int max_time_ms;   /**< Server-side time limit sent as $maxTimeMS (0 for none). */
 } mongo_cursor;
 
+typedef struct {
+    int start;         /**< Template offset of the parameter's type byte. */
+    int offset;        /**< Template offset just past the parameter's field name. */
+    int type;          /**< BSON type of the bound value. */
+} mongo_prepared_param;
+
+typedef struct {
+    char *ns;          /**< owned by the prepared query */
+    bson tmpl;         /**< Query skeleton; parameters are stored without a value. */
+    bson fields;       /**< Projection, sent only if nfields > 0. */
+    int nfields;
+    mongo_prepared_param *params;
+    int nparams;
+    int alloc;
+} mongo_prepared;
+
+typedef struct {
+    const char *str;   /**< Value of a BSON_STRING parameter. */
+    int len;           /**< Length of str, or -1 to use strlen( str ). */
+    int64_t num;       /**< Value of a BSON_LONG parameter. */
+} mongo_prepared_value;
+
+typedef enum {
+    MONGO_BULK_INSERT,
+    MONGO_BULK_UPDATE,
+    MONGO_BULK_REMOVE
+} mongo_bulk_op_type;
+
+typedef struct {
+    mongo_bulk_op_type type;
+    const bson *doc;   /**< Document to insert, or the update/remove condition. */
+    const bson *op;    /**< Update operation; NULL for inserts and removes. */
+    int flags;         /**< Update flags. */
+} mongo_bulk_op;
+
+typedef struct {
+    int w;             /**< Number of nodes that must acknowledge; 1 is the primary alone. */
+    const char *wmode; /**< Named mode such as "majority"; overrides w when set. */
+    int j;             /**< Wait for the write to reach the journal. */
+    int fsync;         /**< Wait for the data files to be flushed. */
+    int wtimeout;      /**< Milliseconds to wait for w before failing; 0 waits forever. */
+} mongo_write_concern;
+
+typedef struct {
+    char *ns;          /**< owned by the bulk writer */
+    int options;       /**< A bitfield of mongo_bulk_opts. */
+    const mongo_write_concern *wc; /**< not owned; NULL acknowledges with w=1. */
+    mongo_bulk_op *ops;
+    int count;
+    int alloc;
+} mongo_bulk;
+
+/**
+ * A failed write message. getlasterror doesn't tell which document of an
+ * insert message failed, so the error covers all of them: see
+ * mongo_bulk_execute( ).
+ */
+typedef struct {
+    int index;         /**< Index of the first write in the failed message. */
+    int count;         /**< Number of writes in the failed message. */
+    mongo_error_t err; /**< Driver error, e.g. MONGO_BSON_TOO_LARGE or MONGO_WRITE_ERROR. */
+    int code;          /**< Server error code, 0 if the write was never sent. */
+    char *errmsg;      /**< Server error string, or NULL. */
+} mongo_bulk_error;
+
+typedef struct {
+    int inserted;      /**< Documents in insert messages that succeeded; none of a failed one count. */
+    int updated;       /**< Documents matched by updates, including upserts. */
+    int removed;       /**< Documents removed. */
+    int messages;      /**< Write messages sent to the server. */
+    int nerrors;
+    mongo_bulk_error *errors;
+} mongo_bulk_result;
+
+typedef struct mongo_pool {
+    mongo *conns;              /**< Connection objects, owned by the pool. */
+    int *idle;                 /**< Stack of indexes into conns that are not checked out. */
+    int nidle;                 /**< Number of entries on the idle stack. */
+    int size;                  /**< Number of connections in the pool. */
+    char host[255];            /**< Server every connection is opened to. */
+    int port;                  /**< Port every connection is opened to. */
+    pthread_mutex_t lock;      /**< Protects idle and nidle. */
+    pthread_cond_t available;  /**< Signalled when a connection is released. */
+    int reconnecting;          /**< A mongo_pool_reconnect( ) is in progress. */
+    int reconnect_started;     /**< reconnect_thread has to be joined. */
+    pthread_t reconnect_thread;
+} mongo_pool;
+
+/**
+ * Callback invoked for each document of a parallel scan. It may be
+ * called concurrently from several threads.
+ *
+ * @param doc the current document; only valid during the call.
+ * @param arg the opaque argument given to mongo_parallel_scan().
+ *
+ * @return MONGO_OK to continue, MONGO_ERROR to abort the whole scan.
+ */
+typedef int ( *mongo_scan_func )( const bson *doc, void *arg );
+
 /* Connection API */
 
 /** Initialize a new mongo connection object. If not created
@@ -186,6 +336,52 @@ void mongo_init( mongo *conn );
  */
 int mongo_connect( mongo *conn , const char *host, int port );
 
+/**
+ * The current time in milliseconds since the epoch, the clock deadlines
+ * are expressed in.
+ */
+int64_t mongo_time_ms( void );
+
+/**
+ * Bound all further socket I/O on this connection by an absolute
+ * deadline. Once it passes, operations fail with
+ * MONGO_DEADLINE_EXCEEDED. If a request was already partly sent or its
+ * reply not yet read, the connection is closed, since it can't be
+ * reused.
+ *
+ * @param conn a mongo object.
+ * @param deadline_ms deadline as given by mongo_time_ms(), or 0 to wait
+ *     forever.
+ */
+void mongo_set_deadline( mongo *conn, int64_t deadline_ms );
+
+/**
+ * Prepare credentials for mongo_set_credentials( ). The password digest
+ * is computed here, once, rather than on every connection.
+ *
+ * @param cred the credentials object to initialize.
+ * @param db the database the user is defined in.
+ * @param user the user name.
+ * @param pass the clear text password; it is not kept.
+ */
+void mongo_credentials_init( mongo_credentials *cred, const char *db,
+                             const char *user, const char *pass );
+
+/**
+ * Release the resources held by a credentials object.
+ */
+void mongo_credentials_destroy( mongo_credentials *cred );
+
+/**
+ * Authenticate every time this connection is (re)established by
+ * mongo_reconnect( ). The getnonce round trip is pipelined with
+ * ismaster, so authentication adds a single round trip.
+ *
+ * @param conn a mongo object.
+ * @param cred credentials that must outlive conn, or NULL.
+ */
+void mongo_set_credentials( mongo *conn, const mongo_credentials *cred );
+
 /**
  * Set up this connection object for connecting to a replica set.
  * To connect, pass the object to mongo_replset_connect().
@@ -299,7 +495,9 @@ int mongo_insert( mongo *conn, const char *ns, bson *data );
 
 /**
  * Insert a batch of BSON documents into a MongoDB server. This function
- * will fail if any of the documents to be inserted is invalid.
+ * will fail if any of the documents to be inserted is invalid or larger
+ * than conn->max_bson_size. Batches bigger than conn->max_message_size
+ * are split over several messages.
  *
  * @param conn a mongo object.
  * @param ns the namespace.
@@ -312,6 +510,116 @@ int mongo_insert( mongo *conn, const char *ns, bson *data );
 int mongo_insert_batch( mongo *conn , const char *ns ,
                         bson **data , int num );
 
+/**
+ * Create a bulk writer. Writes are queued with mongo_bulk_insert( ),
+ * mongo_bulk_update( ) and mongo_bulk_remove( ) and sent by
+ * mongo_bulk_execute( ).
+ *
+ * @param bulk the bulk writer to initialize.
+ * @param ns the namespace every write applies to.
+ * @param options MONGO_BULK_ORDERED to stop at the first failure, or
+ *     MONGO_BULK_CONTINUE_ON_ERROR to attempt every write, optionally
+ *     combined with MONGO_BULK_BATCH_ACK.
+ */
+void mongo_bulk_init( mongo_bulk *bulk, const char *ns, int options );
+
+/**
+ * Initialize a write concern to plain acknowledgement by the primary.
+ *
+ * @param wc the write concern to initialize.
+ */
+void mongo_write_concern_init( mongo_write_concern *wc );
+
+/**
+ * Set the write concern the bulk writer waits for. It is applied to the
+ * final acknowledgement of mongo_bulk_execute( ); since replication
+ * preserves order, that covers every write in the batch.
+ *
+ * @param bulk a mongo_bulk.
+ * @param wc the write concern, which is not copied, or NULL for w=1.
+ */
+void mongo_bulk_set_write_concern( mongo_bulk *bulk, const mongo_write_concern *wc );
+
+/**
+ * Queue a document for insertion. The document is not copied and must
+ * stay valid until the bulk writer is executed.
+ *
+ * @param bulk a mongo_bulk.
+ * @param doc the document to insert.
+ */
+void mongo_bulk_insert( mongo_bulk *bulk, const bson *doc );
+
+/**
+ * Queue an update. Neither document is copied.
+ *
+ * @param bulk a mongo_bulk.
+ * @param cond the bson update query.
+ * @param op the bson update data.
+ * @param flags flags for the update.
+ */
+void mongo_bulk_update( mongo_bulk *bulk, const bson *cond, const bson *op, int flags );
+
+/**
+ * Queue a remove. The condition is not copied.
+ *
+ * @param bulk a mongo_bulk.
+ * @param cond the bson query.
+ */
+void mongo_bulk_remove( mongo_bulk *bulk, const bson *cond );
+
+/**
+ * Send every queued write using as few messages as the server's limits
+ * allow. Consecutive inserts share OP_INSERT messages of up to
+ * conn->max_message_size bytes; updates and removes are sent one per
+ * message. Each message is acknowledged with getlasterror so failures
+ * can be attributed to the writes that caused them; with
+ * MONGO_BULK_BATCH_ACK those are sent along with the writes and their
+ * replies read at the end, so a batch costs one round trip, but an
+ * ordered batch doesn't stop at a failed message. Documents larger
+ * than conn->max_bson_size or invalid for the write are rejected
+ * without being sent.
+ *
+ * Errors are per message, not per document: the server doesn't say
+ * which document of an insert message failed. In ordered mode, the
+ * documents of a failed insert message before the one that failed were
+ * applied all the same, yet none of them count as inserted; with
+ * MONGO_BULK_CONTINUE_ON_ERROR, all but the failed ones were, and only
+ * the last error of the message is reported. Callers
+ * that need to know exactly must make writes they can safely repeat,
+ * e.g. with their own _id so that a repeated insert fails with a
+ * duplicate key error.
+ *
+ * @param conn a mongo object.
+ * @param bulk the queued writes. The queue is left untouched.
+ * @param result receives counts and errors; release it with
+ *     mongo_bulk_result_destroy( ).
+ *
+ * @return MONGO_OK if every write succeeded; otherwise MONGO_ERROR.
+ */
+int mongo_bulk_execute( mongo *conn, mongo_bulk *bulk, mongo_bulk_result *result );
+
+/**
+ * Remove every queued write so the bulk writer can be reused.
+ *
+ * @param bulk a mongo_bulk.
+ */
+void mongo_bulk_clear( mongo_bulk *bulk );
+
+/**
+ * Free the errors stored in a bulk result.
+ *
+ * @param result a result filled in by mongo_bulk_execute( ).
+ */
+void mongo_bulk_result_destroy( mongo_bulk_result *result );
+
+/**
+ * Free the memory used by a bulk writer. The queued documents are
+ * owned by the caller and are not freed.
+ *
+ * @param bulk a mongo_bulk.
+ */
+void mongo_bulk_destroy( mongo_bulk *bulk );
+
 /**
  * Update a document in a MongoDB server.
  *
@@ -365,6 +673,19 @@ mongo_cursor *mongo_find( mongo *conn, const char *ns, bson *query,
  */
 void mongo_cursor_init( mongo_cursor *cursor, mongo *conn, const char *ns );
 
+/**
+ * Initalize a new cursor object for a prepared query. The namespace
+ * is borrowed from the prepared query instead of being copied, so q
+ * must outlive the cursor.
+ *
+ * @param cursor
+ * @param conn a mongo object.
+ * @param q a finished prepared query.
+ * @param query the query bound with mongo_prepared_bind().
+ */
+void mongo_cursor_init_prepared( mongo_cursor *cursor, mongo *conn,
+                                 const mongo_prepared *q, bson *query );
+
 /**
  * Set the bson object specifying this cursor's query spec. If
  * your query is the empty bson object "{}", then you need not
@@ -404,9 +725,50 @@ void mongo_cursor_set_skip( mongo_cursor *cursor, int skip );
  */
 void mongo_cursor_set_limit( mongo_cursor *cursor, int limit );
 
+/**
+ * Set the number of documents the server should return in each
+ * reply. When a limit is also set, the smaller of the two is used.
+ *
+ * @param cursor
+ * @param batch_size documents per batch, or 0 to let the server decide.
+ */
+void mongo_cursor_set_batch_size( mongo_cursor *cursor, int batch_size );
+
+/**
+ * Enable or disable read-ahead on this cursor. With read-ahead enabled,
+ * the getMore for the next batch is sent as soon as a batch arrives, so
+ * the server and the network produce the next batch while the caller
+ * is still iterating over the current one.
+ *
+ * @note While a getMore is in flight the cursor owns the connection
+ *   (MONGO_CONN_BUSY is set on it); any other operation on the connection
+ *   fails with MONGO_CONN_BUSY_ERROR until the cursor is exhausted or
+ *   destroyed.
+ *
+ * @param cursor
+ * @param prefetch non-zero to enable read-ahead.
+ */
+void mongo_cursor_set_prefetch( mongo_cursor *cursor, bson_bool_t prefetch );
+
+/**
+ * Ask the server to abandon the query once it has run for this long.
+ * The limit is sent as $maxTimeMS with the query; servers older than
+ * 2.6 ignore it.
+ *
+ * @param cursor
+ * @param max_time_ms the limit in milliseconds, or 0 for none.
+ */
+void mongo_cursor_set_max_time_ms( mongo_cursor *cursor, int max_time_ms );
+
 /**
  * Set any of the available query options (e.g., MONGO_TAILABLE).
  *
+ * With MONGO_EXHAUST the server streams every remaining batch after the
+ * first reply without waiting for getMore requests. The cursor owns the
+ * connection until the last batch has been read; destroying it earlier
+ * closes the connection, which must then be reconnected with
+ * mongo_reconnect(). The limit is not applied to exhaust cursors.
+ *
  * @param cursor
  * @param options a bitfield storing query options. See
  *   mongo_cursor_bitfield_t for available constants.
@@ -465,6 +827,199 @@ int mongo_cursor_destroy( mongo_cursor *cursor );
 bson_bool_t mongo_find_one( mongo *conn, const char *ns, bson *query,
                             bson *fields, bson *out );
 
+/**
+ * Find a single document without copying it. The reply is read into a
+ * buffer owned by the connection and reused by later borrowed queries,
+ * so once that buffer is large enough nothing is allocated.
+ *
+ * @param cursor a cursor set up with mongo_cursor_init() or
+ *     mongo_cursor_init_prepared(), usually on the stack. Its limit is
+ *     forced to 1.
+ * @param out set to a read-only view of the document. The view stays
+ *     valid until mongo_cursor_destroy() is called on the cursor, which
+ *     must happen before the next borrowed query on the connection.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if nothing matched or the query
+ *     failed. Check cursor->conn->err and cursor->err to tell them apart.
+ */
+int mongo_find_one_borrowed( mongo_cursor *cursor, const bson **out );
+
+/* Prepared query API */
+
+/* A prepared query compiles the field names and constant values of a
+ * query once; each execution only copies the skeleton and writes the
+ * parameter values into it. Constant elements are added to q->tmpl with
+ * the usual bson_append_* functions, in the order they should appear.
+ */
+
+/**
+ * Initialize a prepared query on a namespace.
+ *
+ * @param q a prepared query object allocated on the stack or heap.
+ * @param ns the namespace, e.g., "test.users". It is copied.
+ */
+void mongo_prepared_init( mongo_prepared *q, const char *ns );
+
+/**
+ * Append a parameter to a prepared query.
+ *
+ * @param q a prepared query that has not been finished.
+ * @param name the field name.
+ * @param type the BSON type of the value; BSON_STRING or BSON_LONG.
+ *
+ * @return the index of the parameter in the values given to
+ *     mongo_prepared_bind(), or MONGO_ERROR.
+ */
+int mongo_prepared_add_param( mongo_prepared *q, const char *name, int type );
+
+/**
+ * Have a prepared query return only some fields of the documents it
+ * matches. Without any, whole documents are returned. Adding the same
+ * field twice has no effect.
+ *
+ * @param q a prepared query that has not been finished.
+ * @param name the field name, possibly a dotted path.
+ * @param include 1 to return the field, 0 to leave it out (only
+ *     meaningful for _id when other fields are included).
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+int mongo_prepared_add_field( mongo_prepared *q, const char *name, int include );
+
+/**
+ * Finish a prepared query. No elements can be added afterwards.
+ *
+ * @return MONGO_OK or MONGO_ERROR if the skeleton is not valid BSON.
+ */
+int mongo_prepared_finish( mongo_prepared *q );
+
+/**
+ * Build a query from a prepared query and its parameter values.
+ *
+ * @param q a finished prepared query.
+ * @param values one value per parameter, in the order they were added.
+ * @param buf the buffer the query is written to.
+ * @param size the size of buf.
+ * @param out a bson object pointing into buf. It must not be passed to
+ *     bson_destroy().
+ *
+ * @return MONGO_OK, or MONGO_ERROR if buf is too small or a string
+ *     value is not valid UTF-8.
+ */
+int mongo_prepared_bind( const mongo_prepared *q, const mongo_prepared_value *values,
+                         char *buf, int size, bson *out );
+
+/**
+ * Release the resources held by a prepared query.
+ */
+void mongo_prepared_destroy( mongo_prepared *q );
+
+/* Connection pool API */
+
+/* A mongo object may only be used by one thread at a time. Threads that
+ * share a server should each check a connection out of a pool; error
+ * state (conn->err, conn->lasterrcode) then belongs to the operation
+ * the checking-out thread issued last. */
+
+/**
+ * Open a fixed-size pool of connections to a single server. Connections
+ * are opened concurrently; those that can't be opened now are retried
+ * when they are checked out.
+ *
+ * @param pool the pool to initialize.
+ * @param host a numerical network address or a network hostname.
+ * @param port the port to connect to.
+ * @param size the number of connections to open.
+ * @param cred credentials every connection authenticates with, or NULL.
+ *     They must outlive the pool.
+ *
+ * @return MONGO_OK if at least one connection was opened; otherwise
+ *     MONGO_ERROR. The pool must be passed to mongo_pool_destroy( )
+ *     in either case.
+ */
+int mongo_pool_init( mongo_pool *pool, const char *host, int port, int size,
+                     const mongo_credentials *cred );
+
+/**
+ * Reopen every idle connection, concurrently, in a background thread.
+ * Call this once a connection failed in a way that suggests the others
+ * are gone too, e.g. after a failover, so that the whole pool is back
+ * after about one handshake instead of one handshake per request.
+ * Threads acquiring a connection meanwhile wait until one is reopened.
+ * If the pool is already being reconnected, this does nothing.
+ *
+ * @param pool a mongo_pool.
+ */
+void mongo_pool_reconnect( mongo_pool *pool );
+
+/**
+ * Check a connection out of the pool, waiting until one is released
+ * if all of them are in use. A connection that was lost is reconnected
+ * before it is returned; check conn->connected if that matters.
+ *
+ * @param pool a mongo_pool.
+ *
+ * @return a connection for exclusive use by the caller.
+ */
+mongo *mongo_pool_acquire( mongo_pool *pool );
+
+/**
+ * Like mongo_pool_acquire( ), but give up at a deadline. The deadline is
+ * also set on the connection (see mongo_set_deadline( )) until it is
+ * released, so reconnecting a lost connection is bounded by it too.
+ *
+ * @param pool a mongo_pool.
+ * @param deadline_ms deadline as given by mongo_time_ms(), or 0 to wait
+ *     forever.
+ *
+ * @return a connection for exclusive use by the caller, or NULL if none
+ *     became available before the deadline.
+ */
+mongo *mongo_pool_acquire_timed( mongo_pool *pool, int64_t deadline_ms );
+
+/**
+ * Return a connection obtained from mongo_pool_acquire( ).
+ *
+ * @param pool a mongo_pool.
+ * @param conn the connection to return.
+ */
+void mongo_pool_release( mongo_pool *pool, mongo *conn );
+
+/**
+ * Close every connection and free the pool's memory. No connection
+ * may be checked out.
+ *
+ * @param pool a mongo_pool.
+ */
+void mongo_pool_destroy( mongo_pool *pool );
+
+/**
+ * Scan a collection with several cursors running concurrently, each on
+ * its own pooled connection.
+ *
+ * The collection is split into ranges of an indexed key. When the
+ * smallest and largest keys are both numbers or both ObjectIds, split
+ * points are interpolated between them; otherwise they are sampled at
+ * evenly spaced offsets in key order. Each range is read with $min/$max
+ * bounds on the { key: 1 } index, which is hinted, so every matching
+ * document is delivered exactly once whatever the key's type.
+ *
+ * @param pool the pool providing connections; at most pool->size
+ *     partitions run at the same time.
+ * @param ns the namespace.
+ * @param key a top-level field with an ascending index, e.g. "_id".
+ * @param query an additional filter, or NULL.
+ * @param fields the fields to return, or NULL for all fields.
+ * @param partitions the number of ranges to split the scan into.
+ * @param func called for every document, from several threads.
+ * @param arg passed to func.
+ *
+ * @return MONGO_OK if every partition completed; otherwise MONGO_ERROR.
+ */
+int mongo_parallel_scan( mongo_pool *pool, const char *ns, const char *key,
+                         bson *query, bson *fields, int partitions,
+                         mongo_scan_func func, void *arg );
+
 /* MongoDB Helper Functions */
 
 /**
@@ -482,7 +1037,8 @@ int64_t mongo_count( mongo *conn, const char *db, const char *coll,
                      bson *query );
 
 /**
- * Create a compouned index.
+ * Create a compouned index, with the createIndexes command or, on servers
+ * older than 2.6, through the system.indexes collection.
  *
  * @param conn a mongo object.
  * @param ns the namespace.
@@ -18,12 +18,59 @@
 /* Implementation for generic version of net.h */
 #include "net.h"
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#ifdef MSG_DONTWAIT
+/* Wait for the socket to become ready, at most until conn->deadline_ms.
+ * A request is in flight by then, so on timeout the connection is
+ * closed rather than left with a reply nobody will read. */
+static int mongo_wait_socket( mongo *conn, short events ) {
+    struct pollfd pfd;
+    int64_t left;
+    int res;
+
+    pfd.fd = conn->sock;
+    pfd.events = events;
+
+    do {
+        left = conn->deadline_ms - mongo_time_ms();
+        if( left <= 0 ) {
+            mongo_disconnect( conn );
+            conn->err = MONGO_DEADLINE_EXCEEDED;
+            return MONGO_ERROR;
+        }
+        res = poll( &pfd, 1, left > INT_MAX ? INT_MAX : ( int )left );
+    } while( res == 0 || ( res == -1 && errno == EINTR ) );
+
+    if( res == -1 ) {
+        conn->err = MONGO_IO_ERROR;
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+/* Without a deadline the socket is used in blocking mode as before. */
+#define mongo_socket_flags( conn ) ( ( conn )->deadline_ms ? MSG_DONTWAIT : 0 )
+#define mongo_socket_would_block( conn ) \
+    ( ( conn )->deadline_ms && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+#else
+#define mongo_socket_flags( conn ) 0
+#define mongo_socket_would_block( conn ) 0
+#define mongo_wait_socket( conn, events ) MONGO_ERROR
+#endif
 
 int mongo_write_socket( mongo *conn, const void *buf, int len ) {
     const char *cbuf = buf;
     while ( len ) {
-        int sent = send( conn->sock, cbuf, len, 0 );
+        int sent = send( conn->sock, cbuf, len, mongo_socket_flags( conn ) );
         if ( sent == -1 ) {
+            if( mongo_socket_would_block( conn ) ) {
+                if( mongo_wait_socket( conn, POLLOUT ) != MONGO_OK )
+                    return MONGO_ERROR;
+                continue;
+            }
             conn->err = MONGO_IO_ERROR;
             return MONGO_ERROR;
         }
@@ -37,7 +84,12 @@ int mongo_write_socket( mongo *conn, const void *buf, int len ) {
 int mongo_read_socket( mongo *conn, void *buf, int len ) {
     char *cbuf = buf;
     while ( len ) {
-        int sent = recv( conn->sock, cbuf, len, 0 );
+        int sent = recv( conn->sock, cbuf, len, mongo_socket_flags( conn ) );
+        if ( sent == -1 && mongo_socket_would_block( conn ) ) {
+            if( mongo_wait_socket( conn, POLLIN ) != MONGO_OK )
+                return MONGO_ERROR;
+            continue;
+        }
         if ( sent == 0 || sent == -1 ) {
             conn->err = MONGO_IO_ERROR;
             return MONGO_ERROR;
@@ -66,6 +118,55 @@ static int mongo_create_socket( mongo *conn ) {
     return MONGO_OK;
 }
 
+/* connect( ), giving up at conn->deadline_ms if there is one: an
+ * unreachable host would otherwise block for the kernel's SYN timeout. */
+static int mongo_connect_socket( mongo *conn, const struct sockaddr *sa, socklen_t len ) {
+#ifdef MSG_DONTWAIT
+    struct pollfd pfd;
+    socklen_t errlen = sizeof( int );
+    int64_t left;
+    int flags, res, err = 0;
+
+    if( conn->deadline_ms ) {
+        flags = fcntl( conn->sock, F_GETFL, 0 );
+        fcntl( conn->sock, F_SETFL, flags | O_NONBLOCK );
+
+        res = connect( conn->sock, sa, len );
+        if( res == -1 && errno == EINPROGRESS ) {
+            pfd.fd = conn->sock;
+            pfd.events = POLLOUT;
+            do {
+                left = conn->deadline_ms - mongo_time_ms();
+                res = left > 0 ? poll( &pfd, 1, left > INT_MAX ? INT_MAX : ( int )left ) : 0;
+            } while( res == -1 && errno == EINTR );
+
+            if( res == 0 ) {
+                conn->err = MONGO_DEADLINE_EXCEEDED;
+                return MONGO_ERROR;
+            }
+            if( res == -1 || getsockopt( conn->sock, SOL_SOCKET, SO_ERROR, &err, &errlen ) == -1 || err )
+                res = -1;
+            else
+                res = 0;
+        }
+
+        /* Back to blocking mode; reads and writes pass MSG_DONTWAIT. */
+        fcntl( conn->sock, F_SETFL, flags );
+        if( res == -1 ) {
+            conn->err = MONGO_CONN_FAIL;
+            return MONGO_ERROR;
+        }
+        return MONGO_OK;
+    }
+#endif
+
+    if( connect( conn->sock, sa, len ) == -1 ) {
+        conn->err = MONGO_CONN_FAIL;
+        return MONGO_ERROR;
+    }
+    return MONGO_OK;
+}
+
 int mongo_socket_connect( mongo *conn, const char *host, int port ) {
     struct sockaddr_in sa;
     socklen_t addressSize;
@@ -80,11 +181,10 @@ int mongo_socket_connect( mongo *conn, const char *host, int port ) {
     sa.sin_addr.s_addr = inet_addr( host );
     addressSize = sizeof( sa );
 
-    if ( connect( conn->sock, ( struct sockaddr * )&sa, addressSize ) == -1 ) {
+    if ( mongo_connect_socket( conn, ( struct sockaddr * )&sa, addressSize ) != MONGO_OK ) {
         mongo_close_socket( conn->sock );
         conn->connected = 0;
         conn->sock = 0;
-        conn->err = MONGO_CONN_FAIL;
         return MONGO_ERROR;
     }
 
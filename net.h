@@ -34,6 +34,7 @@ typedef int socklen_t;
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
+#include <poll.h>
 #define mongo_close_socket(sock) ( close(sock) )
 #endif
 
@@ -63,6 +63,16 @@ typedef unsigned long long int uint64_t;
 #define bson_big_endian32(out, in) ( bson_swap_endian32(out, in) )
 #endif
 
+/* Atomic integer operations, used for counters shared between threads. */
+#if defined(__GNUC__) && ( __GNUC__ > 4 || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 1 ) )
+#define mongo_atomic_inc(p) ( __sync_add_and_fetch( (p), 1 ) )
+#define mongo_atomic_cas(p, old, new) ( __sync_bool_compare_and_swap( (p), (old), (new) ) )
+#define mongo_atomic_or(p, v) ( __sync_fetch_and_or( (p), (v) ) )
+#define mongo_atomic_barrier() ( __sync_synchronize() )
+#else
+#error compiler must provide __sync atomic builtins
+#endif
+
 MONGO_EXTERN_C_START
 
 MONGO_INLINE void bson_swap_endian64( void *outp, const void *inp ) {
@@ -28,43 +28,228 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 
-#include "mongo.h"
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "rlm_mongo.h"
 
 #define MONGO_STRING_LENGTH 8196
+#define MONGO_MAX_FIELDS 32	/* read from user documents, see mongo_prepare_query() */
+
+#define MONGO_ACCT_PENDING -1
+#define MONGO_LOOKUP_DOWN -2	/* see find_radius_options() */
+#define MONGO_BATCH_PENDING -3
+#define MONGO_INDEX_WAIT 60	/* seconds to wait for create_index to build it */
+
+/* An accounting record waiting for its batch to be acknowledged. */
+typedef struct rlm_mongo_acct_entry {
+	bson	*doc;
+	int64_t	deadline;	/* see mongo_request_deadline(), 0 for none */
+	int		result;		/* RLM_MODULE_OK/FAIL, or MONGO_ACCT_PENDING */
+} rlm_mongo_acct_entry;
+
+/* An authorize lookup waiting for its batch, see mongo_batch_lookup(). */
+typedef struct rlm_mongo_batch_entry {
+	const char	*username;
+	int64_t	deadline;	/* see mongo_request_deadline(), 0 for none */
+	int64_t	queued;		/* see mongo_time_ms() */
+	char	*value;		/* see find_radius_options() */
+	size_t	size;
+	size_t	*len;
+	int		result;		/* of find_radius_options(), or MONGO_BATCH_PENDING */
+} rlm_mongo_batch_entry;
+
+/* A lookup in progress, which identical lookups wait for. */
+typedef struct rlm_mongo_flight {
+	struct rlm_mongo_flight	*next;
+	char		key[MAX_STRING_LEN * 2 + 2];	/* user \0 mac \0 */
+	size_t		key_len;
+	int		waiters;
+	int		done;
+	int		result;		/* of mongo_lookup() */
+	char		value[MONGO_STRING_LENGTH];	/* see mongo_pack_document() */
+	size_t		value_len;
+	pthread_cond_t	cond;
+} rlm_mongo_flight;
+
+/* A document field added to the reply or control items. */
+typedef struct rlm_mongo_map {
+	int		list;		/* RLM_MONGO_LIST_REPLY or RLM_MONGO_LIST_CONTROL */
+	const char	*attr;
+	const char	*field;
+	int		idx;		/* in fields */
+} rlm_mongo_map;
+
+/* Users to look up before traffic arrives, see mongo_warmup(). */
+typedef struct rlm_mongo_warmup {
+	struct rlm_mongo_t	*data;
+	char		(*keys)[MAX_STRING_LEN * 2 + 2];	/* user \0 mac \0 */
+	int		num_keys;
+	int		next;		/* next key to look up */
+	int		failed;
+} rlm_mongo_warmup;
 
 typedef struct rlm_mongo_t {
 	char	*ip;
 	int		port;
+	int		pool_size;
+	int		request_budget;
+
+	char	*auth_db;
+	char	*auth_user;
+	char	*auth_password;
+	mongo_credentials	cred;
 
 	char	*base;
 	char	*acct_base;
 	char	*search_field;
 	char	*username_field;
+	char	*key_field;
+	const char	*lookup_field;	/* key_field, or search_field */
+	int		username_lowercase;
+	int		username_strip_realm;
+	char	*username_strip_prefix;
 	char	*password_field;
 	char	*mac_field;
+	int		mac_binary;
 	char	*enable_field;
+
+	int		acct_w;
+	int		acct_journal;
+	int		acct_wtimeout;
+	int		acct_batch_size;
+
+	int		batch_window;
+	int		batch_size;
+
+	/* Group commit of accounting records, see mongo_account() */
+	mongo_write_concern	acct_wc;
+	mongo_bulk		acct_bulk;
+	pthread_mutex_t		acct_mutex;
+	pthread_cond_t		acct_cond;
+	rlm_mongo_acct_entry	**acct_queue;
+	int			acct_queued;
+	int			acct_queue_size;
+	rlm_mongo_acct_entry	**acct_batch;
+	int			acct_flushing;
+
+	int		cache_ttl;
+	int		cache_size;
+	int		cache_negative_ttl;
+	int		cache_negative_size;
+	int		cache_bloom_refresh;
+	char	*cache_invalidation;
+	char	*cache_snapshot;
+	int		cache_snapshot_interval;
+	int		cache_stale;
+	char	*cache_shm;
+	int		cache_shm_size;
+	int		cache_warmup;
+	int		cache_warmup_users;
+	int		cache_warmup_concurrency;
+	volatile int	backend_down;	/* MongoDB is failing, see mongo_lookup() */
+	rlm_mongo_cache_t	*cache;
+
+	int		create_index;
+	int		require_index;
+
+	int		replica;
+	rlm_mongo_replica_t	*local;		/* see mongo_authorize() */
+
+	pthread_mutex_t		flight_mutex;
+	rlm_mongo_flight	*flights;	/* see mongo_lookup_shared() */
+
+	/* Lookups merged into one query, see mongo_batch_lookup() */
+	pthread_mutex_t		batch_mutex;
+	pthread_cond_t		batch_cond;
+	rlm_mongo_batch_entry	**batch_queue;
+	int			batch_queued;
+	int			batch_queue_size;
+	rlm_mongo_batch_entry	**batch;
+	int			*batch_result;	/* of batch, until handed over */
+	int			batch_flushing;
+
+	mongo_prepared	query;		/* compiled authorize query, see find_radius_options() */
+	bson_extractor	fields;		/* what is read from its results */
+	int		password_idx;
+	int		search_idx;	/* only read by batches */
+	rlm_mongo_map	map[MONGO_MAX_FIELDS];	/* see mongo_map_section() */
+	int		num_maps;
+	mongo_pool	pool;
 } rlm_mongo_t;
 
 static const CONF_PARSER module_config[] = {
   { "port", PW_TYPE_INTEGER, offsetof(rlm_mongo_t,port), NULL, "27017" },
   { "ip",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,ip), NULL, "127.0.0.1"},
+  { "pool_size", PW_TYPE_INTEGER, offsetof(rlm_mongo_t,pool_size), NULL, "5" },
+  { "request_budget", PW_TYPE_INTEGER, offsetof(rlm_mongo_t,request_budget), NULL, "0" },
+  { "auth_db",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,auth_db), NULL, ""},
+  { "auth_user",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,auth_user), NULL, ""},
+  { "auth_password",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,auth_password), NULL, ""},
 
   { "base",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,base), NULL,  ""},
   { "acct_base",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,acct_base), NULL,  ""},
   { "search_field",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,search_field), NULL,  ""},
   { "username_field",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,username_field), NULL,  ""},
+  { "key_field",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,key_field), NULL,  ""},
+  { "username_lowercase",  PW_TYPE_BOOLEAN, offsetof(rlm_mongo_t,username_lowercase), NULL, "no" },
+  { "username_strip_realm",  PW_TYPE_BOOLEAN, offsetof(rlm_mongo_t,username_strip_realm), NULL, "no" },
+  { "username_strip_prefix",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,username_strip_prefix), NULL,  ""},
   { "password_field",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,password_field), NULL,  ""},
   { "mac_field",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,mac_field), NULL,  ""},
+  { "mac_binary",  PW_TYPE_BOOLEAN, offsetof(rlm_mongo_t,mac_binary), NULL, "no" },
   { "enable_field",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,enable_field), NULL,  ""},
 
+  { "cache_ttl",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,cache_ttl), NULL, "0" },
+  { "cache_size",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,cache_size), NULL, "16384" },
+  { "cache_negative_ttl",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,cache_negative_ttl), NULL, "0" },
+  { "cache_negative_size",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,cache_negative_size), NULL, "1024" },
+  { "cache_bloom_refresh",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,cache_bloom_refresh), NULL, "0" },
+  { "cache_invalidation",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,cache_invalidation), NULL, ""},
+  { "cache_snapshot",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,cache_snapshot), NULL, ""},
+  { "cache_snapshot_interval",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,cache_snapshot_interval), NULL, "300" },
+  { "cache_stale",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,cache_stale), NULL, "0" },
+  { "cache_shm",  PW_TYPE_STRING_PTR, offsetof(rlm_mongo_t,cache_shm), NULL, ""},
+  { "cache_shm_size",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,cache_shm_size), NULL, "16384" },
+  { "cache_warmup",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,cache_warmup), NULL, "0" },
+  { "cache_warmup_users",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,cache_warmup_users), NULL, "10000" },
+  { "cache_warmup_concurrency",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,cache_warmup_concurrency), NULL, "4" },
+
+  { "create_index",  PW_TYPE_BOOLEAN, offsetof(rlm_mongo_t,create_index), NULL, "no" },
+  { "require_index",  PW_TYPE_BOOLEAN, offsetof(rlm_mongo_t,require_index), NULL, "no" },
+
+  { "replica",  PW_TYPE_BOOLEAN, offsetof(rlm_mongo_t,replica), NULL, "no" },
+
+  { "batch_window",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,batch_window), NULL, "0" },
+  { "batch_size",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,batch_size), NULL, "32" },
+
+  { "acct_w",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,acct_w), NULL, "1" },
+  { "acct_journal",  PW_TYPE_BOOLEAN, offsetof(rlm_mongo_t,acct_journal), NULL, "no" },
+  { "acct_wtimeout",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,acct_wtimeout), NULL, "0" },
+  { "acct_batch_size",  PW_TYPE_INTEGER, offsetof(rlm_mongo_t,acct_batch_size), NULL, "100" },
+
   { NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
-mongo conn[1];
-
 static int mongo_start(rlm_mongo_t *data)
 {
-	if (mongo_connect(conn, data->ip, data->port)){
+	if (data->pool_size < 1) {
+		data->pool_size = 1;
+	}
+
+	if (strcmp(data->auth_user, "") != 0) {
+		/* Default to the database the users collection lives in */
+		char db[MONGO_STRING_LENGTH];
+		const char *dot = strchr(data->base, '.');
+
+		snprintf(db, sizeof(db), "%.*s", dot ? (int)(dot - data->base) : (int)strlen(data->base), data->base);
+		mongo_credentials_init(&data->cred, strcmp(data->auth_db, "") != 0 ? data->auth_db : db,
+				       data->auth_user, data->auth_password);
+	}
+
+	if (mongo_pool_init(&data->pool, data->ip, data->port, data->pool_size,
+			    data->cred.user ? &data->cred : NULL)){
 	  radlog(L_ERR, "rlm_mongodb: Failed to connect");
 	  return 0;
 	}
@@ -73,6 +258,42 @@ static int mongo_start(rlm_mongo_t *data)
 	return 1;
 }
 
+/*
+ *	Give a connection back to the pool. It can't be trusted after an
+ *	I/O error, and if the server failed over none of the others can
+ *	either, so the idle connections are all reopened at once in the
+ *	background rather than one by one as requests stumble on them.
+ */
+static void mongo_release_conn(rlm_mongo_t *data, mongo *conn)
+{
+	int lost = (conn->err == MONGO_IO_ERROR || conn->err == MONGO_READ_SIZE_ERROR);
+
+	if (lost) {
+		radlog(L_ERR, "rlm_mongo: mongo error, reconnecting");
+		mongo_disconnect(conn);
+	}
+	mongo_pool_release(&data->pool, conn);
+
+	if (lost) {
+		mongo_pool_reconnect(&data->pool);
+	}
+}
+
+/*
+ *	Work done for a request is useless once the NAS has given up on it,
+ *	so it is bounded by the time the request was received plus
+ *	request_budget milliseconds. Returns 0 (no deadline) if unset.
+ */
+static int64_t mongo_request_deadline(rlm_mongo_t *data, REQUEST *request)
+{
+	if (data->request_budget <= 0) {
+		return 0;
+	}
+
+	return (int64_t)request->packet->timestamp.tv_sec * 1000 +
+	       request->packet->timestamp.tv_usec / 1000 + data->request_budget;
+}
+
 /*
 static void find_in_array(bson_iterator *it, const char *key_ref, const char *value_ref, const char *key_needed, char *value_needed)
 {
@@ -104,22 +325,832 @@ static void find_in_array(bson_iterator *it, const char *key_ref, const char *va
 }
 */
 
-static int find_password(bson_iterator *it, const char *password_key, char *password)
+/*
+ *	Print a scalar field as pairmake() expects it. Returns 0 for other
+ *	types, and fields that weren't found.
+ */
+static int mongo_field_string(const bson_iterator *it, char *out, size_t size)
+{
+	switch (bson_iterator_type(it)) {
+		case BSON_STRING:
+			snprintf(out, size, "%s", bson_iterator_string(it));
+			return 1;
+		case BSON_INT:
+			snprintf(out, size, "%d", bson_iterator_int(it));
+			return 1;
+		case BSON_LONG:
+			snprintf(out, size, "%lld", (long long)bson_iterator_long(it));
+			return 1;
+		case BSON_DOUBLE:
+			snprintf(out, size, "%.15g", bson_iterator_double(it));
+			return 1;
+		case BSON_BOOL:
+			snprintf(out, size, "%d", bson_iterator_bool(it) ? 1 : 0);
+			return 1;
+		case BSON_DATE:
+			snprintf(out, size, "%lld", (long long)(bson_iterator_date(it) / 1000));
+			return 1;
+		case BSON_OID:
+			if (size >= 25) {
+				bson_oid_to_string(bson_iterator_oid(it), out);
+				return 1;
+			}
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+/*
+ *	Pack the password and the mapped fields of a user document, as
+ *	extracted by data->fields, into buf as rlm_mongo_cache_pack() does.
+ *	Returns the length, or 0 if they don't fit.
+ */
+static size_t mongo_pack_fields(rlm_mongo_t *data, const bson_iterator *found, char *buf, size_t size)
 {
-	bson_iterator i;
+	char value[MAX_STRING_LEN];
+	const char *password = "";
+	size_t len;
+	int i;
 
-	while(bson_iterator_next(it)) {
-		switch(bson_iterator_type(it)) {
+	if (data->password_idx >= 0 && bson_iterator_type(&found[data->password_idx]) == BSON_STRING) {
+		password = bson_iterator_string(&found[data->password_idx]);
+	}
+	len = rlm_mongo_cache_pack(buf, size, 0, RLM_MONGO_LIST_CONTROL, "Cleartext-Password", password);
+
+	for (i = 0; len && i < data->num_maps; i++) {
+		if (mongo_field_string(&found[data->map[i].idx], value, sizeof(value))) {
+			len = rlm_mongo_cache_pack(buf, size, len, data->map[i].list, data->map[i].attr, value);
+		}
+	}
+
+	return len;
+}
+
+static size_t mongo_pack_document(rlm_mongo_t *data, const char *doc, char *buf, size_t size)
+{
+	bson_iterator found[MONGO_MAX_FIELDS];
+
+	bson_extractor_run(&data->fields, doc, found);
+
+	return mongo_pack_fields(data, found, buf, size);
+}
+
+/*
+ *	Returns 1 and packs the attributes of the user into value (see
+ *	mongo_pack_document()) if a matching user was found, 0 if there is
+ *	none, MONGO_LOOKUP_DOWN if MongoDB could not be reached in time or
+ *	failed the query, and -1 if this lookup can't be answered anyway
+ *	(a username that isn't UTF-8, attributes too large). The fields go
+ *	straight from the reply buffer of the connection into value.
+ */
+static int find_radius_options(rlm_mongo_t *data, int64_t deadline, const char *username, const char *mac,
+			       char *value, size_t size, size_t *len)
+{
+	char buf[MONGO_STRING_LENGTH];
+	mongo_prepared_value values[2];
+	mongo_cursor cursor;
+	bson query;
+	const bson *result;
+	uint64_t bin;
+	mongo *conn;
+
+	/* Parameters are lookup_field, then mac_field when set */
+	values[0].str = username;
+	values[0].len = -1;
+	values[1].str = mac;
+	values[1].len = -1;
+	values[1].num = 0;
+	if (data->mac_binary && rlm_mongo_mac_parse(mac, &bin) == 0) {
+		values[1].num = (int64_t)bin;
+	}
+
+	if (mongo_prepared_bind(&data->query, values, buf, sizeof(buf), &query) != MONGO_OK) {
+		radlog(L_ERR, "rlm_mongo: can't build query for \"%s\"", username);
+		return -1;
+	}
+
+	DEBUG("Query:\n");
+	if (debug_flag) {
+		bson_print(&query);
+	}
+
+	conn = mongo_pool_acquire_timed(&data->pool, deadline);
+	if (!conn) {
+		radlog(L_ERR, "rlm_mongo: no connection available within request_budget");
+		return MONGO_LOOKUP_DOWN;
+	}
+
+	mongo_cursor_init_prepared(&cursor, conn, &data->query, &query);
+	if (deadline) {
+		/* Let the server drop the query too once nobody is waiting for it */
+		int64_t left = deadline - mongo_time_ms();
+		mongo_cursor_set_max_time_ms(&cursor, left > 1 ? (int)left : 1);
+	}
+
+	if (mongo_find_one_borrowed(&cursor, &result) != MONGO_OK) {
+		int failed = (conn->err != MONGO_CONN_SUCCESS || cursor.err == MONGO_CURSOR_QUERY_FAIL);
+
+		mongo_cursor_destroy(&cursor);
+		mongo_release_conn(data, conn);
+		if (failed) {
+			return MONGO_LOOKUP_DOWN;
+		}
+		DEBUG("Not found.\n");
+		return 0;
+	}
+
+	DEBUG("Result:\n");
+	if (debug_flag) {
+		bson_print((bson *)result);
+	}
+
+	// find_in_array(&it, data->username_field, username, data->password_field, password);
+	*len = mongo_pack_document(data, result->data, value, size);
+
+	mongo_cursor_destroy(&cursor);
+	mongo_pool_release(&data->pool, conn);
+
+	if (!*len) {
+		radlog(L_ERR, "rlm_mongo: attributes of \"%s\" too large", username);
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ *	The authorize query only changes in its values, so compile it once.
+ */
+static int mongo_prepare_query(rlm_mongo_t *data)
+{
+	int i;
+
+	mongo_prepared_init(&data->query, data->base);
+	bson_extractor_init(&data->fields);
+	data->password_idx = -1;
+	data->search_idx = -1;
+
+	if (mongo_prepared_add_param(&data->query, data->lookup_field, BSON_STRING) < 0) {
+		return -1;
+	}
+
+	if (strcmp(data->mac_field, "") != 0 &&
+	    mongo_prepared_add_param(&data->query, data->mac_field,
+				     data->mac_binary ? BSON_LONG : BSON_STRING) < 0) {
+		return -1;
+	}
+
+	if (strcmp(data->enable_field, "") != 0) {
+		bson_append_bool(&data->query.tmpl, data->enable_field, 1);
+	}
+
+	/*
+	 *	Only fetch what authorize reads: user documents also hold
+	 *	device lists, history and notes that are of no use here.
+	 */
+	if (strcmp(data->password_field, "") != 0) {
+		data->password_idx = bson_extractor_add(&data->fields, data->password_field);
+		if (mongo_prepared_add_field(&data->query, data->password_field, 1) != MONGO_OK) {
+			return -1;
+		}
+	}
+	for (i = 0; i < data->num_maps; i++) {
+		data->map[i].idx = bson_extractor_add(&data->fields, data->map[i].field);
+		if (mongo_prepared_add_field(&data->query, data->map[i].field, 1) != MONGO_OK) {
+			return -1;
+		}
+	}
+	/* Batches tell which user a document is for by its lookup_field */
+	if (data->batch_window > 0) {
+		data->search_idx = bson_extractor_add(&data->fields, data->lookup_field);
+		if (data->query.nfields &&
+		    mongo_prepared_add_field(&data->query, data->lookup_field, 1) != MONGO_OK) {
+			return -1;
+		}
+	}
+	/* Unless asked for above, in which case this is a no-op */
+	if (data->query.nfields && mongo_prepared_add_field(&data->query, "_id", 0) != MONGO_OK) {
+		return -1;
+	}
+
+	if (data->fields.nfields > MONGO_MAX_FIELDS) {
+		return -1;
+	}
+
+	return mongo_prepared_finish(&data->query) == MONGO_OK ? 0 : -1;
+}
+
+/*
+ *	Run the queued lookups as one query on lookup_field with $in, and
+ *	hand each document to the entries of its user. Called with
+ *	batch_mutex held by the thread that became the leader; the lock is
+ *	dropped while talking to MongoDB so that further lookups can queue
+ *	up for the next batch.
+ */
+static void mongo_batch_flush(rlm_mongo_t *data)
+{
+	bson_iterator found[MONGO_MAX_FIELDS];
+	char key[16];
+	mongo_cursor cursor;
+	bson query;
+	mongo *conn;
+	const char *user;
+	int64_t deadline = 0;
+	int *result = data->batch_result;
+	int i, k, n, built, missing;
+
+	n = data->batch_queued;
+	if (n > data->batch_size) {
+		n = data->batch_size;
+	}
+	memcpy(data->batch, data->batch_queue, n * sizeof(*data->batch));
+	memmove(data->batch_queue, data->batch_queue + n, (data->batch_queued - n) * sizeof(*data->batch_queue));
+	data->batch_queued -= n;
+	data->batch_flushing = 1;
+	pthread_mutex_unlock(&data->batch_mutex);
+
+	/* The batch is worth running for as long as any of its lookups is */
+	for (i = 0; i < n; i++) {
+		if (i == 0 || (deadline && (!data->batch[i]->deadline || data->batch[i]->deadline > deadline))) {
+			deadline = data->batch[i]->deadline;
+		}
+		result[i] = MONGO_BATCH_PENDING;
+	}
+
+	/* Nothing to merge: a lone lookup keeps its compiled query */
+	if (n == 1) {
+		i = find_radius_options(data, deadline, data->batch[0]->username, "",
+					data->batch[0]->value, data->batch[0]->size, data->batch[0]->len);
+		pthread_mutex_lock(&data->batch_mutex);
+		data->batch[0]->result = i;
+		data->batch_flushing = 0;
+		pthread_cond_broadcast(&data->batch_cond);
+		return;
+	}
+
+	bson_init(&query);
+	bson_append_start_object(&query, data->lookup_field);
+	bson_append_start_array(&query, "$in");
+	for (i = 0, k = 0; i < n; i++) {
+		bson_numstr(key, k);
+		if (bson_append_string(&query, key, data->batch[i]->username) != BSON_OK) {
+			/* Fail it alone, as find_radius_options() would */
+			radlog(L_ERR, "rlm_mongo: can't build query for \"%s\"", data->batch[i]->username);
+			query.err &= ~BSON_NOT_UTF8;
+			result[i] = -1;
+			continue;
+		}
+		k++;
+	}
+	bson_append_finish_array(&query);
+	bson_append_finish_object(&query);
+	if (strcmp(data->enable_field, "") != 0) {
+		bson_append_bool(&query, data->enable_field, 1);
+	}
+	built = (bson_finish(&query) == BSON_OK);
+
+	DEBUG("Query:\n");
+	if (debug_flag) {
+		bson_print(&query);
+	}
+
+	/* What the lookups without a document get */
+	missing = MONGO_LOOKUP_DOWN;
+	conn = mongo_pool_acquire_timed(&data->pool, deadline);
+	if (!conn) {
+		radlog(L_ERR, "rlm_mongo: no connection available for authorize batch of %d", n);
+	} else if (!built) {
+		radlog(L_ERR, "rlm_mongo: can't build query for authorize batch of %d", n);
+		mongo_pool_release(&data->pool, conn);
+		missing = -1;
+	} else {
+		mongo_cursor_init_prepared(&cursor, conn, &data->query, &query);
+		if (deadline) {
+			int64_t left = deadline - mongo_time_ms();
+			mongo_cursor_set_max_time_ms(&cursor, left > 1 ? (int)left : 1);
+		}
+
+		/*
+		 *	The entries belong to threads waiting for their result,
+		 *	which is only handed over under the lock below. A user
+		 *	queued twice gets the document twice.
+		 */
+		while (mongo_cursor_next(&cursor) == MONGO_OK) {
+			bson_extractor_run(&data->fields, cursor.current.data, found);
+			if (bson_iterator_type(&found[data->search_idx]) != BSON_STRING) {
+				continue;
+			}
+			user = bson_iterator_string(&found[data->search_idx]);
+
+			for (i = 0; i < n; i++) {
+				if (result[i] != MONGO_BATCH_PENDING ||
+				    strcmp(data->batch[i]->username, user) != 0) {
+					continue;
+				}
+				*data->batch[i]->len = mongo_pack_fields(data, found, data->batch[i]->value,
+									  data->batch[i]->size);
+				if (*data->batch[i]->len) {
+					result[i] = 1;
+				} else {
+					radlog(L_ERR, "rlm_mongo: attributes of \"%s\" too large", user);
+					result[i] = -1;
+				}
+			}
+		}
+
+		if (conn->err == MONGO_CONN_SUCCESS && cursor.err != MONGO_CURSOR_QUERY_FAIL) {
+			missing = 0;
+		}
+		mongo_cursor_destroy(&cursor);
+		mongo_release_conn(data, conn);
+	}
+	bson_destroy(&query);
+
+	pthread_mutex_lock(&data->batch_mutex);
+	for (i = 0; i < n; i++) {
+		if (result[i] == MONGO_BATCH_PENDING) {
+			result[i] = missing;
+		}
+		data->batch[i]->result = result[i];
+	}
+	data->batch_flushing = 0;
+	pthread_cond_broadcast(&data->batch_cond);
+}
+
+/*
+ *	As find_radius_options(), but the lookup is queued for batch_window
+ *	milliseconds so that concurrent lookups of other users share its
+ *	query and round trip. Whichever waiting thread finds no batch in
+ *	flight runs the next one once the oldest lookup has waited long
+ *	enough, or batch_size of them are queued.
+ */
+static int mongo_batch_lookup(rlm_mongo_t *data, int64_t deadline, const char *username,
+			      char *value, size_t size, size_t *len)
+{
+	rlm_mongo_batch_entry entry;
+	struct timespec ts;
+	int64_t until;
+	int i;
+
+	entry.username = username;
+	entry.deadline = deadline;
+	entry.queued = mongo_time_ms();
+	entry.value = value;
+	entry.size = size;
+	entry.len = len;
+	entry.result = MONGO_BATCH_PENDING;
+
+	pthread_mutex_lock(&data->batch_mutex);
+	if (data->batch_queued == data->batch_queue_size) {
+		data->batch_queue_size = data->batch_queue_size ? 2 * data->batch_queue_size : data->batch_size;
+		data->batch_queue = realloc(data->batch_queue, data->batch_queue_size * sizeof(*data->batch_queue));
+		if (!data->batch_queue) {
+			radlog(L_ERR, "rlm_mongo: out of memory");
+			abort();
+		}
+	}
+	data->batch_queue[data->batch_queued++] = &entry;
+	if (data->batch_queued >= data->batch_size) {
+		pthread_cond_broadcast(&data->batch_cond);
+	}
+
+	while (entry.result == MONGO_BATCH_PENDING) {
+		/*
+		 *	Without a batch in flight, wait for the oldest lookup's
+		 *	window to close, unless ours is due first.
+		 */
+		until = data->batch_queued ? data->batch_queue[0]->queued + data->batch_window : 0;
+		if (deadline && until > deadline) {
+			until = deadline;
+		}
+		if (data->batch_flushing) {
+			until = deadline;
+		} else if (data->batch_queued >= data->batch_size || until <= mongo_time_ms()) {
+			mongo_batch_flush(data);
+			continue;
+		}
+
+		ts.tv_sec = until / 1000;
+		ts.tv_nsec = (until % 1000) * 1000000;
+		if (!until) {
+			pthread_cond_wait(&data->batch_cond, &data->batch_mutex);
+		} else if (pthread_cond_timedwait(&data->batch_cond, &data->batch_mutex, &ts) == ETIMEDOUT &&
+			   deadline && until == deadline) {
+			/*
+			 *	Give up if the lookup is still queued. Once it is
+			 *	part of a batch in flight the leader writes its
+			 *	result into entry, so we have to wait for it.
+			 */
+			for (i = 0; i < data->batch_queued; i++) {
+				if (data->batch_queue[i] == &entry) {
+					memmove(data->batch_queue + i, data->batch_queue + i + 1,
+						(data->batch_queued - i - 1) * sizeof(*data->batch_queue));
+					data->batch_queued--;
+					entry.result = MONGO_LOOKUP_DOWN;
+					break;
+				}
+			}
+			deadline = 0;
+		}
+	}
+	pthread_mutex_unlock(&data->batch_mutex);
+
+	return entry.result;
+}
+
+/*
+ *	Query MongoDB for (username, mac) and cache the answer. Returns as
+ *	find_radius_options().
+ */
+static int mongo_lookup(rlm_mongo_t *data, int64_t deadline, const char *username, const char *mac,
+			time_t now, char *value, size_t size, size_t *len)
+{
+	unsigned int generation = 0;
+	int res;
+
+	if (data->cache) {
+		generation = rlm_mongo_cache_generation(data->cache, username);
+	}
+
+	if (data->batch_window > 0) {
+		res = mongo_batch_lookup(data, deadline, username, value, size, len);
+	} else {
+		res = find_radius_options(data, deadline, username, mac, value, size, len);
+	}
+
+	/*
+	 *	Only MongoDB's own failures count: a bad request must not make
+	 *	others be answered from stale entries. Any answer, including
+	 *	those of background refreshes, clears it.
+	 */
+	if (res == MONGO_LOOKUP_DOWN) {
+		data->backend_down = 1;
+	} else if (res >= 0) {
+		data->backend_down = 0;
+	}
+
+	if (data->cache && res == 0) {
+		rlm_mongo_cache_set(data->cache, username, mac, generation, now, NULL, 0);
+	} else if (data->cache && res == 1) {
+		rlm_mongo_cache_set(data->cache, username, mac, generation, now, value, *len);
+	}
+
+	return res;
+}
+
+/*
+ *	As mongo_lookup(), but if the same (username, mac) is already being
+ *	looked up, wait for that result rather than query MongoDB again:
+ *	EAP conversations and retransmits come in bursts.
+ */
+static int mongo_lookup_shared(rlm_mongo_t *data, int64_t deadline, const char *username,
+			       const char *mac, time_t now, char *value, size_t size, size_t *len)
+{
+	rlm_mongo_flight *f, **p;
+	struct timespec ts;
+	size_t user_len = strlen(username);
+	size_t mac_len = strlen(mac);
+	int res;
+
+	if (user_len + mac_len + 2 > sizeof(f->key)) {
+		return mongo_lookup(data, deadline, username, mac, now, value, size, len);
+	}
+
+	pthread_mutex_lock(&data->flight_mutex);
+	for (f = data->flights; f; f = f->next) {
+		if (f->key_len == user_len + mac_len + 2 &&
+		    memcmp(f->key, username, user_len + 1) == 0 &&
+		    memcmp(f->key + user_len + 1, mac, mac_len + 1) == 0) {
+			break;
+		}
+	}
+
+	if (f) {
+		ts.tv_sec = deadline / 1000;
+		ts.tv_nsec = (deadline % 1000) * 1000000;
+
+		f->waiters++;
+		while (!f->done) {
+			if (!deadline) {
+				pthread_cond_wait(&f->cond, &data->flight_mutex);
+			} else if (pthread_cond_timedwait(&f->cond, &data->flight_mutex, &ts) == ETIMEDOUT) {
+				break;
+			}
+		}
+
+		res = f->done ? f->result : MONGO_LOOKUP_DOWN;
+		if (res == 1 && f->value_len > size) {
+			res = -1;
+		} else if (res == 1) {
+			memcpy(value, f->value, f->value_len);
+			*len = f->value_len;
+		}
+
+		/* The last one out frees a finished lookup */
+		if (--f->waiters == 0 && f->done) {
+			pthread_cond_destroy(&f->cond);
+			free(f);
+		}
+		pthread_mutex_unlock(&data->flight_mutex);
+
+		return res;
+	}
+
+	f = rad_malloc(sizeof(*f));
+	memset(f, 0, sizeof(*f));
+	memcpy(f->key, username, user_len + 1);
+	memcpy(f->key + user_len + 1, mac, mac_len + 1);
+	f->key_len = user_len + mac_len + 2;
+	pthread_cond_init(&f->cond, NULL);
+	f->next = data->flights;
+	data->flights = f;
+	pthread_mutex_unlock(&data->flight_mutex);
+
+	res = mongo_lookup(data, deadline, username, mac, now, value, size, len);
+
+	pthread_mutex_lock(&data->flight_mutex);
+	for (p = &data->flights; *p != f; p = &(*p)->next);
+	*p = f->next;
+
+	f->done = 1;
+	f->result = res;
+	if (res == 1 && *len <= sizeof(f->value)) {
+		memcpy(f->value, value, *len);
+		f->value_len = *len;
+	} else if (res == 1) {
+		/* Nothing to hand over */
+		f->result = -1;
+	}
+	pthread_cond_broadcast(&f->cond);
+
+	if (f->waiters == 0) {
+		pthread_cond_destroy(&f->cond);
+		free(f);
+	}
+	pthread_mutex_unlock(&data->flight_mutex);
+
+	return res;
+}
+
+/*
+ *	Revalidates the cache snapshot of a previous instance, and entries
+ *	served stale. Only MongoDB failing is worth retrying.
+ */
+static int mongo_refresh(void *instance, const char *username, const char *mac)
+{
+	char value[MONGO_STRING_LENGTH];
+	size_t len;
+	int res;
+
+	res = mongo_lookup(instance, 0, username, mac, time(NULL), value, sizeof(value), &len);
+	if (res == MONGO_LOOKUP_DOWN) {
+		return -1;
+	}
+
+	return (res < 0) ? 1 : 0;
+}
+
+static void format_mac(char *in, char *out) {
+	int i;
+	for (i = 0; i < 6; i++) {
+		out[3 * i] = in[2 * i];
+		out[3 * i + 1] = in[2 * i + 1];
+		out[3 * i + 2] = ':';
+	}
+	out[17] = '\0';
+}
+
+/*
+ *	The mac that lookups are keyed and cached by: Calling-Station-Id as
+ *	format_mac() rewrites it or, with mac_binary, written in any way and
+ *	printed back by rlm_mongo_mac_print(). Returns -1 if that isn't a
+ *	MAC.
+ */
+static int mongo_mac_key(rlm_mongo_t *data, char *in, char *out)
+{
+	uint64_t mac;
+
+	if (!data->mac_binary) {
+		format_mac(in, out);
+		return 0;
+	}
+
+	if (rlm_mongo_mac_parse(in, &mac) < 0) {
+		out[0] = '\0';
+		return -1;
+	}
+	rlm_mongo_mac_print(mac, out);
+	return 0;
+}
+
+/*
+ *	The user that lookups are keyed and cached by: User-Name without
+ *	username_strip_prefix (such as "host/") and, if asked to, its
+ *	@realm, in lowercase if asked to. key_field holds users written
+ *	that way, so that lookups stay exact matches on an index.
+ */
+static void mongo_username_key(rlm_mongo_t *data, const char *in, char *out, size_t size)
+{
+	size_t prefix_len = strlen(data->username_strip_prefix);
+	const char *at;
+	size_t i, len;
+
+	if (prefix_len && strncasecmp(in, data->username_strip_prefix, prefix_len) == 0) {
+		in += prefix_len;
+	}
+
+	len = strlen(in);
+	if (data->username_strip_realm && (at = strrchr(in, '@')) != NULL) {
+		len = at - in;
+	}
+	if (len >= size) {
+		len = size - 1;
+	}
+
+	for (i = 0; i < len; i++) {
+		out[i] = data->username_lowercase ? tolower((unsigned char)in[i]) : in[i];
+	}
+	out[len] = '\0';
+}
+
+static void *mongo_warmup_thread(void *arg)
+{
+	rlm_mongo_warmup *w = arg;
+	int i;
+
+	while ((i = mongo_atomic_inc(&w->next) - 1) < w->num_keys) {
+		if (mongo_refresh(w->data, w->keys[i], w->keys[i] + strlen(w->keys[i]) + 1) < 0) {
+			mongo_atomic_inc(&w->failed);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ *	Fill the cache with the users seen in accounting over the last
+ *	cache_warmup seconds, newest first, so that the re-authentications
+ *	following a restart find them there. Accounting-On/Off records name
+ *	no user, hence the filter on Acct-Status-Type.
+ */
+static void mongo_warmup(rlm_mongo_t *data)
+{
+	rlm_mongo_warmup w;
+	pthread_t *threads;
+	uint32_t *seen, hash, mask;
+	bson query, fields;
+	bson_oid_t since;
+	bson_iterator it;
+	mongo_cursor cursor;
+	mongo *conn;
+	char mac_temp[MONGO_STRING_LENGTH];
+	char mac[MONGO_STRING_LENGTH];
+	char user[MAX_STRING_LEN];
+	int t, i, num_threads, started;
+	size_t user_len, mac_len;
+
+	memset(&w, 0, sizeof(w));
+	w.data = data;
+	w.keys = rad_malloc(data->cache_warmup_users * sizeof(*w.keys));
+	for (mask = 1; mask < 2 * (uint32_t)data->cache_warmup_users; mask *= 2);
+	seen = calloc(mask--, sizeof(*seen));
+	if (!seen) {
+		free(w.keys);
+		return;
+	}
+
+	/* ObjectIds start with their creation time */
+	memset(&since, 0, sizeof(since));
+	t = (int)(time(NULL) - data->cache_warmup);
+	bson_big_endian32(&since.ints[0], &t);
+
+	bson_init(&query);
+	bson_append_start_object(&query, "$query");
+	bson_append_start_object(&query, "_id");
+	bson_append_oid(&query, "$gte", &since);
+	bson_append_finish_object(&query);
+	bson_append_start_object(&query, "Acct-Status-Type");
+	bson_append_start_array(&query, "$in");
+	bson_append_int(&query, "0", PW_STATUS_START);
+	bson_append_int(&query, "1", PW_STATUS_ALIVE);
+	bson_append_int(&query, "2", PW_STATUS_STOP);
+	bson_append_finish_array(&query);
+	bson_append_finish_object(&query);
+	bson_append_finish_object(&query);
+	bson_append_start_object(&query, "$orderby");
+	bson_append_int(&query, "_id", -1);
+	bson_append_finish_object(&query);
+	bson_finish(&query);
+
+	bson_init(&fields);
+	bson_append_int(&fields, "User-Name", 1);
+	bson_append_int(&fields, "Calling-Station-Id", 1);
+	bson_finish(&fields);
+
+	conn = mongo_pool_acquire(&data->pool);
+	if (!conn) {
+		radlog(L_ERR, "rlm_mongo: cache warm-up: no connection to MongoDB");
+		goto done;
+	}
+
+	mongo_cursor_init(&cursor, conn, data->acct_base);
+	mongo_cursor_set_query(&cursor, &query);
+	mongo_cursor_set_fields(&cursor, &fields);
+
+	while (w.num_keys < data->cache_warmup_users && mongo_cursor_next(&cursor) == MONGO_OK) {
+		if (bson_find(&it, &cursor.current, "User-Name") != BSON_STRING) {
+			continue;
+		}
+		/* As mongo_authorize() builds them */
+		mongo_username_key(data, bson_iterator_string(&it), user, sizeof(user));
+		if (user[0] == '\0') {
+			continue;
+		}
+
+		mac[0] = '\0';
+		if (strcmp(data->mac_field, "") != 0) {
+			memset(mac_temp, 0, sizeof(mac_temp));
+			if (bson_find(&it, &cursor.current, "Calling-Station-Id") == BSON_STRING) {
+				snprintf(mac_temp, sizeof(mac_temp), "%s", bson_iterator_string(&it));
+			}
+			if (mongo_mac_key(data, mac_temp, mac) < 0) {
+				continue;
+			}
+		}
+
+		user_len = strlen(user);
+		mac_len = strlen(mac);
+		if (user_len + mac_len + 2 > sizeof(w.keys[0])) {
+			continue;
+		}
+
+		/* A collision only costs a user of the warm-up */
+		hash = fr_hash_update(mac, mac_len, fr_hash(user, user_len));
+		if (!hash) {
+			hash = 1;
+		}
+		for (i = hash & mask; seen[i] && seen[i] != hash; i = (i + 1) & mask);
+		if (seen[i]) {
+			continue;
+		}
+		seen[i] = hash;
+
+		memcpy(w.keys[w.num_keys], user, user_len + 1);
+		memcpy(w.keys[w.num_keys] + user_len + 1, mac, mac_len + 1);
+		w.num_keys++;
+	}
+	if (conn->err != MONGO_CONN_SUCCESS || cursor.err == MONGO_CURSOR_QUERY_FAIL) {
+		radlog(L_ERR, "rlm_mongo: cache warm-up: can't read %s", data->acct_base);
+	}
+	mongo_cursor_destroy(&cursor);
+	mongo_release_conn(data, conn);
+
+	/* More threads than connections would only queue for them */
+	num_threads = data->cache_warmup_concurrency;
+	if (num_threads > data->pool_size) {
+		num_threads = data->pool_size;
+	}
+	threads = rad_malloc(num_threads * sizeof(*threads));
+	for (started = 0; started < num_threads - 1; started++) {
+		if (pthread_create(&threads[started], NULL, mongo_warmup_thread, &w) != 0) {
+			break;
+		}
+	}
+	mongo_warmup_thread(&w);
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	radlog(L_INFO, "rlm_mongo: cache warmed up with %d of %d users seen in the last %d seconds",
+	       w.num_keys - w.failed, w.num_keys, data->cache_warmup);
+
+done:
+	bson_destroy(&fields);
+	bson_destroy(&query);
+	free(seen);
+	free(w.keys);
+}
+
+/*
+ *	Whether a query plan, as given by explain, reads the whole collection.
+ */
+static int mongo_plan_scans(bson_iterator *it)
+{
+	bson_iterator sub;
+
+	while (bson_iterator_next(it)) {
+		switch (bson_iterator_type(it)) {
 			case BSON_STRING:
-				if (strcmp(bson_iterator_key(it), password_key) == 0) {
-					strcpy(password, bson_iterator_string(it));
+				if (strcmp(bson_iterator_key(it), "stage") == 0 &&
+				    strcmp(bson_iterator_string(it), "COLLSCAN") == 0) {
 					return 1;
 				}
 				break;
 			case BSON_OBJECT:
 			case BSON_ARRAY:
-				bson_iterator_subiterator(it, &i);
-				if (find_password(&i, password_key, password) == 1) {
+				bson_iterator_subiterator(it, &sub);
+				if (mongo_plan_scans(&sub)) {
 					return 1;
 				}
 				break;
@@ -127,62 +1158,223 @@ static int find_password(bson_iterator *it, const char *password_key, char *pass
 				break;
 		}
 	}
+
 	return 0;
 }
 
-static int find_radius_options(rlm_mongo_t *data, const char *username, const char *mac, char *password)
+/*
+ *	Is an index being built on the collection ns? Returns -1 if the
+ *	server won't tell, e.g. the user may not run currentOp.
+ */
+static int mongo_index_building(mongo *conn, const char *ns, const char *coll)
 {
-	bson query, field, result;
-	bson_iterator it;
-
-	bson_init(&query);
-	bson_empty(&field);
+	bson cmd, out;
+	bson_iterator it, ops;
+	int res = -1;
 
-	bson_append_string(&query, data->search_field, username);
+	/* Reported as a command from 4.2 on, as a message before */
+	bson_init(&cmd);
+	bson_append_int(&cmd, "currentOp", 1);
+	bson_append_string(&cmd, "ns", ns);
+	bson_append_start_array(&cmd, "$or");
+	bson_append_start_object(&cmd, "0");
+	bson_append_string(&cmd, "command.createIndexes", coll);
+	bson_append_finish_object(&cmd);
+	bson_append_start_object(&cmd, "1");
+	bson_append_regex(&cmd, "msg", "^Index Build", "");
+	bson_append_finish_object(&cmd);
+	bson_append_finish_array(&cmd);
+	bson_finish(&cmd);
 
-	if (strcmp(data->mac_field, "") != 0) {
-		bson_append_string(&query, data->mac_field, mac);
+	if (mongo_run_command(conn, "admin", &cmd, &out) == MONGO_OK) {
+		if (bson_find(&it, &out, "inprog") == BSON_ARRAY) {
+			bson_iterator_subiterator(&it, &ops);
+			res = bson_iterator_next(&ops) ? 1 : 0;
+		}
+		bson_destroy(&out);
 	}
+	bson_destroy(&cmd);
 
-	if (strcmp(data->enable_field, "") != 0) {
-		bson_append_bool(&query, data->enable_field, 1);
+	return res;
+}
+
+/*
+ *	Create the index the authorize query needs if create_index is set,
+ *	then have the server explain how it would run that query, as a
+ *	missing index means a collection scan per Access-Request. Returns
+ *	-1 if it would scan the collection and require_index is set; not
+ *	being able to tell only gets a warning. The index is built in the
+ *	background, not to lock the database, and explain waits up to
+ *	MONGO_INDEX_WAIT seconds for the build: it doesn't use an index
+ *	until it is built.
+ */
+static int mongo_check_index(rlm_mongo_t *data)
+{
+	char buf[MONGO_STRING_LENGTH];
+	char db[MONGO_STRING_LENGTH];
+	mongo_prepared_value values[2];
+	bson key, cmd, query, planner, out = {NULL, 0};
+	bson_iterator it, plan;
+	const char *coll;
+	mongo *conn;
+	int64_t deadline;
+	int building = 0, scans;
+	int res = 0;
+
+	coll = strchr(data->base, '.');
+	if (!coll) {
+		return 0;
 	}
-	bson_finish(&query);
+	snprintf(db, sizeof(db), "%.*s", (int)(coll - data->base), data->base);
+	coll++;
 
-	DEBUG("Query:\n");
-	if (debug_flag) {
-		bson_print(&query);
+	conn = mongo_pool_acquire(&data->pool);
+	if (!conn) {
+		radlog(L_ERR, "rlm_mongo: can't check the indexes of %s: no connection to MongoDB", data->base);
+		return 0;
 	}
 
-	bson_bool_t res = mongo_find_one(conn, data->base, &query, &field, &result);
-	bson_destroy(&query);
+	if (data->create_index) {
+		/* Equality fields first, then the password so the query is covered */
+		bson_init(&key);
+		bson_append_int(&key, data->lookup_field, 1);
+		if (strcmp(data->mac_field, "") != 0) {
+			bson_append_int(&key, data->mac_field, 1);
+		}
+		if (strcmp(data->enable_field, "") != 0) {
+			bson_append_int(&key, data->enable_field, 1);
+		}
+		if (strcmp(data->password_field, "") != 0) {
+			bson_append_int(&key, data->password_field, 1);
+		}
+		bson_finish(&key);
 
-	if (res != MONGO_OK) {
-		DEBUG("Not found.\n");
+		deadline = mongo_time_ms() + MONGO_INDEX_WAIT * 1000;
+		mongo_set_deadline(conn, deadline);
+		if (mongo_create_index(conn, data->base, &key, MONGO_INDEX_BACKGROUND, &out) == MONGO_OK) {
+			while ((building = mongo_index_building(conn, data->base, coll)) > 0 &&
+			       mongo_time_ms() + 1000 < deadline) {
+				sleep(1);
+			}
+		} else if (conn->err == MONGO_DEADLINE_EXCEEDED) {
+			/* The server goes on building it */
+			building = 1;
+		} else {
+			radlog(L_ERR, "rlm_mongo: can't create the index of %s: %s", data->base,
+			       conn->lasterrstr ? conn->lasterrstr : "no reply");
+		}
+		bson_destroy(&out);
+		bson_destroy(&key);
+
+		/* Closed if the deadline passed mid-command */
+		mongo_set_deadline(conn, 0);
+		if (!conn->connected && mongo_reconnect(conn) != MONGO_OK) {
+			radlog(L_ERR, "rlm_mongo: can't check the indexes of %s: no connection to MongoDB",
+			       data->base);
+			mongo_release_conn(data, conn);
+			return 0;
+		}
+	}
+
+	/* Any value will do, only the shape of the query matters */
+	values[0].str = "";
+	values[0].len = 0;
+	values[1].str = "";
+	values[1].len = 0;
+	values[1].num = 0;
+	if (mongo_prepared_bind(&data->query, values, buf, sizeof(buf), &query) != MONGO_OK) {
+		mongo_release_conn(data, conn);
 		return 0;
 	}
 
-	DEBUG("Result:\n");
-	if (debug_flag) {
-		bson_print(&result);
+	bson_init(&cmd);
+	bson_append_start_object(&cmd, "explain");
+	bson_append_string(&cmd, "find", coll);
+	bson_append_bson(&cmd, "filter", &query);
+	if (data->query.nfields) {
+		bson_append_bson(&cmd, "projection", &data->query.fields);
 	}
+	bson_append_finish_object(&cmd);
+	bson_append_string(&cmd, "verbosity", "queryPlanner");
+	bson_finish(&cmd);
 
-	if ( res == MONGO_ERROR && conn->err == MONGO_IO_ERROR ) {
-		radlog(L_ERR, "rlm_mongo: mongo error, reconnecting");
-		mongo_reconnect(conn);
+	if (mongo_run_command(conn, db, &cmd, &out) != MONGO_OK ||
+	    bson_find(&it, &out, "queryPlanner") != BSON_OBJECT) {
+		radlog(L_ERR, "rlm_mongo: can't check that authorize queries on %s use an index", data->base);
+	} else {
+		bson_iterator_subobject(&it, &planner);
+		if (bson_find(&it, &planner, "winningPlan") == BSON_OBJECT) {
+			bson_iterator_subiterator(&it, &plan);
+			scans = mongo_plan_scans(&plan);
+			if (scans && building) {
+				radlog(L_ERR, "rlm_mongo: WARNING: can't tell yet whether authorize queries on %s "
+				       "use an index, it may still be being built", data->base);
+			} else if (scans) {
+				radlog(L_ERR, "rlm_mongo: WARNING: authorize queries scan the whole of %s, "
+				       "index %s (or set create_index = yes)", data->base, data->lookup_field);
+				res = data->require_index ? -1 : 0;
+			} else {
+				radlog(L_INFO, "rlm_mongo: authorize queries on %s use an index", data->base);
+			}
+		}
+	}
+	bson_destroy(&out);
+	bson_destroy(&cmd);
+	mongo_release_conn(data, conn);
+
+	return res;
+}
+
+/*
+ *	Read the attributes of the reply or control subsection, which map
+ *	RADIUS attributes to document fields:
+ *
+ *		reply {
+ *			Session-Timeout = "radius.session_timeout"
+ *		}
+ */
+static int mongo_map_section(rlm_mongo_t *data, CONF_SECTION *conf, const char *name, int list)
+{
+	CONF_SECTION *cs;
+	CONF_ITEM *ci;
+	CONF_PAIR *cp;
+
+	cs = cf_section_sub_find(conf, name);
+	if (!cs) {
 		return 0;
 	}
 
-	bson_iterator_init(&it, &result);
+	for (ci = cf_item_find_next(cs, NULL); ci; ci = cf_item_find_next(cs, ci)) {
+		if (!cf_item_is_pair(ci)) {
+			continue;
+		}
+		cp = cf_itemtopair(ci);
 
-	// find_in_array(&it, data->username_field, username, data->password_field, password);
-	find_password(&it, data->password_field, password);
-	return 1;
+		if (!dict_attrbyname(cf_pair_attr(cp))) {
+			radlog(L_ERR, "rlm_mongo: unknown attribute %s in %s", cf_pair_attr(cp), name);
+			return -1;
+		}
+		/* One field is kept for the password */
+		if (data->num_maps == MONGO_MAX_FIELDS - 1) {
+			radlog(L_ERR, "rlm_mongo: more than %d attributes in reply and control", MONGO_MAX_FIELDS - 1);
+			return -1;
+		}
+
+		data->map[data->num_maps].list = list;
+		data->map[data->num_maps].attr = cf_pair_attr(cp);
+		data->map[data->num_maps].field = cf_pair_value(cp);
+		data->num_maps++;
+	}
+
+	return 0;
 }
 
+static int mongo_detach(void *instance);
+
 static int mongo_instantiate(CONF_SECTION *conf, void **instance)
 {
 	rlm_mongo_t *data;
+	int shared = 0;
 
 	data = rad_malloc(sizeof(*data));
 	if (!data) {
@@ -195,21 +1387,150 @@ static int mongo_instantiate(CONF_SECTION *conf, void **instance)
 		return -1;
 	}
 
+	data->lookup_field = (strcmp(data->key_field, "") != 0) ? data->key_field : data->search_field;
+
+	if (data->acct_batch_size < 1) {
+		data->acct_batch_size = 1;
+	}
+	if (data->cache_warmup_concurrency < 1) {
+		data->cache_warmup_concurrency = 1;
+	}
+	if (data->batch_size < 1) {
+		data->batch_size = 1;
+	}
+	/* A batch only matches on lookup_field */
+	if (data->batch_window > 0 && strcmp(data->mac_field, "") != 0) {
+		radlog(L_INFO, "rlm_mongo: batch_window ignored, as mac_field is set");
+		data->batch_window = 0;
+	}
+
+	if (mongo_map_section(data, conf, "reply", RLM_MONGO_LIST_REPLY) < 0 ||
+	    mongo_map_section(data, conf, "control", RLM_MONGO_LIST_CONTROL) < 0) {
+		free(data);
+		return -1;
+	}
+
+	if (mongo_prepare_query(data) < 0) {
+		radlog(L_ERR, "rlm_mongo: invalid search_field or key_field, mac_field, enable_field, password_field or mapped field");
+		mongo_prepared_destroy(&data->query);
+		bson_extractor_destroy(&data->fields);
+		free(data);
+		return -1;
+	}
+
+	mongo_write_concern_init(&data->acct_wc);
+	data->acct_wc.w = data->acct_w;
+	data->acct_wc.j = data->acct_journal;
+	data->acct_wc.wtimeout = data->acct_wtimeout;
+
+	mongo_bulk_init(&data->acct_bulk, data->acct_base, MONGO_BULK_CONTINUE_ON_ERROR | MONGO_BULK_BATCH_ACK);
+	mongo_bulk_set_write_concern(&data->acct_bulk, &data->acct_wc);
+	pthread_mutex_init(&data->acct_mutex, NULL);
+	pthread_mutex_init(&data->flight_mutex, NULL);
+	pthread_cond_init(&data->acct_cond, NULL);
+	data->acct_batch = rad_malloc(data->acct_batch_size * sizeof(*data->acct_batch));
+	pthread_mutex_init(&data->batch_mutex, NULL);
+	pthread_cond_init(&data->batch_cond, NULL);
+	data->batch = rad_malloc(data->batch_size * sizeof(*data->batch));
+	data->batch_result = rad_malloc(data->batch_size * sizeof(*data->batch_result));
+
 	mongo_start(data);
 
+	if (mongo_check_index(data) < 0) {
+		radlog(L_ERR, "rlm_mongo: not starting without an index, as require_index is set");
+		mongo_detach(data);
+		return -1;
+	}
+
+	if (data->cache_ttl > 0 || data->cache_negative_ttl > 0 || data->cache_bloom_refresh > 0) {
+		data->cache = rlm_mongo_cache_create(data->cache_ttl, (size_t)data->cache_size * 1024,
+						     data->cache_negative_ttl,
+						     (size_t)data->cache_negative_size * 1024);
+
+		if (strcmp(data->cache_shm, "") != 0) {
+			if (rlm_mongo_cache_shm(data->cache, data->cache_shm, (size_t)data->cache_shm_size * 1024) < 0) {
+				radlog(L_ERR, "rlm_mongo: shared cache disabled");
+			} else {
+				shared = 1;
+			}
+		}
+
+		if (strcmp(data->cache_invalidation, "") != 0 &&
+		    rlm_mongo_cache_tail(data->cache, data->ip, data->port,
+					 data->cred.user ? &data->cred : NULL, data->cache_invalidation,
+					 data->lookup_field, data->mac_field) < 0) {
+			radlog(L_ERR, "rlm_mongo: cache invalidation disabled");
+		}
+
+		if (data->cache_bloom_refresh > 0 &&
+		    rlm_mongo_cache_bloom(data->cache, &data->pool, data->base,
+					  data->lookup_field, data->cache_bloom_refresh) < 0) {
+			radlog(L_ERR, "rlm_mongo: filter of existing users disabled");
+		}
+
+		if (data->cache_stale > 0 &&
+		    rlm_mongo_cache_stale(data->cache, data->cache_stale, mongo_refresh, data) < 0) {
+			radlog(L_ERR, "rlm_mongo: serving stale cache entries disabled");
+		}
+
+		/*
+		 *	Entries kept in shared memory are not in the snapshot,
+		 *	which would only save the few that did not fit; the
+		 *	segment outlives radiusd anyway.
+		 */
+		if (shared && strcmp(data->cache_snapshot, "") != 0) {
+			radlog(L_ERR, "rlm_mongo: cache_snapshot ignored, as cache_shm is set");
+		} else if (strcmp(data->cache_snapshot, "") != 0 &&
+		    rlm_mongo_cache_snapshot(data->cache, data->cache_snapshot, data->cache_snapshot_interval,
+					     mongo_refresh, data) < 0) {
+			radlog(L_ERR, "rlm_mongo: cache snapshot disabled");
+		}
+
+		if (data->cache_warmup > 0 && data->cache_warmup_users > 0 &&
+		    strcmp(data->acct_base, "") != 0) {
+			mongo_warmup(data);
+		}
+	}
+
+	if (data->replica) {
+		data->local = rlm_mongo_replica_create(&data->pool, data->pool_size, data->ip, data->port,
+						       data->cred.user ? &data->cred : NULL, data->base,
+						       data->lookup_field, data->mac_field, data->enable_field,
+						       data->query.nfields ? &data->query.fields : NULL);
+		if (!data->local) {
+			radlog(L_ERR, "rlm_mongo: replica disabled");
+		}
+	}
+
 	*instance = data;
 
 	return 0;
 }
 
-static void format_mac(char *in, char *out) {
-	int i;
-	for (i = 0; i < 6; i++) {
-		out[3 * i] = in[2 * i];
-		out[3 * i + 1] = in[2 * i + 1];
-		out[3 * i + 2] = ':';
+/*
+ *	Answer from an expired cache entry, if there is one recent enough,
+ *	and have it refreshed in the background. Returns 0 if there is none.
+ */
+static int mongo_authorize_stale(rlm_mongo_t *data, REQUEST *request, const char *username,
+				 const char *mac, int *rcode)
+{
+	char cached[MONGO_STRING_LENGTH];
+	int len;
+
+	len = rlm_mongo_cache_get_stale(data->cache, username, mac, request->timestamp,
+					cached, sizeof(cached));
+	if (len == RLM_MONGO_CACHE_MISS) {
+		return 0;
 	}
-	out[17] = '\0';
+	rlm_mongo_cache_refresh(data->cache, username, mac);
+
+	RDEBUG("Authorisation request by username -> \"%s\" answered from stale cache\n", username);
+	if (len == RLM_MONGO_CACHE_NOTFOUND) {
+		*rcode = RLM_MODULE_REJECT;
+	} else {
+		*rcode = (rlm_mongo_cache_apply(request, cached, len) == 0) ? RLM_MODULE_OK : RLM_MODULE_FAIL;
+	}
+	return 1;
 }
 
 static int mongo_authorize(void *instance, REQUEST *request)
@@ -219,34 +1540,263 @@ static int mongo_authorize(void *instance, REQUEST *request)
 	}
 
 	rlm_mongo_t *data = (rlm_mongo_t *) instance;
+	char username[MAX_STRING_LEN];
 
-	char password[MONGO_STRING_LENGTH] = "";
 	char mac[MONGO_STRING_LENGTH] = "";
+	char cached[MONGO_STRING_LENGTH];
+	size_t value_len;
+	int len, rcode;
+
+	mongo_username_key(data, request->username->vp_strvalue, username, sizeof(username));
+	if (username[0] == '\0') {
+		return RLM_MODULE_NOOP;
+	}
 
 	if (strcmp(data->mac_field, "") != 0) {
 		char mac_temp[MONGO_STRING_LENGTH] = "";
 		radius_xlat(mac_temp, MONGO_STRING_LENGTH, "%{Calling-Station-Id}", request, NULL);
-		format_mac(mac_temp, mac);
+		if (mongo_mac_key(data, mac_temp, mac) < 0) {
+			RDEBUG("Authorisation request by username -> \"%s\" from invalid Calling-Station-Id \"%s\"\n",
+			       username, mac_temp);
+			return RLM_MODULE_REJECT;
+		}
 	}
 
-	if (!find_radius_options(data, request->username->vp_strvalue, mac, password)) {
-		return RLM_MODULE_REJECT;
+	/*
+	 *	The replica answers everything locally once loaded, and until
+	 *	then defers to the cache and MongoDB.
+	 */
+	if (data->local) {
+		char doc[MONGO_STRING_LENGTH];
+
+		switch (rlm_mongo_replica_find(data->local, username, mac, doc, sizeof(doc))) {
+			case 0:
+				RDEBUG("Authorisation request by username -> \"%s\" not in replica\n", username);
+				return RLM_MODULE_REJECT;
+			case 1:
+				value_len = mongo_pack_document(data, doc, cached, sizeof(cached));
+				if (!value_len) {
+					return RLM_MODULE_FAIL;
+				}
+				RDEBUG("Authorisation request by username -> \"%s\" found in replica\n", username);
+				return (rlm_mongo_cache_apply(request, cached, value_len) == 0) ? RLM_MODULE_OK : RLM_MODULE_FAIL;
+		}
 	}
 
-	RDEBUG("Authorisation request by username -> \"%s\"\n", request->username->vp_strvalue);
-	RDEBUG("Password found in MongoDB -> \"%s\"\n\n", password);
+	if (data->cache) {
+		len = rlm_mongo_cache_get(data->cache, username, mac, request->timestamp, cached, sizeof(cached));
+		if (len >= 0) {
+			RDEBUG("Authorisation request by username -> \"%s\" found in cache\n", username);
+			return (rlm_mongo_cache_apply(request, cached, len) == 0) ? RLM_MODULE_OK : RLM_MODULE_FAIL;
+		}
+		if (len == RLM_MONGO_CACHE_NOTFOUND) {
+			RDEBUG("Authorisation request by username -> \"%s\" cached as unknown\n", username);
+			return RLM_MODULE_REJECT;
+		}
+		if (!rlm_mongo_cache_may_exist(data->cache, username)) {
+			RDEBUG("Authorisation request by username -> \"%s\" unknown\n", username);
+			return RLM_MODULE_REJECT;
+		}
+	}
 
-	VALUE_PAIR *vp;
+	/*
+	 *	While MongoDB is failing, don't make the request wait for it
+	 *	if an expired entry can answer.
+	 */
+	if (data->cache && data->backend_down &&
+	    mongo_authorize_stale(data, request, username, mac, &rcode)) {
+		return rcode;
+	}
 
- 	vp = pairmake("Cleartext-Password", password, T_OP_SET);
-	if (!vp) {
-		return RLM_MODULE_FAIL;
+	switch (mongo_lookup_shared(data, mongo_request_deadline(data, request), username, mac,
+				    request->timestamp, cached, sizeof(cached), &value_len)) {
+		case 1:
+			break;
+		case 0:
+			return RLM_MODULE_REJECT;
+		default:
+			if (data->cache && mongo_authorize_stale(data, request, username, mac, &rcode)) {
+				return rcode;
+			}
+			return RLM_MODULE_FAIL;
 	}
 
-	pairmove(&request->config_items, &vp);
-	pairfree(&vp);
+	RDEBUG("Authorisation request by username -> \"%s\" found in MongoDB\n", username);
 
-	return RLM_MODULE_OK;
+	return (rlm_mongo_cache_apply(request, cached, value_len) == 0) ? RLM_MODULE_OK : RLM_MODULE_FAIL;
+}
+
+/*
+ *	Was a failed accounting batch cut short by the connection or by the
+ *	primary stepping down, rather than refused?
+ */
+static int mongo_acct_retryable(const mongo_bulk_result *result)
+{
+	const mongo_bulk_error *e;
+	int i;
+
+	for (i = 0; i < result->nerrors; i++) {
+		e = &result->errors[i];
+		if (e->err == MONGO_IO_ERROR || e->err == MONGO_READ_SIZE_ERROR) {
+			return 1;
+		}
+		if (e->err == MONGO_WRITE_ERROR &&
+		    (e->code == 10058 || e->code == 10107 || e->code == 13435 || e->code == 13436 ||
+		     (e->errmsg && strncmp(e->errmsg, "not master", 10) == 0))) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	Did a batch only fail on records that were already there? Only
+ *	the last error of each insert message is known (see
+ *	mongo_bulk_execute()), so a duplicate may hide another failure
+ *	earlier in the same message: this is a best guess.
+ */
+static int mongo_acct_duplicates(const mongo_bulk_result *result)
+{
+	int i;
+
+	for (i = 0; i < result->nerrors; i++) {
+		if (result->errors[i].err != MONGO_WRITE_ERROR ||
+		    (result->errors[i].code != 11000 && result->errors[i].code != 11001)) {
+			return 0;
+		}
+	}
+
+	return result->nerrors > 0;
+}
+
+/*
+ *	Write out up to acct_batch_size queued records with a single
+ *	acknowledgement. Called with acct_mutex held by the thread that
+ *	became the leader; the lock is dropped while talking to MongoDB so
+ *	that further records can queue up for the next batch.
+ */
+static void mongo_acct_flush(rlm_mongo_t *data)
+{
+	mongo_bulk_result result;
+	mongo *conn;
+	int64_t deadline = 0;
+	int i, n, res, retry, again;
+
+	n = data->acct_queued;
+	if (n > data->acct_batch_size) {
+		n = data->acct_batch_size;
+	}
+	memcpy(data->acct_batch, data->acct_queue, n * sizeof(*data->acct_batch));
+	memmove(data->acct_queue, data->acct_queue + n, (data->acct_queued - n) * sizeof(*data->acct_queue));
+	data->acct_queued -= n;
+	data->acct_flushing = 1;
+	pthread_mutex_unlock(&data->acct_mutex);
+
+	/* The batch is worth writing for as long as any of its records is */
+	mongo_bulk_clear(&data->acct_bulk);
+	for (i = 0; i < n; i++) {
+		mongo_bulk_insert(&data->acct_bulk, data->acct_batch[i]->doc);
+		if (i == 0 || (deadline && (!data->acct_batch[i]->deadline || data->acct_batch[i]->deadline > deadline))) {
+			deadline = data->acct_batch[i]->deadline;
+		}
+	}
+
+	/*
+	 *	If the connection broke or the primary stepped down, any part
+	 *	of the batch may have been applied. Retry once on a fresh
+	 *	connection: the insert continues past errors, and as every
+	 *	record has its own _id, those written the first time fail
+	 *	with a duplicate key and the others go in. Records the server
+	 *	refused aren't retried.
+	 */
+	conn = mongo_pool_acquire_timed(&data->pool, deadline);
+	res = MONGO_ERROR;
+	for (retry = 0; conn && retry < 2; retry++) {
+		res = mongo_bulk_execute(conn, &data->acct_bulk, &result);
+		if (res != MONGO_OK && retry && mongo_acct_duplicates(&result)) {
+			res = MONGO_OK;
+		}
+		if (res != MONGO_OK) {
+			radlog(L_ERR, "rlm_mongo: accounting batch of %d failed: %s", n,
+			       (result.nerrors && result.errors[0].errmsg) ? result.errors[0].errmsg : "connection error");
+		}
+		again = (res != MONGO_OK && !retry && mongo_acct_retryable(&result));
+		mongo_bulk_result_destroy(&result);
+
+		if (!again || mongo_reconnect(conn) != MONGO_OK) {
+			break;
+		}
+	}
+	if (conn) {
+		mongo_pool_release(&data->pool, conn);
+	} else {
+		radlog(L_ERR, "rlm_mongo: no connection available for accounting batch of %d", n);
+	}
+
+	pthread_mutex_lock(&data->acct_mutex);
+	for (i = 0; i < n; i++) {
+		data->acct_batch[i]->result = (res == MONGO_OK) ? RLM_MODULE_OK : RLM_MODULE_FAIL;
+	}
+	data->acct_flushing = 0;
+	pthread_cond_broadcast(&data->acct_cond);
+}
+
+/*
+ *	Queue a record and wait until a batch containing it has been
+ *	acknowledged. Whichever waiting thread finds no batch in flight
+ *	writes the next one, so concurrent accounting requests share a
+ *	single getlasterror round trip.
+ */
+static int mongo_acct_commit(rlm_mongo_t *data, bson *doc, int64_t deadline)
+{
+	rlm_mongo_acct_entry entry;
+	struct timespec ts;
+	int i;
+
+	entry.doc = doc;
+	entry.deadline = deadline;
+	entry.result = MONGO_ACCT_PENDING;
+	ts.tv_sec = deadline / 1000;
+	ts.tv_nsec = (deadline % 1000) * 1000000;
+
+	pthread_mutex_lock(&data->acct_mutex);
+	if (data->acct_queued == data->acct_queue_size) {
+		data->acct_queue_size = data->acct_queue_size ? 2 * data->acct_queue_size : data->acct_batch_size;
+		data->acct_queue = realloc(data->acct_queue, data->acct_queue_size * sizeof(*data->acct_queue));
+		if (!data->acct_queue) {
+			radlog(L_ERR, "rlm_mongo: out of memory");
+			abort();
+		}
+	}
+	data->acct_queue[data->acct_queued++] = &entry;
+
+	while (entry.result == MONGO_ACCT_PENDING) {
+		if (!data->acct_flushing) {
+			mongo_acct_flush(data);
+		} else if (!deadline) {
+			pthread_cond_wait(&data->acct_cond, &data->acct_mutex);
+		} else if (pthread_cond_timedwait(&data->acct_cond, &data->acct_mutex, &ts) == ETIMEDOUT) {
+			/*
+			 *	Give up if the record is still queued. Once it is
+			 *	part of a batch in flight the leader writes its
+			 *	result into entry, so we have to wait for it.
+			 */
+			for (i = 0; i < data->acct_queued; i++) {
+				if (data->acct_queue[i] == &entry) {
+					memmove(data->acct_queue + i, data->acct_queue + i + 1,
+						(data->acct_queued - i - 1) * sizeof(*data->acct_queue));
+					data->acct_queued--;
+					entry.result = RLM_MODULE_FAIL;
+					break;
+				}
+			}
+			deadline = 0;
+		}
+	}
+	pthread_mutex_unlock(&data->acct_mutex);
+
+	return entry.result;
 }
 
 /* Saves accounting information */
@@ -257,6 +1807,8 @@ static int mongo_account(void *instance, REQUEST *request)
 	const char *attr;
 	char value[MAX_STRING_LEN+1];
 	VALUE_PAIR *vp = request->packet->vps;
+	int64_t deadline = mongo_request_deadline(data, request);
+	int res;
 
 	bson_init(&buf);
 	bson_append_new_oid(&buf, "_id");
@@ -283,19 +1835,53 @@ static int mongo_account(void *instance, REQUEST *request)
 	}
 	bson_finish(&buf);
 
-	int res = mongo_insert(conn, data->acct_base, &buf);
-	if (res != MONGO_OK) {
+	if (data->acct_w == 0) {
+		/* Unacknowledged, as fast and as lossy as it gets */
+		mongo *conn = mongo_pool_acquire_timed(&data->pool, deadline);
+
+		res = RLM_MODULE_FAIL;
+		if (conn) {
+			res = (mongo_insert(conn, data->acct_base, &buf) == MONGO_OK) ? RLM_MODULE_OK : RLM_MODULE_FAIL;
+			mongo_release_conn(data, conn);
+		}
+	} else {
+		res = mongo_acct_commit(data, &buf, deadline);
+	}
+	bson_destroy(&buf);
+
+	if (res != RLM_MODULE_OK) {
 		radlog(L_ERR, "mongo_insert failed");
 		return RLM_MODULE_FAIL;
 	}
 	RDEBUG("accounting record was inserted");
 
-	bson_destroy(&buf);
 	return RLM_MODULE_OK;
 }
 
 static int mongo_detach(void *instance)
 {
+	rlm_mongo_t *data = (rlm_mongo_t *) instance;
+
+	mongo_bulk_destroy(&data->acct_bulk);
+	pthread_mutex_destroy(&data->acct_mutex);
+	pthread_mutex_destroy(&data->flight_mutex);
+	pthread_cond_destroy(&data->acct_cond);
+	free(data->acct_queue);
+	free(data->acct_batch);
+	pthread_mutex_destroy(&data->batch_mutex);
+	pthread_cond_destroy(&data->batch_cond);
+	free(data->batch_queue);
+	free(data->batch);
+	free(data->batch_result);
+	rlm_mongo_replica_free(data->local);
+	rlm_mongo_cache_free(data->cache);
+	mongo_prepared_destroy(&data->query);
+	bson_extractor_destroy(&data->fields);
+	mongo_pool_destroy(&data->pool);
+	if (data->cred.user) {
+		mongo_credentials_destroy(&data->cred);
+	}
+
 	free(instance);
 	return 0;
 }
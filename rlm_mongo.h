@@ -0,0 +1,106 @@
+/*
+ * rlm_mongo.h
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010 Guillaume Rose <guillaume.rose@gmail.com>
+ */
+#ifndef RLM_MONGO_H
+#define RLM_MONGO_H
+
+#include <freeradius-devel/ident.h>
+RCSIDH(rlm_mongo_h, "$Id$")
+
+#include <freeradius-devel/radiusd.h>
+
+#include "mongo.h"
+
+/*
+ *	Lists the attributes of a cached result are added to.
+ */
+#define RLM_MONGO_LIST_CONTROL	0
+#define RLM_MONGO_LIST_REPLY	1
+
+/*
+ *	In-process cache of authorize results, keyed by (user, mac). The
+ *	value is an opaque blob built with rlm_mongo_cache_pack().
+ */
+typedef struct rlm_mongo_cache rlm_mongo_cache_t;
+
+/*
+ *	Return values of rlm_mongo_cache_get() other than a length.
+ */
+#define RLM_MONGO_CACHE_MISS		-1
+#define RLM_MONGO_CACHE_NOTFOUND	-2
+
+rlm_mongo_cache_t *rlm_mongo_cache_create(int ttl, size_t max_bytes,
+					  int negative_ttl, size_t negative_max_bytes);
+void rlm_mongo_cache_free(rlm_mongo_cache_t *cache);
+
+int rlm_mongo_cache_get(rlm_mongo_cache_t *cache, const char *user, const char *mac,
+			time_t now, char *value, size_t size);
+unsigned int rlm_mongo_cache_generation(rlm_mongo_cache_t *cache, const char *user);
+void rlm_mongo_cache_set(rlm_mongo_cache_t *cache, const char *user, const char *mac,
+			 unsigned int generation, time_t now, const char *value, size_t len);
+void rlm_mongo_cache_invalidate(rlm_mongo_cache_t *cache, const char *user, const char *mac);
+void rlm_mongo_cache_flush(rlm_mongo_cache_t *cache);
+int rlm_mongo_cache_shm(rlm_mongo_cache_t *cache, const char *name, size_t size);
+
+/*
+ *	Looks (user, mac) up in MongoDB and caches the result; returns -1
+ *	if MongoDB couldn't be queried, or 1 if it can't answer for that
+ *	key (no use retrying).
+ */
+typedef int (*rlm_mongo_cache_refresh_t)(void *ctx, const char *user, const char *mac);
+
+int rlm_mongo_cache_snapshot(rlm_mongo_cache_t *cache, const char *path, int interval,
+			     rlm_mongo_cache_refresh_t refresh, void *ctx);
+int rlm_mongo_cache_stale(rlm_mongo_cache_t *cache, int stale,
+			  rlm_mongo_cache_refresh_t refresh, void *ctx);
+int rlm_mongo_cache_get_stale(rlm_mongo_cache_t *cache, const char *user, const char *mac,
+			      time_t now, char *value, size_t size);
+void rlm_mongo_cache_refresh(rlm_mongo_cache_t *cache, const char *user, const char *mac);
+int rlm_mongo_cache_tail(rlm_mongo_cache_t *cache, const char *host, int port,
+			 const mongo_credentials *cred, const char *ns,
+			 const char *search_field, const char *mac_field);
+int rlm_mongo_cache_bloom(rlm_mongo_cache_t *cache, mongo_pool *pool, const char *ns,
+			  const char *search_field, int refresh);
+int rlm_mongo_cache_may_exist(rlm_mongo_cache_t *cache, const char *user);
+
+/*
+ *	In-memory copy of the users collection, kept current by following
+ *	the oplog.
+ */
+typedef struct rlm_mongo_replica rlm_mongo_replica_t;
+
+rlm_mongo_replica_t *rlm_mongo_replica_create(mongo_pool *pool, int partitions,
+					      const char *host, int port,
+					      const mongo_credentials *cred, const char *ns,
+					      const char *search_field, const char *mac_field,
+					      const char *enable_field, const bson *fields);
+void rlm_mongo_replica_free(rlm_mongo_replica_t *replica);
+int rlm_mongo_replica_find(rlm_mongo_replica_t *replica, const char *user, const char *mac,
+			   char *buf, size_t size);
+
+size_t rlm_mongo_cache_pack(char *buf, size_t size, size_t used, int list,
+			    const char *attr, const char *value);
+int rlm_mongo_cache_apply(REQUEST *request, const char *value, size_t len);
+
+int rlm_mongo_mac_parse(const char *in, uint64_t *mac);
+void rlm_mongo_mac_print(uint64_t mac, char *out);
+
+#endif
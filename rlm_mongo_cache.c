@@ -0,0 +1,2081 @@
+/*
+ * rlm_mongo_cache.c
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010 Guillaume Rose <guillaume.rose@gmail.com>
+ */
+
+#include <freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rlm_mongo.h"
+#include "md5.h"
+
+/*
+ *	The cache is split into shards, each with its own lock, hash table
+ *	and LRU list, so that concurrent requests for different users
+ *	rarely contend. Entries are hashed on the user alone, which keeps
+ *	every MAC of a user in the same bucket for invalidation.
+ */
+#define CACHE_SHARDS		16
+#define CACHE_INITIAL_BUCKETS	64
+
+/*
+ *	Results that a user doesn't exist are kept apart from the others,
+ *	with their own TTL and size bound, so that a flood of unknown users
+ *	can't evict the entries of real ones.
+ */
+#define CACHE_POSITIVE		0
+#define CACHE_NEGATIVE		1
+
+/*
+ *	The Bloom filter of existing users uses BLOOM_BITS_PER_KEY bits per
+ *	user and BLOOM_HASHES probes, for about 1% of false positives.
+ */
+#define BLOOM_BITS_PER_KEY	10
+#define BLOOM_HASHES		7
+#define BLOOM_MIN_BITS		1024
+#define BLOOM_RETRY		10	/* seconds before retrying a failed build */
+
+/*
+ *	Snapshot files hold a header, an open addressing table of record
+ *	offsets hashed like the cache, then the records, so that a mapped
+ *	file can be read as is.
+ */
+#define SNAPSHOT_MAGIC		"rlmmongo"
+#define SNAPSHOT_VERSION	1
+
+typedef struct rlm_mongo_snapshot_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	num_slots;	/* power of two */
+	int64_t		timestamp;
+	uint64_t	size;		/* of the file */
+	unsigned char	md5[16];	/* of what follows the header */
+} rlm_mongo_snapshot_header_t;
+
+typedef struct rlm_mongo_snapshot_record {
+	int64_t		expires;	/* 0 once invalidated */
+	uint32_t	hash;
+	uint32_t	negative;
+	uint32_t	user_len;
+	uint32_t	key_len;
+	uint32_t	value_len;
+	uint32_t	pad;
+	char		data[8];	/* key, then value */
+} rlm_mongo_snapshot_record_t;
+
+#define SNAPSHOT_RECORD_SIZE(key_len, value_len) \
+	((offsetof(rlm_mongo_snapshot_record_t, data) + (key_len) + (value_len) + 7) & ~(size_t)7)
+#define REFRESH_QUEUE		64	/* keys waiting for a background refresh */
+#define TAIL_CONNECT_TIMEOUT	5	/* seconds, for (re)connecting the tail thread */
+
+#define SNAPSHOT_SLOTS(map) \
+	((uint64_t *)((map) + sizeof(rlm_mongo_snapshot_header_t)))
+
+/*
+ *	The shared memory segment is a header followed by fixed size slots,
+ *	a key being stored in one of the SHM_PROBES slots from its hash.
+ *	Writers, from any process, are serialized by a mutex in the header.
+ *	Readers don't lock: the sequence number of a slot is odd while it
+ *	is written, and a copy is only used if it didn't change meanwhile.
+ */
+#define SHM_MAGIC		0x726c6d6d	/* "rlmm" */
+#define SHM_VERSION		2
+#define SHM_SLOT_SIZE		512
+#define SHM_PROBES		8
+#define SHM_MIN_SLOTS		64
+#define SHM_RETRIES		64	/* reads of a slot being written before giving up */
+
+typedef struct rlm_mongo_shm_header {
+	volatile uint32_t	magic;		/* set once the segment is initialized */
+	uint32_t		version;
+	uint32_t		slot_size;
+	uint32_t		num_slots;	/* power of two */
+	pthread_mutex_t		mutex;		/* robust, shared between processes */
+	uint32_t		tail_valid;	/* tail_last is set */
+	bson_oid_t		tail_last;	/* last invalidation applied */
+} rlm_mongo_shm_header_t;
+
+typedef struct rlm_mongo_shm_slot {
+	volatile uint32_t	seq;
+	uint32_t		hash;
+	int64_t			expires;	/* 0 if free */
+	uint16_t		user_len;
+	uint16_t		key_len;
+	uint16_t		value_len;
+	uint8_t			negative;
+	uint8_t			pad;
+	char			data[SHM_SLOT_SIZE - 24];	/* key, then value */
+} rlm_mongo_shm_slot_t;
+
+#define SHM_HEADER(map)		((rlm_mongo_shm_header_t *)(map))
+#define SHM_SLOT(map, i)	((rlm_mongo_shm_slot_t *)((map) + SHM_SLOT_SIZE * ((size_t)(i) + 1)))
+
+typedef struct rlm_mongo_cache_entry {
+	struct rlm_mongo_cache_entry	*next;		/* bucket chain */
+	struct rlm_mongo_cache_entry	*lru_prev;
+	struct rlm_mongo_cache_entry	*lru_next;
+	uint32_t	hash;
+	int		negative;
+	time_t		expires;
+	size_t		user_len;
+	size_t		key_len;	/* user \0 mac \0 */
+	size_t		value_len;
+	char		data[1];	/* key, then value */
+} rlm_mongo_cache_entry_t;
+
+typedef struct rlm_mongo_cache_shard {
+	pthread_mutex_t		mutex;
+	rlm_mongo_cache_entry_t	**buckets;
+	unsigned int		num_buckets;	/* power of two */
+	unsigned int		num_entries;
+	unsigned int		generation;	/* bumped by every invalidation */
+	rlm_mongo_cache_entry_t	lru[2];		/* lru.lru_next is the most recent */
+	size_t			bytes[2];
+	size_t			max_bytes[2];
+} rlm_mongo_cache_shard_t;
+
+typedef struct rlm_mongo_bloom {
+	uint32_t	nbits;		/* power of two */
+	uint32_t	*bits;
+} rlm_mongo_bloom_t;
+
+struct rlm_mongo_cache {
+	int			ttl[2];
+	int			stale;		/* seconds expired entries are kept for */
+	rlm_mongo_cache_shard_t	shards[CACHE_SHARDS];
+
+	/* Background threads, woken up by rlm_mongo_cache_free() */
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	int			stop;
+	char			*search_field;
+
+	/* Invalidation stream, see rlm_mongo_cache_tail() */
+	int			tailing;
+	pthread_t		tail_thread;
+	mongo			tail_conn;
+	char			*tail_ns;
+	char			*mac_field;
+
+	/* Filter of existing users, see rlm_mongo_cache_bloom() */
+	int			blooming;
+	pthread_t		bloom_thread;
+	pthread_rwlock_t	bloom_lock;
+	rlm_mongo_bloom_t	*bloom;
+	rlm_mongo_bloom_t	*bloom_next;	/* being built */
+	int			bloom_stale;
+	int			bloom_refresh;
+	mongo_pool		*bloom_pool;
+	char			*bloom_ns;
+
+	/* Snapshot file, see rlm_mongo_cache_snapshot() */
+	int			snapshotting;
+	pthread_t		snapshot_thread;
+	pthread_rwlock_t	snapshot_lock;
+	char			*snapshot_map;	/* previous snapshot, until revalidated */
+	size_t			snapshot_size;
+	char			*snapshot_path;
+	int			snapshot_interval;
+	rlm_mongo_cache_refresh_t	refresh;
+	void			*refresh_ctx;
+
+	/* Refresh of stale entries, see rlm_mongo_cache_stale() */
+	int			refreshing;
+	pthread_t		refresh_thread;
+	pthread_cond_t		refresh_cond;
+	char			refresh_queue[REFRESH_QUEUE][MAX_STRING_LEN * 2 + 2];
+	int			refresh_queued;
+
+	/* Segment shared with other processes, see rlm_mongo_cache_shm() */
+	char			*shm_map;
+	size_t			shm_size;
+};
+
+#define ENTRY_SIZE(e) (sizeof(*(e)) + (e)->key_len + (e)->value_len)
+
+static uint32_t cache_hash(const char *user, size_t user_len)
+{
+	return fr_hash(user, user_len);
+}
+
+static rlm_mongo_cache_shard_t *cache_shard(rlm_mongo_cache_t *cache, uint32_t hash)
+{
+	return &cache->shards[hash & (CACHE_SHARDS - 1)];
+}
+
+static rlm_mongo_cache_entry_t **cache_bucket(rlm_mongo_cache_shard_t *shard, uint32_t hash)
+{
+	return &shard->buckets[(hash / CACHE_SHARDS) & (shard->num_buckets - 1)];
+}
+
+static size_t cache_key(char *key, size_t size, const char *user, const char *mac, size_t *user_len)
+{
+	size_t mac_len = strlen(mac);
+
+	*user_len = strlen(user);
+	if (*user_len + mac_len + 2 > size) {
+		return 0;
+	}
+
+	memcpy(key, user, *user_len + 1);
+	memcpy(key + *user_len + 1, mac, mac_len + 1);
+	return *user_len + mac_len + 2;
+}
+
+static void lru_unlink(rlm_mongo_cache_entry_t *e)
+{
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push(rlm_mongo_cache_shard_t *shard, rlm_mongo_cache_entry_t *e)
+{
+	rlm_mongo_cache_entry_t *lru = &shard->lru[e->negative];
+
+	e->lru_prev = lru;
+	e->lru_next = lru->lru_next;
+	lru->lru_next->lru_prev = e;
+	lru->lru_next = e;
+}
+
+static void entry_remove(rlm_mongo_cache_shard_t *shard, rlm_mongo_cache_entry_t *e)
+{
+	rlm_mongo_cache_entry_t **p;
+
+	for (p = cache_bucket(shard, e->hash); *p != e; p = &(*p)->next);
+	*p = e->next;
+
+	lru_unlink(e);
+	shard->bytes[e->negative] -= ENTRY_SIZE(e);
+	shard->num_entries--;
+	free(e);
+}
+
+static rlm_mongo_cache_entry_t *entry_find(rlm_mongo_cache_shard_t *shard, uint32_t hash,
+					   const char *key, size_t key_len)
+{
+	rlm_mongo_cache_entry_t *e;
+
+	for (e = *cache_bucket(shard, hash); e; e = e->next) {
+		if (e->hash == hash && e->key_len == key_len &&
+		    memcmp(e->data, key, key_len) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void shard_grow(rlm_mongo_cache_shard_t *shard)
+{
+	rlm_mongo_cache_entry_t **old = shard->buckets;
+	rlm_mongo_cache_entry_t *e, *next, **p;
+	unsigned int i, n = shard->num_buckets;
+
+	shard->buckets = calloc(2 * n, sizeof(*shard->buckets));
+	if (!shard->buckets) {
+		/* Longer chains are better than no cache at all */
+		shard->buckets = old;
+		return;
+	}
+	shard->num_buckets = 2 * n;
+
+	for (i = 0; i < n; i++) {
+		for (e = old[i]; e; e = next) {
+			next = e->next;
+			p = cache_bucket(shard, e->hash);
+			e->next = *p;
+			*p = e;
+		}
+	}
+	free(old);
+}
+
+static rlm_mongo_bloom_t *bloom_create(int64_t keys)
+{
+	rlm_mongo_bloom_t *bloom;
+	uint32_t nbits = BLOOM_MIN_BITS;
+
+	while (nbits < keys * BLOOM_BITS_PER_KEY && nbits < (1U << 31)) {
+		nbits <<= 1;
+	}
+
+	bloom = malloc(sizeof(*bloom));
+	if (!bloom) {
+		return NULL;
+	}
+	bloom->nbits = nbits;
+	bloom->bits = calloc(nbits / 32, sizeof(*bloom->bits));
+	if (!bloom->bits) {
+		free(bloom);
+		return NULL;
+	}
+	return bloom;
+}
+
+static void bloom_free(rlm_mongo_bloom_t *bloom)
+{
+	if (bloom) {
+		free(bloom->bits);
+		free(bloom);
+	}
+}
+
+/*
+ *	Probes are derived from two hashes (Kirsch & Mitzenmacher). Bits
+ *	are set atomically, as invalidations race with the scan threads.
+ */
+static void bloom_add(rlm_mongo_bloom_t *bloom, const char *user, size_t len)
+{
+	uint32_t h1, h2, bit;
+	int i;
+
+	if (!bloom) {
+		return;
+	}
+
+	h1 = fr_hash(user, len);
+	h2 = fr_hash_update(user, len, h1) | 1;
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		bit = (h1 + i * h2) & (bloom->nbits - 1);
+		mongo_atomic_or(&bloom->bits[bit / 32], 1U << (bit % 32));
+	}
+}
+
+static int bloom_test(const rlm_mongo_bloom_t *bloom, const char *user, size_t len)
+{
+	uint32_t h1, h2, bit;
+	int i;
+
+	h1 = fr_hash(user, len);
+	h2 = fr_hash_update(user, len, h1) | 1;
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		bit = (h1 + i * h2) & (bloom->nbits - 1);
+		if (!(bloom->bits[bit / 32] & (1U << (bit % 32)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void snapshot_unmap(rlm_mongo_cache_t *cache)
+{
+	pthread_rwlock_wrlock(&cache->snapshot_lock);
+	if (cache->snapshot_map) {
+		munmap(cache->snapshot_map, cache->snapshot_size);
+		cache->snapshot_map = NULL;
+	}
+	pthread_rwlock_unlock(&cache->snapshot_lock);
+}
+
+/*
+ *	Look (user, mac) up in the previous snapshot, as rlm_mongo_cache_get().
+ */
+static int snapshot_get(rlm_mongo_cache_t *cache, const char *key, size_t key_len, uint32_t hash,
+			time_t now, char *value, size_t size)
+{
+	const rlm_mongo_snapshot_header_t *h;
+	const rlm_mongo_snapshot_record_t *r;
+	const uint64_t *slots;
+	uint32_t i;
+	int len = RLM_MONGO_CACHE_MISS;
+
+	pthread_rwlock_rdlock(&cache->snapshot_lock);
+	if (cache->snapshot_map) {
+		h = (const rlm_mongo_snapshot_header_t *)cache->snapshot_map;
+		slots = SNAPSHOT_SLOTS(cache->snapshot_map);
+
+		for (i = hash & (h->num_slots - 1); slots[i]; i = (i + 1) & (h->num_slots - 1)) {
+			r = (const rlm_mongo_snapshot_record_t *)(cache->snapshot_map + slots[i]);
+			if (r->hash != hash || r->key_len != key_len || memcmp(r->data, key, key_len) != 0) {
+				continue;
+			}
+			if (r->expires > now) {
+				if (r->negative) {
+					len = RLM_MONGO_CACHE_NOTFOUND;
+				} else if (r->value_len <= size) {
+					memcpy(value, r->data + r->key_len, r->value_len);
+					len = r->value_len;
+				}
+			}
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&cache->snapshot_lock);
+
+	return len;
+}
+
+/*
+ *	Stop serving the records of user (and mac) from the previous
+ *	snapshot. The file is mapped privately, so this stays in memory.
+ */
+static void snapshot_invalidate(rlm_mongo_cache_t *cache, const char *user, size_t user_len,
+				const char *mac, size_t mac_len, uint32_t hash)
+{
+	const rlm_mongo_snapshot_header_t *h;
+	rlm_mongo_snapshot_record_t *r;
+	const uint64_t *slots;
+	uint32_t i;
+
+	pthread_rwlock_wrlock(&cache->snapshot_lock);
+	if (cache->snapshot_map) {
+		h = (const rlm_mongo_snapshot_header_t *)cache->snapshot_map;
+		slots = SNAPSHOT_SLOTS(cache->snapshot_map);
+
+		for (i = hash & (h->num_slots - 1); slots[i]; i = (i + 1) & (h->num_slots - 1)) {
+			r = (rlm_mongo_snapshot_record_t *)(cache->snapshot_map + slots[i]);
+			if (r->hash != hash || r->user_len != user_len || memcmp(r->data, user, user_len) != 0) {
+				continue;
+			}
+			if (mac && (r->key_len != user_len + mac_len + 2 ||
+				    memcmp(r->data + user_len + 1, mac, mac_len) != 0)) {
+				continue;
+			}
+			r->expires = 0;
+		}
+	}
+	pthread_rwlock_unlock(&cache->snapshot_lock);
+}
+
+/*
+ *	Take the writers' lock of the shared segment. If its holder died,
+ *	the slot it was writing is left odd: free it, or readers would
+ *	never see it consistent again.
+ */
+static void shm_lock(rlm_mongo_cache_t *cache)
+{
+	rlm_mongo_shm_header_t *h = SHM_HEADER(cache->shm_map);
+	rlm_mongo_shm_slot_t *s;
+	uint32_t i;
+
+	if (pthread_mutex_lock(&h->mutex) != EOWNERDEAD) {
+		return;
+	}
+	for (i = 0; i < h->num_slots; i++) {
+		s = SHM_SLOT(cache->shm_map, i);
+		if (s->seq & 1) {
+			s->expires = 0;
+			mongo_atomic_barrier();
+			s->seq++;
+		}
+	}
+	pthread_mutex_consistent(&h->mutex);
+}
+
+static void shm_unlock(rlm_mongo_cache_t *cache)
+{
+	pthread_mutex_unlock(&SHM_HEADER(cache->shm_map)->mutex);
+}
+
+/*
+ *	Called with the writers' lock held.
+ */
+static void shm_clear(rlm_mongo_shm_slot_t *s)
+{
+	s->seq++;
+	mongo_atomic_barrier();
+	s->expires = 0;
+	mongo_atomic_barrier();
+	s->seq++;
+}
+
+/*
+ *	Copy slot s into copy, the data only if it may hold a key of hash.
+ *	Returns -1 if s kept being written.
+ */
+static int shm_read(const rlm_mongo_shm_slot_t *s, uint32_t hash, rlm_mongo_shm_slot_t *copy)
+{
+	uint32_t seq;
+	size_t len;
+	int i;
+
+	for (i = 0; i < SHM_RETRIES; i++) {
+		seq = s->seq;
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		mongo_atomic_barrier();
+
+		memcpy(copy, (const void *)s, offsetof(rlm_mongo_shm_slot_t, data));
+		if (copy->expires && copy->hash == hash) {
+			len = (size_t)copy->key_len + copy->value_len;
+			if (len > sizeof(copy->data)) {
+				len = sizeof(copy->data);	/* torn, checked below */
+			}
+			memcpy(copy->data, s->data, len);
+		}
+
+		mongo_atomic_barrier();
+		if (s->seq == seq) {
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ *	Look (user, mac) up in the shared segment, as rlm_mongo_cache_get(),
+ *	also serving entries that expired less than stale seconds ago.
+ */
+static int shm_get(rlm_mongo_cache_t *cache, const char *key, size_t key_len, uint32_t hash,
+		   time_t now, int stale, char *value, size_t size)
+{
+	const rlm_mongo_shm_header_t *h = SHM_HEADER(cache->shm_map);
+	rlm_mongo_shm_slot_t copy;
+	uint32_t i;
+
+	for (i = 0; i < SHM_PROBES; i++) {
+		if (shm_read(SHM_SLOT(cache->shm_map, (hash + i) & (h->num_slots - 1)), hash, &copy) < 0) {
+			continue;
+		}
+		if (!copy.expires || copy.hash != hash || copy.key_len != key_len ||
+		    memcmp(copy.data, key, key_len) != 0) {
+			continue;
+		}
+		if (copy.expires + stale <= now) {
+			break;
+		}
+		if (copy.negative) {
+			return RLM_MONGO_CACHE_NOTFOUND;
+		}
+		if (copy.value_len > size) {
+			break;
+		}
+		memcpy(value, copy.data + copy.key_len, copy.value_len);
+		return copy.value_len;
+	}
+
+	return RLM_MONGO_CACHE_MISS;
+}
+
+/*
+ *	Store an entry in the shared segment, over the previous one for the
+ *	key or else the one expiring first. Returns -1 if it doesn't fit
+ *	in a slot.
+ */
+static int shm_set(rlm_mongo_cache_t *cache, const char *key, size_t key_len, size_t user_len,
+		   uint32_t hash, time_t expires, int negative, const char *value, size_t len)
+{
+	const rlm_mongo_shm_header_t *h = SHM_HEADER(cache->shm_map);
+	rlm_mongo_shm_slot_t *s, *victim = NULL;
+	uint32_t i;
+
+	if (key_len + len > sizeof(victim->data)) {
+		return -1;
+	}
+
+	shm_lock(cache);
+	for (i = 0; i < SHM_PROBES; i++) {
+		s = SHM_SLOT(cache->shm_map, (hash + i) & (h->num_slots - 1));
+		if (s->expires && s->hash == hash && s->key_len == key_len &&
+		    memcmp(s->data, key, key_len) == 0) {
+			victim = s;
+			break;
+		}
+		if (!victim || s->expires < victim->expires) {
+			victim = s;
+		}
+	}
+
+	victim->seq++;
+	mongo_atomic_barrier();
+	victim->hash = hash;
+	victim->expires = expires;
+	victim->user_len = user_len;
+	victim->key_len = key_len;
+	victim->value_len = len;
+	victim->negative = negative;
+	memcpy(victim->data, key, key_len);
+	if (len) {
+		memcpy(victim->data + key_len, value, len);
+	}
+	mongo_atomic_barrier();
+	victim->seq++;
+	shm_unlock(cache);
+
+	return 0;
+}
+
+static void shm_invalidate(rlm_mongo_cache_t *cache, const char *user, size_t user_len,
+			   const char *mac, size_t mac_len, uint32_t hash)
+{
+	const rlm_mongo_shm_header_t *h = SHM_HEADER(cache->shm_map);
+	rlm_mongo_shm_slot_t *s;
+	uint32_t i;
+
+	shm_lock(cache);
+	for (i = 0; i < SHM_PROBES; i++) {
+		s = SHM_SLOT(cache->shm_map, (hash + i) & (h->num_slots - 1));
+		if (!s->expires || s->hash != hash || s->user_len != user_len ||
+		    memcmp(s->data, user, user_len) != 0) {
+			continue;
+		}
+		if (mac && (s->key_len != user_len + mac_len + 2 ||
+			    memcmp(s->data + user_len + 1, mac, mac_len) != 0)) {
+			continue;
+		}
+		shm_clear(s);
+	}
+	shm_unlock(cache);
+}
+
+static void shm_flush(rlm_mongo_cache_t *cache)
+{
+	const rlm_mongo_shm_header_t *h = SHM_HEADER(cache->shm_map);
+	rlm_mongo_shm_slot_t *s;
+	uint32_t i;
+
+	shm_lock(cache);
+	for (i = 0; i < h->num_slots; i++) {
+		s = SHM_SLOT(cache->shm_map, i);
+		if (s->expires) {
+			shm_clear(s);
+		}
+	}
+	shm_unlock(cache);
+}
+
+/*
+ *	Position of the invalidation stream the segment is up to date with,
+ *	whichever process applied it, so that another can resume from there
+ *	rather than flush the entries of all of them.
+ */
+static int shm_tail_get(rlm_mongo_cache_t *cache, bson_oid_t *last)
+{
+	rlm_mongo_shm_header_t *h = SHM_HEADER(cache->shm_map);
+	int valid;
+
+	shm_lock(cache);
+	valid = h->tail_valid;
+	*last = h->tail_last;
+	shm_unlock(cache);
+
+	return valid;
+}
+
+static void shm_tail_set(rlm_mongo_cache_t *cache, const bson_oid_t *last)
+{
+	rlm_mongo_shm_header_t *h = SHM_HEADER(cache->shm_map);
+
+	shm_lock(cache);
+	h->tail_last = *last;
+	h->tail_valid = 1;
+	shm_unlock(cache);
+}
+
+/*
+ *	A TTL of 0 disables caching results of that kind.
+ */
+rlm_mongo_cache_t *rlm_mongo_cache_create(int ttl, size_t max_bytes,
+					  int negative_ttl, size_t negative_max_bytes)
+{
+	rlm_mongo_cache_t *cache;
+	int i;
+
+	cache = rad_malloc(sizeof(*cache));
+	memset(cache, 0, sizeof(*cache));
+	cache->ttl[CACHE_POSITIVE] = ttl;
+	cache->ttl[CACHE_NEGATIVE] = negative_ttl;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		rlm_mongo_cache_shard_t *shard = &cache->shards[i];
+
+		pthread_mutex_init(&shard->mutex, NULL);
+		shard->buckets = calloc(CACHE_INITIAL_BUCKETS, sizeof(*shard->buckets));
+		if (!shard->buckets) {
+			radlog(L_ERR, "rlm_mongo: out of memory");
+			abort();
+		}
+		shard->num_buckets = CACHE_INITIAL_BUCKETS;
+		shard->lru[0].lru_next = shard->lru[0].lru_prev = &shard->lru[0];
+		shard->lru[1].lru_next = shard->lru[1].lru_prev = &shard->lru[1];
+		shard->max_bytes[CACHE_POSITIVE] = max_bytes / CACHE_SHARDS;
+		shard->max_bytes[CACHE_NEGATIVE] = negative_max_bytes / CACHE_SHARDS;
+	}
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	pthread_cond_init(&cache->cond, NULL);
+	pthread_cond_init(&cache->refresh_cond, NULL);
+	pthread_rwlock_init(&cache->bloom_lock, NULL);
+	pthread_rwlock_init(&cache->snapshot_lock, NULL);
+
+	return cache;
+}
+
+void rlm_mongo_cache_free(rlm_mongo_cache_t *cache)
+{
+	int i;
+
+	if (!cache) {
+		return;
+	}
+
+	/*
+	 *	The tail thread is most likely blocked in an awaitData read;
+	 *	shutting the socket down makes that fail now. A reconnect
+	 *	gives up after TAIL_CONNECT_TIMEOUT.
+	 */
+	pthread_mutex_lock(&cache->mutex);
+	cache->stop = 1;
+	if (cache->tailing && cache->tail_conn.connected) {
+		shutdown(cache->tail_conn.sock, SHUT_RDWR);
+	}
+	pthread_cond_broadcast(&cache->cond);
+	pthread_cond_signal(&cache->refresh_cond);
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (cache->tailing) {
+		pthread_join(cache->tail_thread, NULL);
+		mongo_destroy(&cache->tail_conn);
+	}
+	if (cache->blooming) {
+		pthread_join(cache->bloom_thread, NULL);
+	}
+	if (cache->snapshotting) {
+		pthread_join(cache->snapshot_thread, NULL);
+	}
+	if (cache->refreshing) {
+		pthread_join(cache->refresh_thread, NULL);
+	}
+	if (cache->shm_map) {
+		/* Other processes still use it: don't flush it below */
+		munmap(cache->shm_map, cache->shm_size);
+		cache->shm_map = NULL;
+	}
+	/* Unmaps the snapshot, while snapshot_lock still exists */
+	rlm_mongo_cache_flush(cache);
+	free(cache->snapshot_path);
+	bloom_free(cache->bloom);
+	free(cache->tail_ns);
+	free(cache->bloom_ns);
+	free(cache->search_field);
+	free(cache->mac_field);
+	pthread_rwlock_destroy(&cache->bloom_lock);
+	pthread_rwlock_destroy(&cache->snapshot_lock);
+	pthread_cond_destroy(&cache->refresh_cond);
+	pthread_cond_destroy(&cache->cond);
+	pthread_mutex_destroy(&cache->mutex);
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		free(cache->shards[i].buckets);
+		pthread_mutex_destroy(&cache->shards[i].mutex);
+	}
+	free(cache);
+}
+
+/*
+ *	Copy the cached value for (user, mac) into value. Returns its length,
+ *	RLM_MONGO_CACHE_NOTFOUND if the user is known not to exist, or
+ *	RLM_MONGO_CACHE_MISS if there is no live entry or it doesn't fit.
+ */
+int rlm_mongo_cache_get(rlm_mongo_cache_t *cache, const char *user, const char *mac,
+			time_t now, char *value, size_t size)
+{
+	char key[MAX_STRING_LEN * 2 + 2];
+	size_t key_len, user_len;
+	uint32_t hash;
+	rlm_mongo_cache_shard_t *shard;
+	rlm_mongo_cache_entry_t *e;
+	int len = RLM_MONGO_CACHE_MISS;
+
+	key_len = cache_key(key, sizeof(key), user, mac, &user_len);
+	if (!key_len) {
+		return RLM_MONGO_CACHE_MISS;
+	}
+
+	hash = cache_hash(user, user_len);
+	shard = cache_shard(cache, hash);
+
+	pthread_mutex_lock(&shard->mutex);
+	e = entry_find(shard, hash, key, key_len);
+	if (e && e->expires <= now) {
+		/* Kept for rlm_mongo_cache_get_stale() for a while */
+		if (e->expires + cache->stale <= now) {
+			entry_remove(shard, e);
+		}
+		e = NULL;
+	}
+	if (e && e->negative) {
+		len = RLM_MONGO_CACHE_NOTFOUND;
+	} else if (e && e->value_len <= size) {
+		memcpy(value, e->data + e->key_len, e->value_len);
+		len = e->value_len;
+	} else {
+		e = NULL;
+	}
+	if (e) {
+		lru_unlink(e);
+		lru_push(shard, e);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	if (!e && cache->shm_map) {
+		len = shm_get(cache, key, key_len, hash, now, 0, value, size);
+	}
+	if (len == RLM_MONGO_CACHE_MISS && cache->snapshot_map) {
+		len = snapshot_get(cache, key, key_len, hash, now, value, size);
+	}
+
+	return len;
+}
+
+/*
+ *	As rlm_mongo_cache_get(), but for entries that expired less than
+ *	stale seconds ago, for when MongoDB can't be queried. The previous
+ *	snapshot isn't looked at, as it is revalidated anyway.
+ */
+int rlm_mongo_cache_get_stale(rlm_mongo_cache_t *cache, const char *user, const char *mac,
+			      time_t now, char *value, size_t size)
+{
+	char key[MAX_STRING_LEN * 2 + 2];
+	size_t key_len, user_len;
+	uint32_t hash;
+	rlm_mongo_cache_shard_t *shard;
+	rlm_mongo_cache_entry_t *e;
+	int len = RLM_MONGO_CACHE_MISS;
+
+	key_len = cache_key(key, sizeof(key), user, mac, &user_len);
+	if (!key_len || cache->stale <= 0) {
+		return RLM_MONGO_CACHE_MISS;
+	}
+
+	hash = cache_hash(user, user_len);
+	shard = cache_shard(cache, hash);
+
+	pthread_mutex_lock(&shard->mutex);
+	e = entry_find(shard, hash, key, key_len);
+	if (e && e->expires + cache->stale > now) {
+		if (e->negative) {
+			len = RLM_MONGO_CACHE_NOTFOUND;
+		} else if (e->value_len <= size) {
+			memcpy(value, e->data + e->key_len, e->value_len);
+			len = e->value_len;
+		}
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	if (len == RLM_MONGO_CACHE_MISS && cache->shm_map) {
+		len = shm_get(cache, key, key_len, hash, now, cache->stale, value, size);
+	}
+
+	return len;
+}
+
+/*
+ *	Read before querying MongoDB and hand to rlm_mongo_cache_set(), so
+ *	that a result read before an invalidation isn't cached after it.
+ */
+unsigned int rlm_mongo_cache_generation(rlm_mongo_cache_t *cache, const char *user)
+{
+	rlm_mongo_cache_shard_t *shard;
+	unsigned int generation;
+
+	shard = cache_shard(cache, cache_hash(user, strlen(user)));
+
+	pthread_mutex_lock(&shard->mutex);
+	generation = shard->generation;
+	pthread_mutex_unlock(&shard->mutex);
+
+	return generation;
+}
+
+/*
+ *	Cache value for (user, mac). A NULL value records that the user
+ *	doesn't exist.
+ */
+void rlm_mongo_cache_set(rlm_mongo_cache_t *cache, const char *user, const char *mac,
+			 unsigned int generation, time_t now, const char *value, size_t len)
+{
+	char key[MAX_STRING_LEN * 2 + 2];
+	size_t key_len, user_len;
+	uint32_t hash;
+	int negative = (value == NULL);
+	rlm_mongo_cache_shard_t *shard;
+	rlm_mongo_cache_entry_t *e, *old;
+
+	if (cache->ttl[negative] <= 0) {
+		return;
+	}
+	if (negative) {
+		len = 0;
+	}
+
+	key_len = cache_key(key, sizeof(key), user, mac, &user_len);
+	if (!key_len) {
+		return;
+	}
+
+	hash = cache_hash(user, user_len);
+	shard = cache_shard(cache, hash);
+
+	if (sizeof(*e) + key_len + len > shard->max_bytes[negative]) {
+		return;
+	}
+
+	e = malloc(sizeof(*e) + key_len + len);
+	if (!e) {
+		return;
+	}
+	e->hash = hash;
+	e->negative = negative;
+	e->expires = now + cache->ttl[negative];
+	e->user_len = user_len;
+	e->key_len = key_len;
+	e->value_len = len;
+	memcpy(e->data, key, key_len);
+	if (len) {
+		memcpy(e->data + key_len, value, len);
+	}
+
+	pthread_mutex_lock(&shard->mutex);
+	if (shard->generation != generation) {
+		pthread_mutex_unlock(&shard->mutex);
+		free(e);
+		return;
+	}
+
+	old = entry_find(shard, hash, key, key_len);
+	if (old) {
+		entry_remove(shard, old);
+	}
+
+	/*
+	 *	Under the lock of the shard, so that an invalidation can't
+	 *	come between the check of the generation and the store.
+	 */
+	if (cache->shm_map &&
+	    shm_set(cache, key, key_len, user_len, hash, e->expires, negative, value, len) == 0) {
+		pthread_mutex_unlock(&shard->mutex);
+		free(e);
+		return;
+	}
+
+	while (shard->bytes[negative] + ENTRY_SIZE(e) > shard->max_bytes[negative]) {
+		entry_remove(shard, shard->lru[negative].lru_prev);
+	}
+
+	if (shard->num_entries >= 2 * shard->num_buckets) {
+		shard_grow(shard);
+	}
+
+	e->next = *cache_bucket(shard, hash);
+	*cache_bucket(shard, hash) = e;
+	lru_push(shard, e);
+	shard->bytes[negative] += ENTRY_SIZE(e);
+	shard->num_entries++;
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/*
+ *	Drop the entry for (user, mac), or every entry of user if mac is
+ *	NULL. The user may have just been created, so the Bloom filter
+ *	learns about it too.
+ */
+void rlm_mongo_cache_invalidate(rlm_mongo_cache_t *cache, const char *user, const char *mac)
+{
+	size_t user_len = strlen(user);
+	size_t mac_len = mac ? strlen(mac) : 0;
+	uint32_t hash;
+	rlm_mongo_cache_shard_t *shard;
+	rlm_mongo_cache_entry_t *e, *next;
+
+	hash = cache_hash(user, user_len);
+	shard = cache_shard(cache, hash);
+
+	pthread_rwlock_rdlock(&cache->bloom_lock);
+	bloom_add(cache->bloom, user, user_len);
+	bloom_add(cache->bloom_next, user, user_len);
+	pthread_rwlock_unlock(&cache->bloom_lock);
+
+	if (cache->snapshot_map) {
+		snapshot_invalidate(cache, user, user_len, mac, mac_len, hash);
+	}
+
+	pthread_mutex_lock(&shard->mutex);
+	shard->generation++;
+	if (cache->shm_map) {
+		shm_invalidate(cache, user, user_len, mac, mac_len, hash);
+	}
+	for (e = *cache_bucket(shard, hash); e; e = next) {
+		next = e->next;
+		if (e->hash != hash || e->user_len != user_len ||
+		    memcmp(e->data, user, user_len) != 0) {
+			continue;
+		}
+		if (mac && (e->key_len != user_len + mac_len + 2 ||
+			    memcmp(e->data + user_len + 1, mac, mac_len) != 0)) {
+			continue;
+		}
+		entry_remove(shard, e);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/*
+ *	Drop the entries of this process, leaving the shared segment alone.
+ */
+static void cache_flush_local(rlm_mongo_cache_t *cache)
+{
+	int i;
+
+	snapshot_unmap(cache);
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		rlm_mongo_cache_shard_t *shard = &cache->shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		shard->generation++;
+		while (shard->lru[0].lru_next != &shard->lru[0]) {
+			entry_remove(shard, shard->lru[0].lru_next);
+		}
+		while (shard->lru[1].lru_next != &shard->lru[1]) {
+			entry_remove(shard, shard->lru[1].lru_next);
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+void rlm_mongo_cache_flush(rlm_mongo_cache_t *cache)
+{
+	cache_flush_local(cache);
+
+	if (cache->shm_map) {
+		shm_flush(cache);
+	}
+}
+
+/*
+ *	Cached values are a sequence of (list, attribute, value) records:
+ *	one list byte followed by two NUL terminated strings. Returns the
+ *	new length of buf, or 0 if the record doesn't fit.
+ */
+size_t rlm_mongo_cache_pack(char *buf, size_t size, size_t used, int list,
+			    const char *attr, const char *value)
+{
+	size_t attr_len = strlen(attr) + 1;
+	size_t value_len = strlen(value) + 1;
+
+	if (used + 1 + attr_len + value_len > size) {
+		return 0;
+	}
+
+	buf[used] = list;
+	memcpy(buf + used + 1, attr, attr_len);
+	memcpy(buf + used + 1 + attr_len, value, value_len);
+
+	return used + 1 + attr_len + value_len;
+}
+
+/*
+ *	Add the attributes of a cached value to the request.
+ */
+int rlm_mongo_cache_apply(REQUEST *request, const char *value, size_t len)
+{
+	const char *p = value, *end = value + len;
+	const char *attr, *val;
+	VALUE_PAIR *vp;
+	int list;
+
+	while (p < end) {
+		list = *p++;
+		attr = p;
+		p += strlen(p) + 1;
+		val = p;
+		p += strlen(p) + 1;
+
+		vp = pairmake(attr, val, T_OP_SET);
+		if (!vp) {
+			return -1;
+		}
+
+		if (list == RLM_MONGO_LIST_REPLY) {
+			pairmove(&request->reply->vps, &vp);
+		} else {
+			pairmove(&request->config_items, &vp);
+		}
+		pairfree(&vp);
+	}
+
+	return 0;
+}
+
+/*
+ *	Read a MAC written in any of the usual ways (aa:bb:cc:dd:ee:ff,
+ *	AA-BB-CC-DD-EE-FF, aabb.ccdd.eeff, aabbccddeeff) as a 48 bit number.
+ *	Returns -1 unless there are exactly 12 hex digits.
+ */
+int rlm_mongo_mac_parse(const char *in, uint64_t *mac)
+{
+	int digits = 0;
+
+	*mac = 0;
+	for (; *in; in++) {
+		if (*in == ':' || *in == '-' || *in == '.' || *in == ' ') {
+			continue;
+		}
+		if (!isxdigit((unsigned char)*in) || ++digits > 12) {
+			return -1;
+		}
+		*mac = (*mac << 4) | (isdigit((unsigned char)*in) ? *in - '0' : (tolower((unsigned char)*in) - 'a' + 10));
+	}
+
+	return (digits == 12) ? 0 : -1;
+}
+
+/*
+ *	The key a MAC read by rlm_mongo_mac_parse() is cached under. out
+ *	holds at least 18 bytes.
+ */
+void rlm_mongo_mac_print(uint64_t mac, char *out)
+{
+	snprintf(out, 18, "%02x:%02x:%02x:%02x:%02x:%02x",
+		 (unsigned int)(mac >> 40) & 0xff, (unsigned int)(mac >> 32) & 0xff,
+		 (unsigned int)(mac >> 24) & 0xff, (unsigned int)(mac >> 16) & 0xff,
+		 (unsigned int)(mac >> 8) & 0xff, (unsigned int)mac & 0xff);
+}
+
+/*
+ *	Sleep up to seconds, or until another thread wakes us. Called with
+ *	the cache mutex held.
+ */
+static void cache_sleep(rlm_mongo_cache_t *cache, int seconds)
+{
+	struct timespec ts;
+
+	ts.tv_sec = time(NULL) + seconds;
+	ts.tv_nsec = 0;
+	if (!cache->stop) {
+		pthread_cond_timedwait(&cache->cond, &cache->mutex, &ts);
+	}
+}
+
+/*
+ *	Forget the Bloom filter when invalidations may have been missed: a
+ *	user created meanwhile would be rejected until the next refresh.
+ */
+static void cache_bloom_drop(rlm_mongo_cache_t *cache)
+{
+	pthread_rwlock_wrlock(&cache->bloom_lock);
+	bloom_free(cache->bloom);
+	cache->bloom = NULL;
+	pthread_rwlock_unlock(&cache->bloom_lock);
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->bloom_stale = 1;
+	pthread_cond_broadcast(&cache->cond);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/*
+ *	Each document of the invalidation collection names a user, and
+ *	optionally a MAC, whose cached results are stale. A document naming
+ *	neither flushes the whole cache.
+ */
+static void cache_tail_apply(rlm_mongo_cache_t *cache, const bson *doc)
+{
+	bson_iterator it;
+	char mac_buf[18];
+	const char *user = NULL;
+	const char *mac = NULL;
+
+	if (bson_find(&it, doc, cache->search_field) == BSON_STRING) {
+		user = bson_iterator_string(&it);
+	}
+	switch (cache->mac_field[0] ? bson_find(&it, doc, cache->mac_field) : BSON_EOO) {
+		case BSON_STRING:
+			mac = bson_iterator_string(&it);
+			break;
+		case BSON_LONG:
+			/* See mac_binary */
+			rlm_mongo_mac_print((uint64_t)bson_iterator_long(&it), mac_buf);
+			mac = mac_buf;
+			break;
+		default:
+			break;
+	}
+
+	if (user) {
+		DEBUG2("rlm_mongo: invalidating cache for \"%s\"", user);
+		rlm_mongo_cache_invalidate(cache, user, mac);
+	} else {
+		DEBUG2("rlm_mongo: flushing cache");
+		rlm_mongo_cache_flush(cache);
+	}
+}
+
+/*
+ *	Whether the stream can resume from where the shared segment is up
+ *	to date: that document must still be in the capped collection, or
+ *	newer ones were overwritten unseen. Returns -1 if MongoDB couldn't
+ *	tell.
+ */
+static int cache_tail_resume(rlm_mongo_cache_t *cache, mongo *conn, bson_oid_t *last)
+{
+	bson query, out;
+	int found;
+
+	if (!shm_tail_get(cache, last)) {
+		return 0;
+	}
+
+	bson_init(&query);
+	bson_append_oid(&query, "_id", last);
+	bson_finish(&query);
+	found = (mongo_find_one(conn, cache->tail_ns, &query, NULL, &out) == MONGO_OK);
+	if (found) {
+		bson_destroy(&out);
+	}
+	bson_destroy(&query);
+
+	if (found) {
+		return 1;
+	}
+	return (conn->err == MONGO_CONN_SUCCESS) ? 0 : -1;
+}
+
+/*
+ *	Follow the capped invalidation collection with a tailable cursor.
+ *	Whenever the stream is interrupted we may have missed documents, so
+ *	the cache is flushed before following it again. The shared segment
+ *	is only flushed if the stream can't resume from where it was left.
+ */
+static void *cache_tail_thread(void *arg)
+{
+	rlm_mongo_cache_t *cache = arg;
+	mongo *conn = &cache->tail_conn;
+	mongo_cursor cursor;
+	bson query, newest;
+	bson_iterator it;
+	bson_oid_t last;
+	int have_last = 0;
+	int synced = 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	while (!cache->stop) {
+		/*
+		 *	Not under the mutex, which request threads take to
+		 *	queue refreshes, as MongoDB is most likely down.
+		 */
+		if (!conn->connected) {
+			int res;
+
+			pthread_mutex_unlock(&cache->mutex);
+			mongo_set_deadline(conn, mongo_time_ms() + TAIL_CONNECT_TIMEOUT * 1000);
+			res = mongo_reconnect(conn);
+			/* awaitData reads block until a document comes */
+			mongo_set_deadline(conn, 0);
+			pthread_mutex_lock(&cache->mutex);
+			if (res != MONGO_OK || cache->stop) {
+				cache_sleep(cache, 1);
+				continue;
+			}
+		}
+		pthread_mutex_unlock(&cache->mutex);
+
+		if (!synced) {
+			cache_flush_local(cache);
+			cache_bloom_drop(cache);
+
+			switch (cache->shm_map ? cache_tail_resume(cache, conn, &last) : 0) {
+				case 1:
+					have_last = 1;
+					break;
+				case 0:
+					if (cache->shm_map) {
+						shm_flush(cache);
+					}
+
+					/* Start after the newest document; older ones are moot */
+					bson_init(&query);
+					bson_append_start_object(&query, "$query");
+					bson_append_finish_object(&query);
+					bson_append_start_object(&query, "$orderby");
+					bson_append_int(&query, "$natural", -1);
+					bson_append_finish_object(&query);
+					bson_finish(&query);
+					if (mongo_find_one(conn, cache->tail_ns, &query, NULL, &newest) == MONGO_OK) {
+						if (bson_find(&it, &newest, "_id") == BSON_OID) {
+							last = *bson_iterator_oid(&it);
+							have_last = 1;
+							if (cache->shm_map) {
+								shm_tail_set(cache, &last);
+							}
+						}
+						bson_destroy(&newest);
+					}
+					bson_destroy(&query);
+					break;
+				default:
+					/* Lost the connection */
+					break;
+			}
+			synced = (conn->err == MONGO_CONN_SUCCESS);
+		}
+
+		bson_init(&query);
+		if (have_last) {
+			bson_append_start_object(&query, "_id");
+			bson_append_oid(&query, "$gt", &last);
+			bson_append_finish_object(&query);
+		}
+		bson_finish(&query);
+
+		mongo_cursor_init(&cursor, conn, cache->tail_ns);
+		mongo_cursor_set_query(&cursor, &query);
+		mongo_cursor_set_options(&cursor, MONGO_TAILABLE | MONGO_AWAIT_DATA);
+
+		while (!cache->stop) {
+			cursor.err = MONGO_CONN_SUCCESS;
+			if (mongo_cursor_next(&cursor) == MONGO_OK) {
+				cache_tail_apply(cache, &cursor.current);
+				if (bson_find(&it, &cursor.current, "_id") == BSON_OID) {
+					last = *bson_iterator_oid(&it);
+					have_last = 1;
+					if (cache->shm_map) {
+						shm_tail_set(cache, &last);
+					}
+				}
+			} else if (cursor.err != MONGO_CURSOR_PENDING || conn->err != MONGO_CONN_SUCCESS) {
+				break;
+			}
+		}
+		mongo_cursor_destroy(&cursor);
+		bson_destroy(&query);
+
+		pthread_mutex_lock(&cache->mutex);
+		if (conn->err != MONGO_CONN_SUCCESS) {
+			/* Lost the connection: anything could have happened */
+			mongo_disconnect(conn);
+			synced = 0;
+		}
+
+		/*
+		 *	The cursor also dies when the collection is empty or
+		 *	wrapped around past our position; wait before retrying.
+		 */
+		cache_sleep(cache, 1);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+
+/*
+ *	Start following the capped collection ns for invalidations.
+ */
+int rlm_mongo_cache_tail(rlm_mongo_cache_t *cache, const char *host, int port,
+			 const mongo_credentials *cred, const char *ns,
+			 const char *search_field, const char *mac_field)
+{
+	mongo *conn = &cache->tail_conn;
+
+	mongo_init(conn);
+	conn->primary = bson_malloc(sizeof(mongo_host_port));
+	snprintf(conn->primary->host, sizeof(conn->primary->host), "%s", host);
+	conn->primary->port = port;
+	conn->primary->next = NULL;
+	mongo_set_credentials(conn, cred);
+
+	cache->tail_ns = strdup(ns);
+	if (!cache->search_field) {
+		cache->search_field = strdup(search_field);
+	}
+	cache->mac_field = strdup(mac_field);
+
+	if (pthread_create(&cache->tail_thread, NULL, cache_tail_thread, cache) != 0) {
+		radlog(L_ERR, "rlm_mongo: can't start the cache invalidation thread");
+		mongo_destroy(conn);
+		return -1;
+	}
+	cache->tailing = 1;
+
+	return 0;
+}
+
+static int cache_bloom_scan(const bson *doc, void *arg)
+{
+	rlm_mongo_cache_t *cache = arg;
+	bson_iterator it;
+
+	if (cache->stop) {
+		return MONGO_ERROR;
+	}
+
+	if (bson_find(&it, doc, cache->search_field) == BSON_STRING) {
+		bloom_add(cache->bloom_next, bson_iterator_string(&it),
+			  bson_iterator_string_len(&it) - 1);
+	}
+	return MONGO_OK;
+}
+
+/*
+ *	Build a new filter from a scan of the users collection and swap it
+ *	in. Users created during the scan are added by invalidations, which
+ *	go to both filters. Returns 0 if the new filter is in use.
+ */
+static int cache_bloom_build(rlm_mongo_cache_t *cache)
+{
+	rlm_mongo_bloom_t *bloom;
+	const char *dot = strchr(cache->bloom_ns, '.');
+	char db[MAX_STRING_LEN];
+	mongo *conn;
+	bson fields;
+	int64_t count;
+	int res;
+
+	if (!dot) {
+		return -1;
+	}
+	snprintf(db, sizeof(db), "%.*s", (int)(dot - cache->bloom_ns), cache->bloom_ns);
+
+	conn = mongo_pool_acquire(cache->bloom_pool);
+	count = mongo_count(conn, db, dot + 1, NULL);
+	mongo_pool_release(cache->bloom_pool, conn);
+	if (count < 0) {
+		return -1;
+	}
+
+	bloom = bloom_create(count);
+	if (!bloom) {
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&cache->bloom_lock);
+	cache->bloom_next = bloom;
+	pthread_rwlock_unlock(&cache->bloom_lock);
+
+	bson_init(&fields);
+	bson_append_int(&fields, cache->search_field, 1);
+	bson_finish(&fields);
+	res = mongo_parallel_scan(cache->bloom_pool, cache->bloom_ns, "_id", NULL, &fields, 2,
+				  cache_bloom_scan, cache);
+	bson_destroy(&fields);
+
+	pthread_mutex_lock(&cache->mutex);
+	pthread_rwlock_wrlock(&cache->bloom_lock);
+	cache->bloom_next = NULL;
+	if (res == MONGO_OK && !cache->bloom_stale) {
+		rlm_mongo_bloom_t *old = cache->bloom;
+
+		DEBUG2("rlm_mongo: filter of %ld users built", (long)count);
+		cache->bloom = bloom;
+		bloom = old;
+	} else {
+		res = MONGO_ERROR;
+	}
+	pthread_rwlock_unlock(&cache->bloom_lock);
+	pthread_mutex_unlock(&cache->mutex);
+
+	bloom_free(bloom);
+
+	return (res == MONGO_OK) ? 0 : -1;
+}
+
+static void *cache_bloom_thread(void *arg)
+{
+	rlm_mongo_cache_t *cache = arg;
+	time_t now, next;
+	int wait;
+
+	pthread_mutex_lock(&cache->mutex);
+	while (!cache->stop) {
+		cache->bloom_stale = 0;
+		pthread_mutex_unlock(&cache->mutex);
+
+		if (cache_bloom_build(cache) == 0) {
+			wait = cache->bloom_refresh;
+		} else {
+			radlog(L_ERR, "rlm_mongo: can't build the filter of existing users");
+			wait = (cache->bloom_refresh < BLOOM_RETRY) ? cache->bloom_refresh : BLOOM_RETRY;
+		}
+
+		pthread_mutex_lock(&cache->mutex);
+		next = time(NULL) + wait;
+		while (!cache->stop && !cache->bloom_stale && (now = time(NULL)) < next) {
+			cache_sleep(cache, next - now);
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+
+/*
+ *	Keep a Bloom filter of the search_field values in the collection
+ *	ns, rebuilt every refresh seconds, so that unknown users can be
+ *	rejected without a query.
+ */
+int rlm_mongo_cache_bloom(rlm_mongo_cache_t *cache, mongo_pool *pool, const char *ns,
+			  const char *search_field, int refresh)
+{
+	cache->bloom_pool = pool;
+	cache->bloom_ns = strdup(ns);
+	cache->bloom_refresh = refresh;
+	if (!cache->search_field) {
+		cache->search_field = strdup(search_field);
+	}
+
+	if (pthread_create(&cache->bloom_thread, NULL, cache_bloom_thread, cache) != 0) {
+		radlog(L_ERR, "rlm_mongo: can't start the filter thread");
+		return -1;
+	}
+	cache->blooming = 1;
+
+	return 0;
+}
+
+/*
+ *	Returns 0 if user is certainly not in the collection. Until a filter
+ *	has been built, every user may exist.
+ */
+int rlm_mongo_cache_may_exist(rlm_mongo_cache_t *cache, const char *user)
+{
+	int res = 1;
+
+	pthread_rwlock_rdlock(&cache->bloom_lock);
+	if (cache->bloom) {
+		res = bloom_test(cache->bloom, user, strlen(user));
+	}
+	pthread_rwlock_unlock(&cache->bloom_lock);
+
+	return res;
+}
+
+static int snapshot_write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void snapshot_md5(mongo_md5_state_t *st, const char *p, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = (len > (1 << 30)) ? (1 << 30) : len;
+		mongo_md5_append(st, (const mongo_md5_byte_t *)p, (int)n);
+		p += n;
+		len -= n;
+	}
+}
+
+/*
+ *	Write the live entries to a temporary file, then rename it over the
+ *	snapshot, so that a crash never leaves a partial snapshot behind.
+ */
+static int cache_snapshot_write(rlm_mongo_cache_t *cache)
+{
+	rlm_mongo_snapshot_header_t h;
+	rlm_mongo_snapshot_record_t *r;
+	rlm_mongo_cache_entry_t *e;
+	mongo_md5_state_t st;
+	char *records = NULL, *p;
+	size_t used = 0, alloc = 0, rsize, off;
+	uint64_t *slots = NULL, base;
+	uint32_t count = 0, num_slots, j;
+	char tmp[PATH_MAX];
+	time_t now = time(NULL);
+	int i, kind, fd, res = -1;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		rlm_mongo_cache_shard_t *shard = &cache->shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		for (kind = 0; kind < 2; kind++) {
+			for (e = shard->lru[kind].lru_next; e != &shard->lru[kind]; e = e->lru_next) {
+				if (e->expires <= now) {
+					continue;
+				}
+
+				rsize = SNAPSHOT_RECORD_SIZE(e->key_len, e->value_len);
+				if (used + rsize > alloc) {
+					alloc = (alloc + rsize) * 2;
+					p = realloc(records, alloc);
+					if (!p) {
+						pthread_mutex_unlock(&shard->mutex);
+						goto done;
+					}
+					records = p;
+				}
+
+				r = (rlm_mongo_snapshot_record_t *)(records + used);
+				memset(r, 0, rsize);
+				r->expires = e->expires;
+				r->hash = e->hash;
+				r->negative = e->negative;
+				r->user_len = e->user_len;
+				r->key_len = e->key_len;
+				r->value_len = e->value_len;
+				memcpy(r->data, e->data, e->key_len + e->value_len);
+				used += rsize;
+				count++;
+			}
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	for (num_slots = 16; num_slots < 2 * count; num_slots <<= 1);
+	slots = calloc(num_slots, sizeof(*slots));
+	if (!slots) {
+		goto done;
+	}
+
+	base = sizeof(h) + num_slots * sizeof(*slots);
+	for (off = 0; off < used; off += SNAPSHOT_RECORD_SIZE(r->key_len, r->value_len)) {
+		r = (rlm_mongo_snapshot_record_t *)(records + off);
+		for (j = r->hash & (num_slots - 1); slots[j]; j = (j + 1) & (num_slots - 1));
+		slots[j] = base + off;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.num_slots = num_slots;
+	h.timestamp = now;
+	h.size = base + used;
+	mongo_md5_init(&st);
+	snapshot_md5(&st, (const char *)slots, num_slots * sizeof(*slots));
+	snapshot_md5(&st, records, used);
+	mongo_md5_finish(&st, h.md5);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache->snapshot_path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		radlog(L_ERR, "rlm_mongo: can't write %s: %s", tmp, strerror(errno));
+		goto done;
+	}
+	if (snapshot_write_all(fd, &h, sizeof(h)) < 0 ||
+	    snapshot_write_all(fd, slots, num_slots * sizeof(*slots)) < 0 ||
+	    snapshot_write_all(fd, records, used) < 0 ||
+	    fsync(fd) < 0) {
+		radlog(L_ERR, "rlm_mongo: can't write %s: %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		goto done;
+	}
+	close(fd);
+
+	if (rename(tmp, cache->snapshot_path) < 0) {
+		radlog(L_ERR, "rlm_mongo: can't rename %s: %s", tmp, strerror(errno));
+		unlink(tmp);
+		goto done;
+	}
+
+	DEBUG2("rlm_mongo: %u cache entries saved to %s", count, cache->snapshot_path);
+	res = 0;
+
+done:
+	free(slots);
+	free(records);
+	return res;
+}
+
+/*
+ *	Map the snapshot left by a previous instance, if it is sound.
+ */
+static void cache_snapshot_map(rlm_mongo_cache_t *cache)
+{
+	const rlm_mongo_snapshot_header_t *h;
+	const rlm_mongo_snapshot_record_t *r;
+	const uint64_t *slots;
+	mongo_md5_state_t st;
+	unsigned char md5[16];
+	struct stat sb;
+	char *map;
+	uint64_t base;
+	uint32_t i;
+	int fd;
+
+	fd = open(cache->snapshot_path, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(*h)) {
+		close(fd);
+		goto invalid_file;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		goto invalid_file;
+	}
+
+	h = (const rlm_mongo_snapshot_header_t *)map;
+	base = sizeof(*h) + (uint64_t)h->num_slots * sizeof(*slots);
+	if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != SNAPSHOT_VERSION || h->size != (uint64_t)sb.st_size ||
+	    !h->num_slots || (h->num_slots & (h->num_slots - 1)) || base > h->size) {
+		goto invalid;
+	}
+
+	mongo_md5_init(&st);
+	snapshot_md5(&st, map + sizeof(*h), h->size - sizeof(*h));
+	mongo_md5_finish(&st, md5);
+	if (memcmp(md5, h->md5, sizeof(md5)) != 0) {
+		goto invalid;
+	}
+
+	slots = SNAPSHOT_SLOTS(map);
+	for (i = 0; i < h->num_slots; i++) {
+		if (!slots[i]) {
+			continue;
+		}
+		if (slots[i] < base || slots[i] + offsetof(rlm_mongo_snapshot_record_t, data) > h->size) {
+			goto invalid;
+		}
+		r = (const rlm_mongo_snapshot_record_t *)(map + slots[i]);
+		if (slots[i] + SNAPSHOT_RECORD_SIZE(r->key_len, r->value_len) > h->size ||
+		    r->user_len >= r->key_len) {
+			goto invalid;
+		}
+	}
+
+	radlog(L_INFO, "rlm_mongo: serving cache snapshot of %s written at %ld",
+	       cache->snapshot_path, (long)h->timestamp);
+	cache->snapshot_map = map;
+	cache->snapshot_size = sb.st_size;
+	return;
+
+invalid:
+	munmap(map, sb.st_size);
+invalid_file:
+	radlog(L_ERR, "rlm_mongo: ignoring invalid cache snapshot %s", cache->snapshot_path);
+}
+
+/*
+ *	Look every record of the previous snapshot up again, then stop
+ *	serving it. The refresh callback fills the live cache as it goes.
+ */
+static void cache_snapshot_revalidate(rlm_mongo_cache_t *cache)
+{
+	const rlm_mongo_snapshot_header_t *h;
+	const rlm_mongo_snapshot_record_t *r;
+	char key[MAX_STRING_LEN * 2 + 2];
+	const char *mac;
+	size_t user_len;
+	uint32_t i, num_slots, count = 0;
+	int live, res;
+
+	h = (const rlm_mongo_snapshot_header_t *)cache->snapshot_map;
+	num_slots = h->num_slots;
+
+	for (i = 0; i < num_slots && !cache->stop; i++) {
+		pthread_rwlock_rdlock(&cache->snapshot_lock);
+		if (!cache->snapshot_map) {
+			/* Flushed meanwhile */
+			pthread_rwlock_unlock(&cache->snapshot_lock);
+			return;
+		}
+		live = 0;
+		if (SNAPSHOT_SLOTS(cache->snapshot_map)[i]) {
+			r = (const rlm_mongo_snapshot_record_t *)(cache->snapshot_map +
+								 SNAPSHOT_SLOTS(cache->snapshot_map)[i]);
+			if (r->expires && r->key_len <= sizeof(key)) {
+				memcpy(key, r->data, r->key_len);
+				live = 1;
+			}
+		}
+		pthread_rwlock_unlock(&cache->snapshot_lock);
+
+		if (!live) {
+			continue;
+		}
+
+		/* Keep serving the snapshot while MongoDB can't answer */
+		while ((res = cache->refresh(cache->refresh_ctx, key, key + strlen(key) + 1)) < 0) {
+			pthread_mutex_lock(&cache->mutex);
+			cache_sleep(cache, 1);
+			pthread_mutex_unlock(&cache->mutex);
+			if (cache->stop) {
+				return;
+			}
+		}
+		if (res > 0) {
+			/* Can't be looked up again, so don't serve it either */
+			user_len = strlen(key);
+			mac = key + user_len + 1;
+			snapshot_invalidate(cache, key, user_len, mac, strlen(mac),
+					    cache_hash(key, user_len));
+			continue;
+		}
+		count++;
+	}
+
+	if (!cache->stop) {
+		snapshot_unmap(cache);
+		DEBUG2("rlm_mongo: %u cache entries revalidated", count);
+	}
+}
+
+static void *cache_snapshot_thread(void *arg)
+{
+	rlm_mongo_cache_t *cache = arg;
+	time_t now, next;
+
+	if (cache->snapshot_map) {
+		cache_snapshot_revalidate(cache);
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	while (!cache->stop) {
+		next = time(NULL) + cache->snapshot_interval;
+		while (!cache->stop && (now = time(NULL)) < next) {
+			cache_sleep(cache, next - now);
+		}
+
+		/* Also when stopping, for the next instance */
+		pthread_mutex_unlock(&cache->mutex);
+		cache_snapshot_write(cache);
+		pthread_mutex_lock(&cache->mutex);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+
+/*
+ *	Serve the snapshot left at path by a previous instance while
+ *	refresh() looks its entries up again, and save the cache there
+ *	every interval seconds and when it is freed.
+ */
+int rlm_mongo_cache_snapshot(rlm_mongo_cache_t *cache, const char *path, int interval,
+			     rlm_mongo_cache_refresh_t refresh, void *ctx)
+{
+	cache->snapshot_path = strdup(path);
+	cache->snapshot_interval = (interval > 0) ? interval : 1;
+	cache->refresh = refresh;
+	cache->refresh_ctx = ctx;
+
+	cache_snapshot_map(cache);
+
+	if (pthread_create(&cache->snapshot_thread, NULL, cache_snapshot_thread, cache) != 0) {
+		radlog(L_ERR, "rlm_mongo: can't start the cache snapshot thread");
+		snapshot_unmap(cache);
+		return -1;
+	}
+	cache->snapshotting = 1;
+
+	return 0;
+}
+
+/*
+ *	Queue (user, mac) for the refresh thread. Keys already queued, or
+ *	beyond what the queue holds, are dropped: they will be queued again
+ *	when next served stale.
+ */
+void rlm_mongo_cache_refresh(rlm_mongo_cache_t *cache, const char *user, const char *mac)
+{
+	char key[MAX_STRING_LEN * 2 + 2];
+	size_t key_len, user_len;
+	int i;
+
+	key_len = cache_key(key, sizeof(key), user, mac, &user_len);
+	if (!key_len || !cache->refreshing) {
+		return;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	for (i = 0; i < cache->refresh_queued; i++) {
+		if (memcmp(cache->refresh_queue[i], key, key_len) == 0) {
+			break;
+		}
+	}
+	if (i == cache->refresh_queued && i < REFRESH_QUEUE) {
+		memcpy(cache->refresh_queue[i], key, key_len);
+		cache->refresh_queued++;
+		pthread_cond_signal(&cache->refresh_cond);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+static void *cache_refresh_thread(void *arg)
+{
+	rlm_mongo_cache_t *cache = arg;
+	char key[MAX_STRING_LEN * 2 + 2];
+	int failed;
+
+	pthread_mutex_lock(&cache->mutex);
+	while (!cache->stop) {
+		if (!cache->refresh_queued) {
+			pthread_cond_wait(&cache->refresh_cond, &cache->mutex);
+			continue;
+		}
+
+		memcpy(key, cache->refresh_queue[0], sizeof(key));
+		cache->refresh_queued--;
+		memmove(cache->refresh_queue[0], cache->refresh_queue[1],
+			cache->refresh_queued * sizeof(cache->refresh_queue[0]));
+		pthread_mutex_unlock(&cache->mutex);
+
+		failed = (cache->refresh(cache->refresh_ctx, key, key + strlen(key) + 1) < 0);
+
+		pthread_mutex_lock(&cache->mutex);
+		if (failed) {
+			/* MongoDB is still away; don't hammer it */
+			cache_sleep(cache, 1);
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+
+/*
+ *	Keep expired entries for stale more seconds, for
+ *	rlm_mongo_cache_get_stale(), and refresh those served in the
+ *	background with refresh().
+ */
+int rlm_mongo_cache_stale(rlm_mongo_cache_t *cache, int stale,
+			  rlm_mongo_cache_refresh_t refresh, void *ctx)
+{
+	cache->stale = stale;
+	cache->refresh = refresh;
+	cache->refresh_ctx = ctx;
+
+	if (pthread_create(&cache->refresh_thread, NULL, cache_refresh_thread, cache) != 0) {
+		radlog(L_ERR, "rlm_mongo: can't start the cache refresh thread");
+		return -1;
+	}
+	cache->refreshing = 1;
+
+	return 0;
+}
+
+/*
+ *	Keep entries in the shared memory segment name, of about size bytes,
+ *	instead of the memory of the process, so that every radiusd of the
+ *	host shares them. The first process creates the segment, and it
+ *	outlives them all. Entries too large for a slot are still kept in
+ *	the process.
+ */
+int rlm_mongo_cache_shm(rlm_mongo_cache_t *cache, const char *name, size_t size)
+{
+	rlm_mongo_shm_header_t *h;
+	pthread_mutexattr_t attr;
+	struct stat st;
+	uint32_t num_slots = SHM_MIN_SLOTS;
+	size_t map_size;
+	char *map;
+	int fd, created = 0, i;
+
+	while ((size_t)num_slots * 2 * SHM_SLOT_SIZE <= size) {
+		num_slots *= 2;
+	}
+	map_size = SHM_SLOT_SIZE * ((size_t)num_slots + 1);
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0) {
+		created = 1;
+		if (ftruncate(fd, map_size) < 0) {
+			radlog(L_ERR, "rlm_mongo: can't size shared memory segment %s: %s",
+			       name, strerror(errno));
+			close(fd);
+			shm_unlink(name);
+			return -1;
+		}
+	} else if (errno == EEXIST) {
+		fd = shm_open(name, O_RDWR, 0);
+	}
+	if (fd < 0) {
+		radlog(L_ERR, "rlm_mongo: can't open shared memory segment %s: %s",
+		       name, strerror(errno));
+		return -1;
+	}
+
+	/* Give the process creating it a second to size it */
+	for (i = 0; !created && i < 100; i++) {
+		if (fstat(fd, &st) < 0 || (size_t)st.st_size == map_size) {
+			break;
+		}
+		usleep(10000);
+	}
+	if (!created && (fstat(fd, &st) < 0 || (size_t)st.st_size != map_size)) {
+		radlog(L_ERR, "rlm_mongo: shared memory segment %s has another size, remove it", name);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		radlog(L_ERR, "rlm_mongo: can't map shared memory segment %s: %s",
+		       name, strerror(errno));
+		return -1;
+	}
+	h = SHM_HEADER(map);
+
+	if (created) {
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&h->mutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+		h->version = SHM_VERSION;
+		h->slot_size = SHM_SLOT_SIZE;
+		h->num_slots = num_slots;
+		mongo_atomic_barrier();
+		h->magic = SHM_MAGIC;
+	} else {
+		for (i = 0; h->magic != SHM_MAGIC && i < 100; i++) {
+			usleep(10000);
+		}
+		mongo_atomic_barrier();
+		if (h->magic != SHM_MAGIC || h->version != SHM_VERSION ||
+		    h->slot_size != SHM_SLOT_SIZE || h->num_slots != num_slots) {
+			radlog(L_ERR, "rlm_mongo: shared memory segment %s isn't usable, remove it", name);
+			munmap(map, map_size);
+			return -1;
+		}
+	}
+
+	cache->shm_map = map;
+	cache->shm_size = map_size;
+
+	return 0;
+}
@@ -0,0 +1,1037 @@
+/*
+ * rlm_mongo_replica.c
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2010 Guillaume Rose <guillaume.rose@gmail.com>
+ */
+
+#include <freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+
+#include <sched.h>
+#include <sys/socket.h>
+
+#include "rlm_mongo.h"
+
+/*
+ *	The replica is a copy of every document of the users collection,
+ *	cut down to the fields authorize reads, indexed on search_field by
+ *	an open addressing hash table. Requests
+ *	read it without locks; the one writer, the oplog thread, never
+ *	modifies a document or a table in place but swaps pointers, and
+ *	frees what it replaced once no reader can still see it (epoch based
+ *	reclamation).
+ */
+#define REPLICA_OPLOG		"local.oplog.rs"
+#define REPLICA_INITIAL_SLOTS	1024
+#define REPLICA_READERS		128
+#define REPLICA_RECLAIM		1024	/* oplog entries between reclaims */
+
+typedef struct rlm_mongo_replica_doc {
+	uint32_t	hash;		/* of user */
+	uint32_t	id_hash;
+	const char	*user;		/* in data */
+	size_t		user_len;
+	const char	*id;		/* value of _id, in data */
+	size_t		id_len;
+	int		id_type;
+	int		size;
+	char		data[1];	/* the document */
+} rlm_mongo_replica_doc_t;
+
+typedef struct rlm_mongo_replica_table {
+	uint32_t		size;		/* power of two */
+	uint32_t		used;		/* documents and tombstones */
+	uint32_t		live;
+	rlm_mongo_replica_doc_t	*slots[1];
+} rlm_mongo_replica_table_t;
+
+/* Things replaced by the writer, to be freed after epoch */
+typedef struct rlm_mongo_replica_retired {
+	struct rlm_mongo_replica_retired	*next;
+	unsigned long				epoch;
+	void					*ptr;
+} rlm_mongo_replica_retired_t;
+
+/* The epoch a reader entered at, or 0; one per cache line */
+typedef struct rlm_mongo_replica_reader {
+	volatile unsigned long	epoch;
+	char			pad[64 - sizeof(unsigned long)];
+} rlm_mongo_replica_reader_t;
+
+struct rlm_mongo_replica {
+	rlm_mongo_replica_table_t		*index;	/* on user, shared with readers */
+	rlm_mongo_replica_table_t		*ids;	/* on _id, writer only */
+	volatile int				ready;
+	volatile unsigned long			epoch;
+	rlm_mongo_replica_reader_t		readers[REPLICA_READERS];
+	rlm_mongo_replica_retired_t		*retired;
+
+	/* Bulk load, see replica_load() */
+	pthread_mutex_t				load_mutex;
+	rlm_mongo_replica_table_t		*load_index;
+	rlm_mongo_replica_table_t		*load_ids;
+	mongo_pool				*pool;
+	int					partitions;
+
+	pthread_t				thread;
+	pthread_mutex_t				mutex;
+	pthread_cond_t				cond;
+	int					stop;
+	mongo					conn;
+	bson_timestamp_t			last;
+	int					warned;
+
+	char					*ns;
+	char					*cmd_ns;	/* db.$cmd */
+	char					*admin_ns;	/* admin.$cmd */
+	char					*search_field;
+	char					*mac_field;
+	char					*enable_field;
+	bson					fields;		/* projection */
+	int					has_fields;	/* or whole documents */
+};
+
+static rlm_mongo_replica_doc_t replica_tombstone;
+#define TOMBSTONE (&replica_tombstone)
+
+/*
+ *	Find the first string at the dotted path in the document at data.
+ *	Arrays along the path are searched element by element, as MongoDB
+ *	does for queries.
+ */
+static const char *replica_string(const char *data, const char *path);
+
+static const char *replica_string_value(const bson_iterator *it, const char *rest)
+{
+	bson_iterator sub;
+	const char *str;
+
+	switch (bson_iterator_type(it)) {
+		case BSON_STRING:
+			return rest ? NULL : bson_iterator_string(it);
+		case BSON_OBJECT:
+			return rest ? replica_string(bson_iterator_value(it), rest) : NULL;
+		case BSON_ARRAY:
+			bson_iterator_subiterator(it, &sub);
+			while (bson_iterator_next(&sub)) {
+				if ((str = replica_string_value(&sub, rest)) != NULL) {
+					return str;
+				}
+			}
+			return NULL;
+		default:
+			return NULL;
+	}
+}
+
+static const char *replica_string(const char *data, const char *path)
+{
+	bson_iterator it;
+	const char *dot = strchr(path, '.');
+	size_t len = dot ? (size_t)(dot - path) : strlen(path);
+
+	bson_iterator_from_buffer(&it, data);
+	while (bson_iterator_next(&it)) {
+		if (strncmp(bson_iterator_key(&it), path, len) == 0 &&
+		    bson_iterator_key(&it)[len] == '\0') {
+			return replica_string_value(&it, dot ? dot + 1 : NULL);
+		}
+	}
+	return NULL;
+}
+
+/*
+ *	Does the value at path equal value, or true if value is NULL? This
+ *	is how the authorize query matches mac_field and enable_field.
+ */
+static int replica_match(const char *data, const char *path, const char *value);
+
+static int replica_match_value(const bson_iterator *it, const char *rest, const char *value)
+{
+	bson_iterator sub;
+	uint64_t mac;
+
+	switch (bson_iterator_type(it)) {
+		case BSON_STRING:
+			return !rest && value && strcmp(bson_iterator_string(it), value) == 0;
+		case BSON_LONG:
+			/* A MAC stored as a number, see mac_binary */
+			return !rest && value && rlm_mongo_mac_parse(value, &mac) == 0 &&
+			       (uint64_t)bson_iterator_long(it) == mac;
+		case BSON_BOOL:
+			return !rest && !value && bson_iterator_bool(it);
+		case BSON_OBJECT:
+			return rest && replica_match(bson_iterator_value(it), rest, value);
+		case BSON_ARRAY:
+			bson_iterator_subiterator(it, &sub);
+			while (bson_iterator_next(&sub)) {
+				if (replica_match_value(&sub, rest, value)) {
+					return 1;
+				}
+			}
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+static int replica_match(const char *data, const char *path, const char *value)
+{
+	bson_iterator it;
+	const char *dot = strchr(path, '.');
+	size_t len = dot ? (size_t)(dot - path) : strlen(path);
+
+	bson_iterator_from_buffer(&it, data);
+	while (bson_iterator_next(&it)) {
+		if (strncmp(bson_iterator_key(&it), path, len) == 0 &&
+		    bson_iterator_key(&it)[len] == '\0') {
+			return replica_match_value(&it, dot ? dot + 1 : NULL, value);
+		}
+	}
+	return 0;
+}
+
+/*
+ *	Locate the value of _id for the _id index.
+ */
+static void replica_id(const bson_iterator *it, const char **id, size_t *len, int *type, uint32_t *hash)
+{
+	bson_iterator next = *it;
+
+	*type = bson_iterator_type(it);
+	*id = bson_iterator_value(it);
+	bson_iterator_next(&next);
+	*len = next.cur - *id;
+	*hash = fr_hash(*id, *len) ^ *type;
+}
+
+static rlm_mongo_replica_doc_t *replica_doc_create(rlm_mongo_replica_t *replica, const bson *b)
+{
+	const char *data = bson_data((bson *)b);
+	const char *user, *id;
+	rlm_mongo_replica_doc_t *doc;
+	bson_iterator it;
+	size_t id_len;
+	uint32_t id_hash;
+	int id_type;
+
+	user = replica_string(data, replica->search_field);
+	if (!user || bson_find(&it, b, "_id") == BSON_EOO) {
+		return NULL;
+	}
+	replica_id(&it, &id, &id_len, &id_type, &id_hash);
+
+	doc = malloc(sizeof(*doc) + bson_size(b));
+	if (!doc) {
+		return NULL;
+	}
+	doc->size = bson_size(b);
+	memcpy(doc->data, data, doc->size);
+	doc->user = doc->data + (user - data);
+	doc->user_len = strlen(doc->user);
+	doc->hash = fr_hash(doc->user, doc->user_len);
+	doc->id = doc->data + (id - data);
+	doc->id_len = id_len;
+	doc->id_type = id_type;
+	doc->id_hash = id_hash;
+
+	return doc;
+}
+
+/*
+ *	Hand ptr to replica_reclaim(), to be freed once no reader that
+ *	could have seen it is left.
+ */
+static void replica_retire(rlm_mongo_replica_t *replica, void *ptr)
+{
+	rlm_mongo_replica_retired_t *r;
+
+	r = malloc(sizeof(*r));
+	if (!r) {
+		radlog(L_ERR, "rlm_mongo: out of memory");
+		abort();
+	}
+	r->epoch = replica->epoch;
+	r->ptr = ptr;
+	r->next = replica->retired;
+	replica->retired = r;
+}
+
+static void replica_reclaim(rlm_mongo_replica_t *replica)
+{
+	rlm_mongo_replica_retired_t **p, *r;
+	unsigned long min, e;
+	int i;
+
+	min = mongo_atomic_inc(&replica->epoch);
+	for (i = 0; i < REPLICA_READERS; i++) {
+		e = replica->readers[i].epoch;
+		if (e && e < min) {
+			min = e;
+		}
+	}
+
+	for (p = &replica->retired; (r = *p) != NULL; ) {
+		if (r->epoch < min) {
+			*p = r->next;
+			free(r->ptr);
+			free(r);
+		} else {
+			p = &r->next;
+		}
+	}
+}
+
+static rlm_mongo_replica_reader_t *replica_enter(rlm_mongo_replica_t *replica)
+{
+	rlm_mongo_replica_reader_t *reader;
+	unsigned int i = (unsigned int)((unsigned long)pthread_self() >> 8);
+
+	for (;; i++) {
+		reader = &replica->readers[i % REPLICA_READERS];
+		if (!reader->epoch && mongo_atomic_cas(&reader->epoch, 0, replica->epoch)) {
+			return reader;
+		}
+		if (i % REPLICA_READERS == REPLICA_READERS - 1) {
+			sched_yield();
+		}
+	}
+}
+
+static void replica_leave(rlm_mongo_replica_reader_t *reader)
+{
+	mongo_atomic_cas(&reader->epoch, reader->epoch, 0);
+}
+
+/*
+ *	Slots are stored with a barrier, so that a reader following the
+ *	pointer sees the whole document.
+ */
+static void slot_set(rlm_mongo_replica_doc_t **slot, rlm_mongo_replica_doc_t *doc)
+{
+	mongo_atomic_cas(slot, *slot, doc);
+}
+
+static uint32_t doc_hash(const rlm_mongo_replica_doc_t *doc, int by_id)
+{
+	return by_id ? doc->id_hash : doc->hash;
+}
+
+static rlm_mongo_replica_table_t *table_create(uint32_t size)
+{
+	rlm_mongo_replica_table_t *t;
+
+	t = calloc(1, sizeof(*t) + (size - 1) * sizeof(t->slots[0]));
+	if (!t) {
+		radlog(L_ERR, "rlm_mongo: out of memory");
+		abort();
+	}
+	t->size = size;
+	return t;
+}
+
+static rlm_mongo_replica_doc_t **table_slot(rlm_mongo_replica_table_t *t,
+					    const rlm_mongo_replica_doc_t *doc, int by_id)
+{
+	uint32_t i;
+
+	for (i = doc_hash(doc, by_id) & (t->size - 1); t->slots[i]; i = (i + 1) & (t->size - 1)) {
+		if (t->slots[i] == doc) {
+			return &t->slots[i];
+		}
+	}
+	return NULL;
+}
+
+static void table_put(rlm_mongo_replica_table_t *t, rlm_mongo_replica_doc_t *doc, int by_id)
+{
+	uint32_t i;
+
+	for (i = doc_hash(doc, by_id) & (t->size - 1);
+	     t->slots[i] && t->slots[i] != TOMBSTONE;
+	     i = (i + 1) & (t->size - 1));
+
+	if (!t->slots[i]) {
+		t->used++;
+	}
+	t->live++;
+	slot_set(&t->slots[i], doc);
+}
+
+/*
+ *	Add doc, first rebuilding the table if it is three quarters full:
+ *	twice as large, or the same size if that is mostly tombstones. The
+ *	index is rebuilt aside and swapped in, as readers may be probing it.
+ */
+static void table_add(rlm_mongo_replica_t *replica, rlm_mongo_replica_table_t **tp,
+		      rlm_mongo_replica_doc_t *doc, int by_id)
+{
+	rlm_mongo_replica_table_t *t = *tp, *n;
+	uint32_t i;
+
+	if ((t->used + 1) * 4 > t->size * 3) {
+		n = table_create((t->live * 4 < t->size) ? t->size : t->size * 2);
+		for (i = 0; i < t->size; i++) {
+			if (t->slots[i] && t->slots[i] != TOMBSTONE) {
+				table_put(n, t->slots[i], by_id);
+			}
+		}
+		mongo_atomic_cas(tp, t, n);
+		if (by_id) {
+			free(t);
+		} else {
+			replica_retire(replica, t);
+		}
+		t = n;
+	}
+
+	table_put(t, doc, by_id);
+}
+
+static void table_del(rlm_mongo_replica_table_t *t, rlm_mongo_replica_doc_t *doc, int by_id)
+{
+	rlm_mongo_replica_doc_t **slot = table_slot(t, doc, by_id);
+
+	if (slot) {
+		slot_set(slot, TOMBSTONE);
+		t->live--;
+	}
+}
+
+static rlm_mongo_replica_doc_t *ids_find(rlm_mongo_replica_table_t *t, int type,
+					 const char *id, size_t len, uint32_t hash)
+{
+	rlm_mongo_replica_doc_t *doc;
+	uint32_t i;
+
+	for (i = hash & (t->size - 1); (doc = t->slots[i]) != NULL; i = (i + 1) & (t->size - 1)) {
+		if (doc != TOMBSTONE && doc->id_hash == hash && doc->id_type == type &&
+		    doc->id_len == len && memcmp(doc->id, id, len) == 0) {
+			return doc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ *	Make b the document with _id id, or remove that document if b is
+ *	NULL. A document whose user doesn't change is swapped in its slot,
+ *	so that readers never miss it.
+ */
+static void replica_update(rlm_mongo_replica_t *replica, rlm_mongo_replica_table_t **index,
+			   rlm_mongo_replica_table_t **ids, const bson_iterator *id, const bson *b)
+{
+	rlm_mongo_replica_doc_t *doc = NULL, *old;
+	const char *id_value;
+	size_t id_len;
+	uint32_t id_hash;
+	int id_type;
+
+	replica_id(id, &id_value, &id_len, &id_type, &id_hash);
+	old = ids_find(*ids, id_type, id_value, id_len, id_hash);
+
+	if (b) {
+		doc = replica_doc_create(replica, b);
+	}
+
+	if (doc && old && doc->hash == old->hash && doc->user_len == old->user_len &&
+	    memcmp(doc->user, old->user, doc->user_len) == 0) {
+		slot_set(table_slot(*index, old, 0), doc);
+		slot_set(table_slot(*ids, old, 1), doc);
+	} else {
+		if (doc) {
+			table_add(replica, index, doc, 0);
+		}
+		if (old) {
+			table_del(*index, old, 0);
+			table_del(*ids, old, 1);
+		}
+		if (doc) {
+			table_add(replica, ids, doc, 1);
+		}
+	}
+
+	if (old) {
+		replica_retire(replica, old);
+	}
+}
+
+/*
+ *	Copy the document of user (and mac) into buf. Returns 1 if found, 0
+ *	if there is no such user, and -1 if the replica can't answer: not
+ *	loaded, not following the oplog, or the document doesn't fit.
+ */
+int rlm_mongo_replica_find(rlm_mongo_replica_t *replica, const char *user, const char *mac,
+			   char *buf, size_t size)
+{
+	rlm_mongo_replica_reader_t *reader;
+	rlm_mongo_replica_table_t *t;
+	rlm_mongo_replica_doc_t *doc;
+	size_t len = strlen(user);
+	uint32_t hash = fr_hash(user, len);
+	uint32_t i;
+	int res = 0;
+
+	if (!replica->ready) {
+		return -1;
+	}
+
+	reader = replica_enter(replica);
+	t = replica->index;
+	for (i = hash & (t->size - 1); (doc = t->slots[i]) != NULL; i = (i + 1) & (t->size - 1)) {
+		if (doc == TOMBSTONE || doc->hash != hash || doc->user_len != len ||
+		    memcmp(doc->user, user, len) != 0) {
+			continue;
+		}
+		if (replica->mac_field[0] && !replica_match(doc->data, replica->mac_field, mac)) {
+			continue;
+		}
+		if (replica->enable_field[0] && !replica_match(doc->data, replica->enable_field, NULL)) {
+			continue;
+		}
+
+		if ((size_t)doc->size > size) {
+			res = -1;
+		} else {
+			memcpy(buf, doc->data, doc->size);
+			res = 1;
+		}
+		break;
+	}
+	replica_leave(reader);
+
+	return res;
+}
+
+static int replica_ts_cmp(const bson_timestamp_t *a, const bson_timestamp_t *b)
+{
+	if (a->t != b->t) {
+		return ((unsigned int)a->t < (unsigned int)b->t) ? -1 : 1;
+	}
+	if (a->i != b->i) {
+		return ((unsigned int)a->i < (unsigned int)b->i) ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ *	Read the ts of the oldest (dir 1) or newest (dir -1) oplog entry.
+ */
+static int replica_oplog_edge(mongo *conn, int dir, bson_timestamp_t *ts)
+{
+	bson query, fields, out;
+	bson_iterator it;
+	int res = -1;
+
+	bson_init(&query);
+	bson_append_start_object(&query, "$query");
+	bson_append_finish_object(&query);
+	bson_append_start_object(&query, "$orderby");
+	bson_append_int(&query, "$natural", dir);
+	bson_append_finish_object(&query);
+	bson_finish(&query);
+
+	bson_init(&fields);
+	bson_append_int(&fields, "ts", 1);
+	bson_finish(&fields);
+
+	if (mongo_find_one(conn, REPLICA_OPLOG, &query, &fields, &out) == MONGO_OK) {
+		if (bson_find(&it, &out, "ts") == BSON_TIMESTAMP) {
+			*ts = bson_iterator_timestamp(&it);
+			res = 0;
+		}
+		bson_destroy(&out);
+	}
+	bson_destroy(&fields);
+	bson_destroy(&query);
+
+	return res;
+}
+
+/*
+ *	Fetch what authorize fetches (fields, see mongo_prepare_query()),
+ *	plus what the replica matches documents on. _id is always there.
+ */
+static void replica_fields(rlm_mongo_replica_t *replica, const bson *fields)
+{
+	const char *match[3];
+	const char *key;
+	bson_iterator it;
+	int i, n = 0;
+
+	match[n++] = replica->search_field;
+	if (replica->mac_field[0]) {
+		match[n++] = replica->mac_field;
+	}
+	if (replica->enable_field[0]) {
+		match[n++] = replica->enable_field;
+	}
+
+	bson_init(&replica->fields);
+	for (i = 0; i < n; i++) {
+		bson_append_int(&replica->fields, match[i], 1);
+	}
+	bson_iterator_init(&it, fields);
+	while (bson_iterator_next(&it)) {
+		key = bson_iterator_key(&it);
+		if (!bson_iterator_int(&it) || strcmp(key, "_id") == 0) {
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			if (strcmp(key, match[i]) == 0) {
+				break;
+			}
+		}
+		if (i == n) {
+			bson_append_int(&replica->fields, key, 1);
+		}
+	}
+	bson_finish(&replica->fields);
+	replica->has_fields = 1;
+}
+
+/*
+ *	Is the top level field key, or part of it, in the projection?
+ */
+static int replica_projected(rlm_mongo_replica_t *replica, const char *key)
+{
+	bson_iterator it;
+	const char *name;
+	size_t len = strlen(key);
+
+	if (strcmp(key, "_id") == 0) {
+		return 1;
+	}
+	bson_iterator_init(&it, &replica->fields);
+	while (bson_iterator_next(&it)) {
+		name = bson_iterator_key(&it);
+		if (strncmp(name, key, len) == 0 && (name[len] == '\0' || name[len] == '.')) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ *	Oplog inserts carry the whole document: keep what the projection
+ *	asks for, subdocuments it only wants part of included.
+ */
+static void replica_strip(rlm_mongo_replica_t *replica, const bson *doc, bson *out)
+{
+	bson_iterator it;
+
+	bson_init(out);
+	bson_iterator_init(&it, doc);
+	while (bson_iterator_next(&it)) {
+		if (replica_projected(replica, bson_iterator_key(&it))) {
+			bson_append_element(out, NULL, &it);
+		}
+	}
+	bson_finish(out);
+}
+
+static int replica_scan(const bson *doc, void *arg)
+{
+	rlm_mongo_replica_t *replica = arg;
+	bson_iterator it;
+
+	if (replica->stop) {
+		return MONGO_ERROR;
+	}
+
+	if (bson_find(&it, doc, "_id") != BSON_EOO) {
+		pthread_mutex_lock(&replica->load_mutex);
+		replica_update(replica, &replica->load_index, &replica->load_ids, &it, doc);
+		pthread_mutex_unlock(&replica->load_mutex);
+	}
+	return MONGO_OK;
+}
+
+static void replica_tables_free(rlm_mongo_replica_table_t *index, rlm_mongo_replica_table_t *ids)
+{
+	uint32_t i;
+
+	if (ids) {
+		for (i = 0; i < ids->size; i++) {
+			if (ids->slots[i] && ids->slots[i] != TOMBSTONE) {
+				free(ids->slots[i]);
+			}
+		}
+	}
+	free(ids);
+	free(index);
+}
+
+/*
+ *	Copy the whole collection. The oplog position is taken first, so
+ *	that replaying from it covers whatever changed during the scan.
+ */
+static int replica_load(rlm_mongo_replica_t *replica)
+{
+	rlm_mongo_replica_table_t *old_index = replica->index;
+	rlm_mongo_replica_table_t *old_ids = replica->ids;
+	bson_timestamp_t ts;
+	uint32_t i;
+
+	if (replica_oplog_edge(&replica->conn, -1, &ts) < 0) {
+		if (!replica->warned) {
+			radlog(L_ERR, "rlm_mongo: can't read %s, replica disabled until it can", REPLICA_OPLOG);
+			replica->warned = 1;
+		}
+		return -1;
+	}
+
+	replica->load_index = table_create(REPLICA_INITIAL_SLOTS);
+	replica->load_ids = table_create(REPLICA_INITIAL_SLOTS);
+
+	if (mongo_parallel_scan(replica->pool, replica->ns, "_id", NULL,
+				replica->has_fields ? &replica->fields : NULL, replica->partitions,
+				replica_scan, replica) != MONGO_OK) {
+		replica_reclaim(replica);
+		replica_tables_free(replica->load_index, replica->load_ids);
+		return -1;
+	}
+
+	mongo_atomic_cas(&replica->index, old_index, replica->load_index);
+	replica->ids = replica->load_ids;
+	replica->last = ts;
+	replica->warned = 0;
+
+	if (old_index) {
+		replica_retire(replica, old_index);
+		for (i = 0; i < old_ids->size; i++) {
+			if (old_ids->slots[i] && old_ids->slots[i] != TOMBSTONE) {
+				replica_retire(replica, old_ids->slots[i]);
+			}
+		}
+		free(old_ids);
+	}
+	replica_reclaim(replica);
+
+	DEBUG2("rlm_mongo: %u users loaded from %s", replica->ids->live, replica->ns);
+	return 0;
+}
+
+/*
+ *	Apply one oplog entry. Updates may only carry modifiers, so the
+ *	document is read again. Returns -1 if the collection has to be
+ *	loaded again.
+ */
+static int replica_apply(rlm_mongo_replica_t *replica, const bson *entry)
+{
+	bson_iterator it, id;
+	bson o, query, doc, stripped;
+	const char *op, *coll;
+
+	if (bson_find(&it, entry, "op") != BSON_STRING) {
+		return 0;
+	}
+	op = bson_iterator_string(&it);
+
+	if (bson_find(&it, entry, "o") != BSON_OBJECT) {
+		return 0;
+	}
+	bson_iterator_subobject(&it, &o);
+
+	switch (op[0]) {
+		case 'i':
+			if (bson_find(&id, &o, "_id") == BSON_EOO) {
+				break;
+			}
+			if (replica->has_fields) {
+				replica_strip(replica, &o, &stripped);
+				bson_find(&id, &stripped, "_id");
+				replica_update(replica, &replica->index, &replica->ids, &id, &stripped);
+				bson_destroy(&stripped);
+			} else {
+				replica_update(replica, &replica->index, &replica->ids, &id, &o);
+			}
+			break;
+
+		case 'd':
+			if (bson_find(&id, &o, "_id") != BSON_EOO) {
+				replica_update(replica, &replica->index, &replica->ids, &id, NULL);
+			}
+			break;
+
+		case 'u':
+			if (bson_find(&it, entry, "o2") != BSON_OBJECT) {
+				break;
+			}
+			bson_iterator_subobject(&it, &o);
+			if (bson_find(&id, &o, "_id") == BSON_EOO) {
+				break;
+			}
+
+			bson_init(&query);
+			bson_append_element(&query, NULL, &id);
+			bson_finish(&query);
+			if (mongo_find_one(&replica->conn, replica->ns, &query,
+					   replica->has_fields ? &replica->fields : NULL, &doc) == MONGO_OK) {
+				replica_update(replica, &replica->index, &replica->ids, &id, &doc);
+				bson_destroy(&doc);
+			} else if (replica->conn.err == MONGO_CONN_SUCCESS) {
+				replica_update(replica, &replica->index, &replica->ids, &id, NULL);
+			}
+			bson_destroy(&query);
+			break;
+
+		case 'c':
+			/* Commands: only those replacing the collection matter */
+			coll = strchr(replica->ns, '.') + 1;
+			if (bson_find(&it, entry, "ns") == BSON_STRING &&
+			    strcmp(bson_iterator_string(&it), replica->cmd_ns) == 0) {
+				if (bson_find(&it, &o, "dropDatabase") != BSON_EOO) {
+					return -1;
+				}
+				if (bson_find(&it, &o, "drop") == BSON_STRING &&
+				    strcmp(bson_iterator_string(&it), coll) == 0) {
+					return -1;
+				}
+			}
+			if ((bson_find(&it, &o, "renameCollection") == BSON_STRING &&
+			     strcmp(bson_iterator_string(&it), replica->ns) == 0) ||
+			    (bson_find(&it, &o, "to") == BSON_STRING &&
+			     strcmp(bson_iterator_string(&it), replica->ns) == 0)) {
+				return -1;
+			}
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ *	Sleep up to a second, or until rlm_mongo_replica_free() wakes us.
+ */
+static void replica_sleep(rlm_mongo_replica_t *replica)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&replica->mutex);
+	ts.tv_sec = time(NULL) + 1;
+	ts.tv_nsec = 0;
+	if (!replica->stop) {
+		pthread_cond_timedwait(&replica->cond, &replica->mutex, &ts);
+	}
+	pthread_mutex_unlock(&replica->mutex);
+}
+
+/*
+ *	Load the collection, then follow the oplog from where the load
+ *	started. The replica only answers while it is following the oplog;
+ *	if it fell behind the oldest entry, it is loaded again.
+ */
+static void *replica_thread(void *arg)
+{
+	rlm_mongo_replica_t *replica = arg;
+	mongo *conn = &replica->conn;
+	mongo_cursor cursor;
+	bson query;
+	bson_iterator it;
+	bson_timestamp_t oldest, newest;
+	int loaded = 0;
+	int applied;
+
+	while (!replica->stop) {
+		if (!conn->connected && mongo_reconnect(conn) != MONGO_OK) {
+			replica->ready = 0;
+			replica_sleep(replica);
+			continue;
+		}
+
+		if (loaded && (replica_oplog_edge(conn, 1, &oldest) < 0 ||
+			       replica_ts_cmp(&oldest, &replica->last) > 0)) {
+			radlog(L_INFO, "rlm_mongo: replica fell behind the oplog, loading it again");
+			loaded = 0;
+		}
+		if (!loaded) {
+			replica->ready = 0;
+			if (conn->err != MONGO_CONN_SUCCESS || replica_load(replica) < 0) {
+				mongo_disconnect(conn);
+				replica_sleep(replica);
+				continue;
+			}
+			loaded = 1;
+		}
+
+		/* Caught up once past this, even if the oplog is never idle */
+		if (replica_oplog_edge(conn, -1, &newest) < 0) {
+			newest = replica->last;
+		}
+		if (replica_ts_cmp(&replica->last, &newest) >= 0) {
+			replica->ready = 1;
+		}
+
+		bson_init(&query);
+		bson_append_start_object(&query, "ts");
+		bson_append_timestamp(&query, "$gt", &replica->last);
+		bson_append_finish_object(&query);
+		bson_append_start_object(&query, "ns");
+		bson_append_start_array(&query, "$in");
+		bson_append_string(&query, "0", replica->ns);
+		bson_append_string(&query, "1", replica->cmd_ns);
+		bson_append_string(&query, "2", replica->admin_ns);
+		bson_append_finish_array(&query);
+		bson_append_finish_object(&query);
+		bson_finish(&query);
+
+		mongo_cursor_init(&cursor, conn, REPLICA_OPLOG);
+		mongo_cursor_set_query(&cursor, &query);
+		mongo_cursor_set_options(&cursor, MONGO_TAILABLE | MONGO_AWAIT_DATA | MONGO_OPLOG_REPLAY);
+
+		applied = 0;
+		while (!replica->stop) {
+			cursor.err = MONGO_CONN_SUCCESS;
+			if (mongo_cursor_next(&cursor) == MONGO_OK) {
+				if (replica_apply(replica, &cursor.current) < 0) {
+					loaded = 0;
+					break;
+				}
+				if (bson_find(&it, &cursor.current, "ts") == BSON_TIMESTAMP) {
+					replica->last = bson_iterator_timestamp(&it);
+					if (replica_ts_cmp(&replica->last, &newest) >= 0) {
+						replica->ready = 1;
+					}
+				}
+				if (++applied % REPLICA_RECLAIM == 0) {
+					replica_reclaim(replica);
+				}
+			} else if (cursor.err == MONGO_CURSOR_PENDING && conn->err == MONGO_CONN_SUCCESS) {
+				replica->ready = 1;
+				replica_reclaim(replica);
+			} else {
+				break;
+			}
+		}
+		mongo_cursor_destroy(&cursor);
+		bson_destroy(&query);
+		replica_reclaim(replica);
+
+		if (conn->err != MONGO_CONN_SUCCESS) {
+			replica->ready = 0;
+			mongo_disconnect(conn);
+		}
+		replica_sleep(replica);
+	}
+
+	return NULL;
+}
+
+/*
+ *	Copy the collection ns into memory with a scan over pool, and keep
+ *	it current by following the oplog of host, which must be a replica
+ *	set member. Only the fields projection names are kept, or whole
+ *	documents if it is NULL.
+ */
+rlm_mongo_replica_t *rlm_mongo_replica_create(mongo_pool *pool, int partitions,
+					      const char *host, int port,
+					      const mongo_credentials *cred, const char *ns,
+					      const char *search_field, const char *mac_field,
+					      const char *enable_field, const bson *fields)
+{
+	rlm_mongo_replica_t *replica;
+	const char *dot = strchr(ns, '.');
+	mongo *conn;
+
+	if (!dot) {
+		radlog(L_ERR, "rlm_mongo: invalid base \"%s\"", ns);
+		return NULL;
+	}
+
+	replica = rad_malloc(sizeof(*replica));
+	memset(replica, 0, sizeof(*replica));
+	replica->epoch = 1;
+	replica->pool = pool;
+	replica->partitions = partitions;
+	replica->ns = strdup(ns);
+	replica->cmd_ns = malloc(dot - ns + sizeof(".$cmd"));
+	sprintf(replica->cmd_ns, "%.*s.$cmd", (int)(dot - ns), ns);
+	replica->admin_ns = strdup("admin.$cmd");
+	replica->search_field = strdup(search_field);
+	replica->mac_field = strdup(mac_field);
+	replica->enable_field = strdup(enable_field);
+	if (fields) {
+		replica_fields(replica, fields);
+	}
+	pthread_mutex_init(&replica->load_mutex, NULL);
+	pthread_mutex_init(&replica->mutex, NULL);
+	pthread_cond_init(&replica->cond, NULL);
+
+	conn = &replica->conn;
+	mongo_init(conn);
+	conn->primary = bson_malloc(sizeof(mongo_host_port));
+	snprintf(conn->primary->host, sizeof(conn->primary->host), "%s", host);
+	conn->primary->port = port;
+	conn->primary->next = NULL;
+	mongo_set_credentials(conn, cred);
+
+	if (pthread_create(&replica->thread, NULL, replica_thread, replica) != 0) {
+		radlog(L_ERR, "rlm_mongo: can't start the replica thread");
+		replica->stop = 1;
+		rlm_mongo_replica_free(replica);
+		return NULL;
+	}
+
+	return replica;
+}
+
+void rlm_mongo_replica_free(rlm_mongo_replica_t *replica)
+{
+	if (!replica) {
+		return;
+	}
+
+	/* The thread is most likely blocked in an awaitData read */
+	pthread_mutex_lock(&replica->mutex);
+	if (!replica->stop) {
+		replica->stop = 1;
+		if (replica->conn.connected) {
+			shutdown(replica->conn.sock, SHUT_RDWR);
+		}
+		pthread_cond_signal(&replica->cond);
+		pthread_mutex_unlock(&replica->mutex);
+		pthread_join(replica->thread, NULL);
+	} else {
+		pthread_mutex_unlock(&replica->mutex);
+	}
+	mongo_destroy(&replica->conn);
+
+	/* No reader is left, so everything retired can go */
+	replica->ready = 0;
+	replica_reclaim(replica);
+	replica_tables_free(replica->index, replica->ids);
+
+	free(replica->ns);
+	free(replica->cmd_ns);
+	free(replica->admin_ns);
+	free(replica->search_field);
+	free(replica->mac_field);
+	free(replica->enable_field);
+	if (replica->has_fields) {
+		bson_destroy(&replica->fields);
+	}
+	pthread_cond_destroy(&replica->cond);
+	pthread_mutex_destroy(&replica->mutex);
+	pthread_mutex_destroy(&replica->load_mutex);
+	free(replica);
+}